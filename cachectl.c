@@ -0,0 +1,306 @@
+/*
+ * This program holds the rules which add Cache-Control and Expires
+ * headers to responses. They are read once at startup from the
+ * file given by -r, one rule per line:
+ *
+ *	prefix	/assets/	public max-age=31536000 immutable
+ *	glob	*.html		no-cache
+ *	type	image/png	max-age=86400
+ *
+ * A prefix matches the start of the request path, a glob the whole
+ * path as fnmatch(3) does, and a type the Content-Type of the
+ * response, exactly or up to a trailing "*". The rest of the line
+ * is the value of Cache-Control; with max-age, Expires is sent as
+ * well. The first rule of the file which matches is used.
+ *
+ * The rules are compiled into tries of path prefixes, of reversed
+ * path suffixes for globs such as "*.css", and of types, so finding
+ * the rule of a response is one walk over its path and its type.
+ * Only other globs are tried one by one.
+ */
+#include <sys/types.h>
+
+#ifdef _LINUX_
+#include <bsd/stdlib.h>
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "macros.h"
+#include "http.h"
+#include "cachectl.h"
+
+/*
+ * node
+ * One byte of the keys of a trie. prefix is the first rule for
+ * every string which starts with the key up to here, exact the
+ * first rule for that key alone, -1 if there is none.
+ */
+struct node {
+	int c;
+	int prefix;
+	int exact;
+	struct node *child;
+	struct node *sibling;
+};
+
+static void parse_rule(char *, int, char *, char *, char *);
+static char *parse_directives(char *, int, char *, long *);
+static void insert(struct node *, char *, size_t, int, BOOL, int);
+static int walk(struct node *, char *, size_t, int);
+static BOOL has_wildcard(char *);
+static void load_error(char *, int, char *);
+
+/* directives without and with a number of seconds */
+static char *flags[] = {
+	"public", "private", "no-cache", "no-store", "no-transform",
+	"must-revalidate", "proxy-revalidate", "immutable", NULL
+};
+static char *durations[] = {
+	"max-age", "s-maxage", "stale-while-revalidate", "stale-if-error",
+	NULL
+};
+
+static struct cache_rule rules[CACHECTL_RULES_MAX];
+static int nrules;
+
+static struct node prefixes = { 0, -1, -1, NULL, NULL };
+static struct node suffixes = { 0, -1, -1, NULL, NULL };
+static struct node types = { 0, -1, -1, NULL, NULL };
+
+/* globs which are not a plain suffix, in the order of the file */
+static char *globs[CACHECTL_RULES_MAX];
+static int glob_rules[CACHECTL_RULES_MAX];
+static int nglobs;
+
+/* This function reads the rule file and exits if it's not valid. */
+void
+cachectl_load(char *file)
+{
+	FILE *fp;
+	char line[CACHECTL_LINE_MAX];
+	char *kind, *pattern, *p, *last;
+	int lineno;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		(void)fprintf(stderr, "%s: %s: %s\n", getprogname(), file,
+		              strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (lineno = 1; fgets(line, sizeof(line), fp) != NULL; lineno++) {
+		if (strchr(line, '\n') == NULL && !feof(fp))
+			load_error(file, lineno, "line too long");
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+
+		if ((kind = strtok_r(line, " \t\r\n", &last)) == NULL)
+			continue;
+		if ((pattern = strtok_r(NULL, " \t\r\n", &last)) == NULL)
+			load_error(file, lineno, "missing pattern");
+		if (nrules == CACHECTL_RULES_MAX)
+			load_error(file, lineno, "too many rules");
+		parse_rule(file, lineno, kind, pattern, last);
+	}
+
+	(void)fclose(fp);
+}
+
+/*
+ * This function returns the first rule for a response to the
+ * request path uri with the given Content-Type, or NULL. The path
+ * is the decoded one, without the query string.
+ */
+struct cache_rule *
+cachectl_match(char *uri, char *type)
+{
+	char path[HTTP_REQUEST_MAX_LENGTH];
+	size_t len;
+	int best, i;
+
+	if (nrules == 0)
+		return NULL;
+
+	len = strlen(uri);
+	best = walk(&prefixes, uri, len, 1);
+	if (len > 0 && (i = walk(&suffixes, uri + len - 1, len, -1)) < best)
+		best = i;
+	if ((i = walk(&types, type, strlen(type), 1)) < best)
+		best = i;
+
+	if (nglobs > 0 && glob_rules[0] < best && len < sizeof(path)) {
+		(void)memcpy(path, uri, len);
+		path[len] = '\0';
+		for (i = 0; i < nglobs && glob_rules[i] < best; i++)
+			if (fnmatch(globs[i], path, 0) == 0)
+				best = glob_rules[i];
+	}
+
+	return best < nrules ? &rules[best] : NULL;
+}
+
+static void
+parse_rule(char *file, int lineno, char *kind, char *pattern, char *rest)
+{
+	struct cache_rule *rule;
+	size_t len;
+
+	rule = &rules[nrules];
+	rule->index = nrules;
+	rule->value = parse_directives(file, lineno, rest, &rule->max_age);
+
+	len = strlen(pattern);
+	if (strcmp(kind, "prefix") == 0)
+		insert(&prefixes, pattern, len, 1, FALSE, nrules);
+	else if (strcmp(kind, "type") == 0 && pattern[len - 1] == '*')
+		insert(&types, pattern, len - 1, 1, FALSE, nrules);
+	else if (strcmp(kind, "type") == 0)
+		insert(&types, pattern, len, 1, TRUE, nrules);
+	else if (strcmp(kind, "glob") == 0 && !has_wildcard(pattern))
+		insert(&prefixes, pattern, len, 1, TRUE, nrules);
+	else if (strcmp(kind, "glob") == 0 && pattern[0] == '*' &&
+	         !has_wildcard(pattern + 1))
+		insert(&suffixes, pattern + len - 1, len - 1, -1, FALSE, nrules);
+	else if (strcmp(kind, "glob") == 0) {
+		MALLOC(globs[nglobs], char, len + 1);
+		(void)strcpy(globs[nglobs], pattern);
+		glob_rules[nglobs++] = nrules;
+	} else
+		load_error(file, lineno, "unknown kind of rule");
+
+	nrules++;
+}
+
+/*
+ * Check the directives of a rule and join them to the value of
+ * Cache-Control. The seconds of max-age are stored in max_age,
+ * -1 if there is none.
+ */
+static char *
+parse_directives(char *file, int lineno, char *rest, long *max_age)
+{
+	char value[CACHECTL_LINE_MAX * 2];
+	char *token, *seconds, *last, *p;
+	size_t len;
+	int i;
+
+	*max_age = -1;
+	value[0] = '\0';
+	for (token = strtok_r(rest, " \t\r\n", &last); token != NULL;
+	     token = strtok_r(NULL, " \t\r\n", &last)) {
+		if ((seconds = strchr(token, '=')) != NULL) {
+			*seconds++ = '\0';
+			for (i = 0; durations[i] != NULL; i++)
+				if (strcasecmp(token, durations[i]) == 0)
+					break;
+			if (durations[i] == NULL)
+				load_error(file, lineno, "unknown directive");
+			len = strlen(seconds);
+			if (len == 0 || len > 10)
+				load_error(file, lineno, "invalid number of seconds");
+			for (p = seconds; *p != '\0'; p++)
+				if (!isdigit((unsigned char)*p))
+					load_error(file, lineno,
+					           "invalid number of seconds");
+			if (strcasecmp(token, "max-age") == 0)
+				*max_age = strtol(seconds, NULL, 10);
+			seconds[-1] = '=';
+		} else {
+			for (i = 0; flags[i] != NULL; i++)
+				if (strcasecmp(token, flags[i]) == 0)
+					break;
+			if (flags[i] == NULL)
+				load_error(file, lineno, "unknown directive");
+		}
+
+		if (value[0] != '\0')
+			(void)strcat(value, ", ");
+		(void)strcat(value, token);
+	}
+	if (value[0] == '\0')
+		load_error(file, lineno, "missing directives");
+
+	MALLOC(p, char, strlen(value) + 1);
+	(void)strcpy(p, value);
+	return p;
+}
+
+/*
+ * Add the len bytes of key to a trie, read from key on with the
+ * given step, so a suffix is added backwards. An earlier rule for
+ * the same key stays in place.
+ */
+static void
+insert(struct node *n, char *key, size_t len, int step, BOOL exact, int rule)
+{
+	struct node *child;
+	size_t i;
+
+	for (i = 0; i < len; i++, key += step) {
+		for (child = n->child; child != NULL; child = child->sibling)
+			if (child->c == (unsigned char)*key)
+				break;
+		if (child == NULL) {
+			MALLOC(child, struct node, 1);
+			child->c = (unsigned char)*key;
+			child->prefix = -1;
+			child->exact = -1;
+			child->child = NULL;
+			child->sibling = n->child;
+			n->child = child;
+		}
+		n = child;
+	}
+
+	if (exact && n->exact == -1)
+		n->exact = rule;
+	else if (!exact && n->prefix == -1)
+		n->prefix = rule;
+}
+
+/*
+ * Return the first rule of the trie for len bytes of s, read with
+ * the given step, or nrules if there is none.
+ */
+static int
+walk(struct node *n, char *s, size_t len, int step)
+{
+	size_t i;
+	int best;
+
+	best = nrules;
+	for (i = 0; n != NULL; i++, s += step) {
+		if (n->prefix != -1 && n->prefix < best)
+			best = n->prefix;
+		if (i == len) {
+			if (n->exact != -1 && n->exact < best)
+				best = n->exact;
+			break;
+		}
+		for (n = n->child; n != NULL; n = n->sibling)
+			if (n->c == (unsigned char)*s)
+				break;
+	}
+	return best;
+}
+
+static BOOL
+has_wildcard(char *pattern)
+{
+	return strpbrk(pattern, "*?[\\") != NULL;
+}
+
+static void
+load_error(char *file, int lineno, char *msg)
+{
+	(void)fprintf(stderr, "%s: %s:%d: %s\n", getprogname(), file, lineno,
+	              msg);
+	exit(EXIT_FAILURE);
+}
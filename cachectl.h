@@ -0,0 +1,13 @@
+#ifndef _CACHECTL_H_
+#define _CACHECTL_H_
+
+/* rules read from the file given by -r at most */
+#define CACHECTL_RULES_MAX	1024
+
+/* longest line of the rule file */
+#define CACHECTL_LINE_MAX	1024
+
+void cachectl_load(char *);
+struct cache_rule *cachectl_match(char *, char *);
+
+#endif /* !_CACHECTL_H_ */
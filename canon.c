@@ -0,0 +1,222 @@
+/*
+ * This program turns the decoded path of a request into the name
+ * of the file it's served from, in one pass over the path and
+ * without allocating:
+ *
+ *	/a//b/./c/../d		/a/b/d under the content directory
+ *	/~bob/x/../y		/home/bob/sws/y
+ *	/a/../../x		403, it's above the content directory
+ *
+ * The segments are copied into a buffer of the caller, "." and
+ * empty ones are dropped and ".." takes the last one back. The
+ * path is written after room for the root, which is filled in at
+ * the end: the content directory, or /home/<user>/sws when the
+ * first segment is "~<user>", which is decided on the clean path
+ * as a ".." may remove it.
+ *
+ * The roots are opened once, the content directory at startup and
+ * a user directory when it's first asked for, and files are opened
+ * relative to them. On Linux openat2(2) with RESOLVE_BENEATH makes
+ * the kernel walk only the path under the root and refuse to leave
+ * it, by ".." or by a symbolic link; elsewhere, or on a kernel
+ * without it, openat(2) walks the same short path.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _LINUX_
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "macros.h"
+#include "http.h"
+#include "canon.h"
+
+/* the open /home/<user>/sws directories */
+struct userdir {
+	char *name;
+	size_t len;
+	int fd;
+	struct userdir *next;
+};
+
+static int user_root(char *, size_t);
+
+static char *content_root;
+static size_t content_len;
+static int content_fd = -1;
+static struct userdir *userdirs;
+#ifdef _LINUX_
+static BOOL has_openat2 = TRUE;
+#endif
+
+/*
+ * This function opens the content directory root. It returns -1
+ * and sets errno if that fails.
+ */
+int
+canon_init(char *root)
+{
+	content_root = root;
+	content_len = strlen(root);
+	content_fd = canon_root(*root != '\0' ? root : "/");
+	return content_fd;
+}
+
+/* open the directory dir to resolve names beneath it, or -1 */
+int
+canon_root(char *dir)
+{
+	return open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+ * This function opens name beneath the directory dir with flags of
+ * open(2), "" being dir itself. It returns -1 and sets errno if that
+ * fails; EXDEV if name leaves dir.
+ */
+int
+canon_open(int dir, char *name, int flags)
+{
+#ifdef _LINUX_
+	struct open_how how;
+	int fd;
+#endif
+
+	if (*name == '\0')
+		name = ".";
+#ifdef _LINUX_
+	if (has_openat2 == TRUE) {
+		(void)memset(&how, 0, sizeof(how));
+		how.flags = flags;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+		fd = (int)syscall(SYS_openat2, dir, name, &how, sizeof(how));
+		if (fd != -1 || errno != ENOSYS)
+			return fd;
+		has_openat2 = FALSE;
+	}
+#endif
+	return openat(dir, name, flags);
+}
+
+/*
+ * This function writes the file of the request path path to buf,
+ * which has size bytes, and fills cp: the name of the file, the
+ * clean path in buf, or NULL for a user directory, whose path was
+ * replaced, and the open root with the name under it. CANON_TAIL
+ * bytes are left after them to add "/index.html". It returns 0,
+ * Forbidden if a ".." leaves the root, or the status of the error
+ * of a user directory which can't be opened; Not_Found if the name
+ * doesn't fit.
+ */
+int
+canon_path(char *path, char *buf, size_t size, struct canon *cp)
+{
+	size_t room, n, j, k;
+	char *p, *q, *u;
+
+	room = content_len > CANON_USERDIR_GROWTH ?
+	       content_len : CANON_USERDIR_GROWTH;
+	if (room + strlen(path) + CANON_TAIL > size)
+		return Not_Found;
+
+	/* the path has a leading '/', each segment kept ends with one */
+	u = buf + room;
+	u[0] = '/';
+	j = 1;
+	for (p = path + (path[0] == '/'); *p != '\0'; p = q + (*q == '/')) {
+		q = p + strcspn(p, "/");
+		n = (size_t)(q - p);
+		if (n == 0 || (n == 1 && p[0] == '.'))
+			continue;
+		if (n == 2 && p[0] == '.' && p[1] == '.') {
+			if (j == 1)
+				return Forbidden;
+			for (j--; u[j - 1] != '/'; j--)
+				;
+			continue;
+		}
+		(void)memcpy(u + j, p, n + (*q == '/'));
+		j += n + (*q == '/');
+	}
+	u[j] = '\0';
+
+	/* "/~<user>/rest" is /home/<user>/sws/rest, "/~/" isn't */
+	if (j > 2 && u[1] == '~' && u[2] != '/') {
+		for (k = 2; k < j && u[k] != '/'; k++)
+			;
+		(void)memmove(u - 2, u + 2, k - 2);
+		(void)memcpy(u - CANON_USERDIR_GROWTH, "/home/", 6);
+		(void)memcpy(u + k - 4, "/sws", 4);
+		if (k == j) {
+			u[j++] = '/';
+			u[j] = '\0';
+		}
+		cp->file = u - CANON_USERDIR_GROWTH;
+		cp->url = NULL;
+		cp->rel = u + k + 1;
+		if ((cp->dir = user_root(cp->file, k - 2)) != -1)
+			return 0;
+		if (errno == ENOENT)
+			return Not_Found;
+		else if (errno == EACCES)
+			return Forbidden;
+		else
+			return Internal_Server_Error;
+	}
+
+	(void)memcpy(u - content_len, content_root, content_len);
+	cp->file = u - content_len;
+	cp->url = u;
+	cp->dir = content_fd;
+	cp->rel = u + 1;
+	return 0;
+}
+
+/*
+ * The open root of the user whose name of len bytes is in file,
+ * which starts with /home/<user>/sws, or -1 and errno. "." and ".."
+ * aren't users. A directory is kept open once it was opened.
+ */
+static int
+user_root(char *file, size_t len)
+{
+	struct userdir *d;
+	char *name, c;
+	int fd;
+
+	name = file + 6;
+	for (d = userdirs; d != NULL; d = d->next)
+		if (d->len == len && memcmp(d->name, name, len) == 0)
+			return d->fd;
+
+	if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'))) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	c = file[len + 10];
+	file[len + 10] = '\0';
+	fd = canon_root(file);
+	file[len + 10] = c;
+	if (fd == -1)
+		return -1;
+
+	MALLOC(d, struct userdir, 1);
+	MALLOC(d->name, char, len);
+	(void)memcpy(d->name, name, len);
+	d->len = len;
+	d->fd = fd;
+	d->next = userdirs;
+	userdirs = d;
+	return fd;
+}
@@ -0,0 +1,38 @@
+#ifndef _CANON_H_
+#define _CANON_H_
+
+/* bytes "/home/<user>/sws" takes more than "/~<user>" */
+#define CANON_USERDIR_GROWTH	8
+
+/* bytes kept after a path for "/index.html" and its '\0' */
+#define CANON_TAIL		sizeof("/index.html")
+
+/* a buffer for any request path under a root of PATH_MAX bytes */
+#define CANON_SIZE		(PATH_MAX + HTTP_REQUEST_MAX_LENGTH + CANON_TAIL)
+
+/* flags of canon_open() to look at a file without reading it */
+#ifdef _LINUX_
+#define CANON_LOOKUP	O_PATH
+#else
+#define CANON_LOOKUP	(O_RDONLY | O_NONBLOCK)
+#endif
+
+/*
+ * canon
+ * Where the file of a request is: its name from "/", the clean
+ * request path, NULL for a user directory, and the open root dir
+ * with the name rel beneath it, the end of file.
+ */
+struct canon {
+	char *file;
+	char *url;
+	int dir;
+	char *rel;
+};
+
+int canon_init(char *);
+int canon_root(char *);
+int canon_open(int, char *, int);
+int canon_path(char *, char *, size_t, struct canon *);
+
+#endif /* !_CANON_H_ */
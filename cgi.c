@@ -2,12 +2,18 @@
  * This program contains the code to deal with
  * cgi request.
  */
+#ifdef _LINUX_
+#define _GNU_SOURCE	/* O_PATH */
+#endif
+
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
@@ -17,12 +23,13 @@
 #include "jstring.h"
 #include "macros.h"
 #include "http.h"
+#include "canon.h"
 
 #include "cgi.h"
 
 static void alarm_handler(int);
 static int separate_pathinfo(JSTRING *, JSTRING **, JSTRING **);
-static BOOL is_regular_file(char *);
+static BOOL is_regular_file(int, char *);
 static JSTRING *get_parent(JSTRING *);
 
 /* used by alarm_handler() to kill cgi process */
@@ -42,11 +49,11 @@ call_cgi(struct cgi_request *cgi_req,
 {
 	extern pid_t cgi_pid;
 	pid_t pid;
-	char *env_list[11];
+	char *env_list[13];
 	char request_method[5];
     char resp_buf[HTTP_RESPONSE_MAX_LENGTH];
     size_t size;
-	int sep_result;
+	int sep_result, n;
     JSTRING *abs_path, *path_info;
 	
 	JSTRING *cwd;
@@ -60,11 +67,13 @@ call_cgi(struct cgi_request *cgi_req,
 	JSTRING *mv_SERVER_PORT;
 	JSTRING *mv_SERVER_PROTOCOL;
 	JSTRING *mv_SERVER_SOFTWARE;
+	JSTRING *mv_HTTP_HOST;
+	JSTRING *mv_HTTP_USER_AGENT;
 	/* 
 	 * remove /cgi-bin from the uri, then separate
-	 * PATH_INFO and the original uri, and
-	 * convert it to absolute path according
-	 * to cgi_dir.
+	 * PATH_INFO and the original uri, look the program
+	 * up beneath the open cgi directory and convert it
+	 * to absolute path according to cgi_dir.
 	 */
 	jstr_trunc(cgi_req->uri, 8, jstr_length(cgi_req->uri) - 8);
 	
@@ -72,14 +81,12 @@ call_cgi(struct cgi_request *cgi_req,
 	if (sep_result != 0)
 		return sep_result;
 	
-	jstr_insert(abs_path, 0, jstr_cstr(cgi_req->cgi_dir));
-	
 	/* check if file is a regular file */
-	if (is_regular_file(jstr_cstr(abs_path)) == FALSE)
+	if (is_regular_file(cgi_req->cgi_fd, jstr_cstr(abs_path) + 1) == FALSE)
 		return Not_Found;
 	
 	/* check if file is executable */
-	if (access(jstr_cstr(abs_path), X_OK) == -1) {
+	if (faccessat(cgi_req->cgi_fd, jstr_cstr(abs_path) + 1, X_OK, 0) == -1) {
 		if (errno == ENOENT)
 			return Not_Found;
 		else if (errno == EACCES)
@@ -87,6 +94,8 @@ call_cgi(struct cgi_request *cgi_req,
 		else
 			return Internal_Server_Error;
 	}
+	
+	jstr_insert(abs_path, 0, jstr_cstr(cgi_req->cgi_dir));
 		
 	if ((pid = fork()) == -1)
 		return Internal_Server_Error;
@@ -134,15 +143,26 @@ call_cgi(struct cgi_request *cgi_req,
 		mv_SERVER_SOFTWARE = jstr_create("SERVER_SOFTWARE=" HTTP_SERVER_NAME);
 		env_list[8] = jstr_cstr(mv_SERVER_SOFTWARE);
 		
-		if (jstr_length(path_info) == 0)
-			env_list[9] = NULL;
-		else {
+		n = 9;
+		if (jstr_length(path_info) != 0) {
 			mv_PATH_INFO = jstr_create("PATH_INFO=");
 			jstr_concat(mv_PATH_INFO, jstr_cstr(path_info));
-			env_list[9] = jstr_cstr(mv_PATH_INFO);
+			env_list[n++] = jstr_cstr(mv_PATH_INFO);
 		}
 		
-		env_list[10] = NULL;
+		/* header fields of the request as HTTP_ variables */
+		if (cgi_req->host != NULL) {
+			mv_HTTP_HOST = jstr_create("HTTP_HOST=");
+			jstr_concat(mv_HTTP_HOST, cgi_req->host);
+			env_list[n++] = jstr_cstr(mv_HTTP_HOST);
+		}
+		if (cgi_req->user_agent != NULL) {
+			mv_HTTP_USER_AGENT = jstr_create("HTTP_USER_AGENT=");
+			jstr_concat(mv_HTTP_USER_AGENT, cgi_req->user_agent);
+			env_list[n++] = jstr_cstr(mv_HTTP_USER_AGENT);
+		}
+		
+		env_list[n] = NULL;
 		
 		/* send http response header here */
         h_res->last_modified = time(NULL);
@@ -186,16 +206,13 @@ call_cgi(struct cgi_request *cgi_req,
  * This function verify whether the url is a CGI call.
  */
 BOOL
-is_cgi_call(JSTRING *url)
+is_cgi_call(char *url)
 {
-	/* url length must be greater than the length of "/cgi-bin" */
-	if (jstr_length(url) < 8)
-		return FALSE;
-	
-	if (strncmp(jstr_cstr(url), "/cgi-bin", 8) != 0)
+	/* url must start with the segment "/cgi-bin" */
+	if (strncmp(url, "/cgi-bin", 8) != 0)
 		return FALSE;
 
-	if (jstr_length(url) > 8 && jstr_charat(url, 8) != '/')
+	if (url[8] != '\0' && url[8] != '/')
 		return FALSE;
 	
 	return TRUE;
@@ -235,16 +252,19 @@ separate_pathinfo(JSTRING *uri, JSTRING **abs_path, JSTRING **path_info)
 	return 0;
 }
 
+/* name beneath the directory dir is a regular file */
 static BOOL
-is_regular_file(char *path)
+is_regular_file(int dir, char *name)
 {
 	struct stat buf;
+	BOOL ret;
+	int fd;
 	
-	if (stat(path, &buf) != -1 && 
-	    S_ISREG(buf.st_mode))
-		return TRUE;
-	else
+	if ((fd = canon_open(dir, name, CANON_LOOKUP | O_CLOEXEC)) == -1)
 		return FALSE;
+	ret = fstat(fd, &buf) != -1 && S_ISREG(buf.st_mode);
+	(void)close(fd);
+	return ret;
 }
 
 static void 
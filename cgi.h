@@ -1,7 +1,10 @@
 #ifndef _CGI_H_
 #define _CGI_H_
 
+/* seconds, fastcgi-test builds a server with a shorter one */
+#ifndef MAX_CGI_EXEC_TIME
 #define MAX_CGI_EXEC_TIME 60
+#endif
 
 struct cgi_request {
 	int cfd;
@@ -10,12 +13,15 @@ struct cgi_request {
 	char *server_name;
 	char *server_port;
 	JSTRING *cgi_dir;
+	int cgi_fd;            /* cgi_dir, open */
 	JSTRING *uri;
 	JSTRING *query;
+	char *host;            /* of the request, or NULL */
+	char *user_agent;
 };
 
 /* return 0 when succeed, or return http error status code */
 int call_cgi(struct cgi_request *, struct http_response *);
-BOOL is_cgi_call(JSTRING *);
+BOOL is_cgi_call(char *);
 
 #endif /* !_CGI_H_ */
@@ -0,0 +1,407 @@
+/*
+ * This program compresses responses with zlib for clients which
+ * accept gzip or deflate, when -z is given and the file has no
+ * precompressed copy next to it.
+ *
+ * A file is compressed once: the result is kept in a cache of
+ * variants keyed by path, modification time, size and coding,
+ * which holds at most COMPRESS_MAX variants in COMPRESS_MEM bytes
+ * and drops the least recently used ones to make room. A variant
+ * has a known length, so it's sent with Content-Length.
+ *
+ * Generated bodies such as directory indexes are compressed while
+ * they are queued, by a zstream which sends its output in HTTP/1.1
+ * chunks, as the length is known only at the end.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "macros.h"
+#include "http.h"
+#include "fcache.h"
+#include "conn.h"
+#include "compress.h"
+
+/*
+ * zvariant
+ * The compressed content of one file in one coding. data is NULL
+ * if the file didn't get smaller, so it's not tried again.
+ */
+struct zvariant {
+	char *path;
+	time_t mtime;
+	off_t size;
+	int encoding;
+	char *data;
+	size_t len;
+	struct zvariant *hnext;
+	struct zvariant *prev;
+	struct zvariant *next;
+};
+
+struct zstream {
+	z_stream z;
+	struct conn *c;
+	size_t total;
+	char out[COMPRESS_CHUNK];
+};
+
+static struct zvariant *lookup(struct fentry *, int, unsigned);
+static void insert(struct zvariant *, unsigned);
+static void drop(struct zvariant *);
+static char *read_file(struct fentry *);
+static BOOL deflate_all(char *, size_t, int, char **, size_t *);
+static int window_bits(int);
+static void queue_chunk(struct zstream *, size_t);
+static unsigned hash(char *);
+
+/* types of content which get smaller, the prefixes of types */
+static char *types[] = {
+	"text/",
+	"application/json",
+	"application/x-ndjson",
+	"application/javascript",
+	"application/xml",
+	"image/svg+xml",
+	"image/bmp",
+	NULL
+};
+
+static BOOL enabled;
+static struct zvariant *buckets[COMPRESS_BUCKETS];
+static int nvariants;
+static size_t mem_used;
+
+/* all variants, the most recently used first */
+static struct zvariant *variants;
+static struct zvariant *variants_tail;
+
+void
+compress_init(BOOL on)
+{
+	enabled = on;
+}
+
+/*
+ * This function tells if bodies of the given type are compressed
+ * for clients which accept it, so that responses with them vary
+ * by Accept-Encoding, also when they are sent as they are.
+ */
+BOOL
+compress_type(char *type)
+{
+	int i;
+
+	if (!enabled)
+		return FALSE;
+
+	for (i = 0; types[i] != NULL; i++)
+		if (strncmp(type, types[i], strlen(types[i])) == 0)
+			return TRUE;
+	return FALSE;
+}
+
+/*
+ * This function returns the coding a body of the given type is
+ * compressed in for the request, or ENCODING_NONE. gzip wins over
+ * deflate if the client likes both equally.
+ */
+int
+compress_encoding(struct http_request *hr, char *type)
+{
+	if (!compress_type(type))
+		return ENCODING_NONE;
+
+	if (hr->encoding_q[ENCODING_GZIP] > 0 &&
+	    hr->encoding_q[ENCODING_GZIP] >= hr->encoding_q[ENCODING_DEFLATE])
+		return ENCODING_GZIP;
+	if (hr->encoding_q[ENCODING_DEFLATE] > 0)
+		return ENCODING_DEFLATE;
+	return ENCODING_NONE;
+}
+
+/*
+ * This function returns the file of fe compressed in the given
+ * coding and stores its length in len, compressing it if it's not
+ * in the cache yet. It returns NULL if the file is too small or
+ * too large, can't be read or doesn't get smaller. The content is
+ * valid until the next call, the caller has to copy it.
+ */
+char *
+compress_file(struct fentry *fe, int encoding, size_t *len)
+{
+	struct zvariant *v;
+	unsigned h;
+	char *body, *data;
+	BOOL ok;
+
+	if (fe->size < COMPRESS_MIN || fe->size > COMPRESS_FILE_MAX)
+		return NULL;
+
+	h = hash(fe->path) % COMPRESS_BUCKETS;
+	if ((v = lookup(fe, encoding, h)) != NULL) {
+		*len = v->len;
+		return v->data;
+	}
+
+	/* a small file is in memory already */
+	if ((body = fcache_body(fe)) != NULL)
+		ok = deflate_all(body, fe->size, encoding, &data, len);
+	else if ((body = read_file(fe)) != NULL) {
+		ok = deflate_all(body, fe->size, encoding, &data, len);
+		free(body);
+	} else
+		return NULL;
+
+	MALLOC(v, struct zvariant, 1);
+	MALLOC(v->path, char, strlen(fe->path) + 1);
+	(void)strcpy(v->path, fe->path);
+	v->mtime = fe->mtime;
+	v->size = fe->size;
+	v->encoding = encoding;
+	v->data = ok ? data : NULL;
+	v->len = ok ? *len : 0;
+	insert(v, h);
+	return v->data;
+}
+
+/*
+ * This function starts compressing a body into the queue of c,
+ * in chunks of the chunked transfer coding.
+ */
+struct zstream *
+zstream_open(struct conn *c, int encoding)
+{
+	struct zstream *zs;
+
+	MALLOC(zs, struct zstream, 1);
+	(void)memset(&zs->z, 0, sizeof(zs->z));
+	if (deflateInit2(&zs->z, COMPRESS_LEVEL, Z_DEFLATED,
+	                 window_bits(encoding), 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		(void)fprintf(stderr, "deflateInit2() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	zs->c = c;
+	zs->total = 0;
+	zs->z.next_out = (Bytef *)zs->out;
+	zs->z.avail_out = sizeof(zs->out);
+	return zs;
+}
+
+void
+zstream_write(struct zstream *zs, char *data, size_t len)
+{
+	zs->z.next_in = (Bytef *)data;
+	zs->z.avail_in = len;
+	while (zs->z.avail_in > 0) {
+		(void)deflate(&zs->z, Z_NO_FLUSH);
+		if (zs->z.avail_out == 0)
+			queue_chunk(zs, sizeof(zs->out));
+	}
+}
+
+/*
+ * This function queues the rest of the body and the last chunk,
+ * frees the stream and returns the length of the encoded body.
+ */
+size_t
+zstream_close(struct zstream *zs)
+{
+	size_t total;
+	int ret;
+
+	zs->z.avail_in = 0;
+	do {
+		ret = deflate(&zs->z, Z_FINISH);
+		if (zs->z.avail_out < sizeof(zs->out))
+			queue_chunk(zs, sizeof(zs->out) - zs->z.avail_out);
+	} while (ret == Z_OK);
+	(void)deflateEnd(&zs->z);
+
+	conn_queue(zs->c, "0\r\n\r\n", 5);
+	total = zs->total + 5;
+	free(zs);
+	return total;
+}
+
+static void
+queue_chunk(struct zstream *zs, size_t len)
+{
+	char size[32];
+	int n;
+
+	n = snprintf(size, sizeof(size), "%zx\r\n", len);
+	conn_queue(zs->c, size, n);
+	conn_queue(zs->c, zs->out, len);
+	conn_queue(zs->c, "\r\n", 2);
+	zs->total += n + len + 2;
+
+	zs->z.next_out = (Bytef *)zs->out;
+	zs->z.avail_out = sizeof(zs->out);
+}
+
+/* find the variant of the current version of the file */
+static struct zvariant *
+lookup(struct fentry *fe, int encoding, unsigned h)
+{
+	struct zvariant *v;
+
+	for (v = buckets[h]; v != NULL; v = v->hnext)
+		if (v->encoding == encoding && strcmp(v->path, fe->path) == 0)
+			break;
+	if (v == NULL)
+		return NULL;
+
+	if (v->mtime != fe->mtime || v->size != fe->size) {
+		drop(v);
+		return NULL;
+	}
+
+	if (v != variants) {
+		v->prev->next = v->next;
+		if (v->next != NULL)
+			v->next->prev = v->prev;
+		else
+			variants_tail = v->prev;
+		v->prev = NULL;
+		v->next = variants;
+		variants->prev = v;
+		variants = v;
+	}
+	return v;
+}
+
+/* add a variant, the least recently used ones make room */
+static void
+insert(struct zvariant *v, unsigned h)
+{
+	while (variants_tail != NULL &&
+	       (nvariants == COMPRESS_MAX || mem_used + v->len > COMPRESS_MEM))
+		drop(variants_tail);
+
+	v->hnext = buckets[h];
+	buckets[h] = v;
+	v->prev = NULL;
+	v->next = variants;
+	if (variants != NULL)
+		variants->prev = v;
+	else
+		variants_tail = v;
+	variants = v;
+	nvariants++;
+	mem_used += v->len;
+}
+
+static void
+drop(struct zvariant *v)
+{
+	struct zvariant **pp;
+
+	for (pp = &buckets[hash(v->path) % COMPRESS_BUCKETS]; *pp != v;
+	     pp = &(*pp)->hnext)
+		;
+	*pp = v->hnext;
+
+	if (v->prev != NULL)
+		v->prev->next = v->next;
+	else
+		variants = v->next;
+	if (v->next != NULL)
+		v->next->prev = v->prev;
+	else
+		variants_tail = v->prev;
+
+	nvariants--;
+	mem_used -= v->len;
+	free(v->data);
+	free(v->path);
+	free(v);
+}
+
+/* read a file which is not kept in memory by the file cache */
+static char *
+read_file(struct fentry *fe)
+{
+	char *buf;
+	ssize_t count;
+	off_t offset;
+
+	if (fcache_open(fe) == -1)
+		return NULL;
+
+	MALLOC(buf, char, fe->size);
+	for (offset = 0; offset < fe->size; offset += count) {
+		count = pread(fe->fd, buf + offset, fe->size - offset, offset);
+		if (count == -1 && errno == EINTR)
+			count = 0;
+		else if (count <= 0) {
+			free(buf);
+			return NULL;
+		}
+	}
+	return buf;
+}
+
+/*
+ * Compress len bytes of data into a new buffer. Return FALSE if
+ * the result isn't smaller than the data.
+ */
+static BOOL
+deflate_all(char *data, size_t len, int encoding, char **out, size_t *outlen)
+{
+	z_stream z;
+	char *buf;
+	size_t bound;
+
+	(void)memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, COMPRESS_LEVEL, Z_DEFLATED, window_bits(encoding),
+	                 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return FALSE;
+
+	bound = deflateBound(&z, len);
+	MALLOC(buf, char, bound);
+	z.next_in = (Bytef *)data;
+	z.avail_in = len;
+	z.next_out = (Bytef *)buf;
+	z.avail_out = bound;
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END || z.total_out >= len) {
+		(void)deflateEnd(&z);
+		free(buf);
+		return FALSE;
+	}
+
+	*outlen = z.total_out;
+	(void)deflateEnd(&z);
+	*out = buf;
+	return TRUE;
+}
+
+/* gzip has a header of its own, deflate is the zlib format */
+static int
+window_bits(int encoding)
+{
+	return encoding == ENCODING_GZIP ? 15 + 16 : 15;
+}
+
+/* FNV-1a */
+static unsigned
+hash(char *s)
+{
+	unsigned h;
+
+	for (h = 2166136261U; *s != '\0'; s++)
+		h = (h ^ (unsigned char)*s) * 16777619U;
+	return h;
+}
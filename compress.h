@@ -0,0 +1,30 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+/* bodies shorter than this are not worth compressing */
+#define COMPRESS_MIN		256
+
+/* larger files are always sent as they are */
+#define COMPRESS_FILE_MAX	(1024 * 1024)
+
+/* compressed variants of files kept at most, and their memory */
+#define COMPRESS_MAX		256
+#define COMPRESS_BUCKETS	512
+#define COMPRESS_MEM		(16 * 1024 * 1024)
+
+#define COMPRESS_LEVEL		6
+
+/* output of a stream is queued in chunks of this size at most */
+#define COMPRESS_CHUNK		16384
+
+struct zstream;
+
+void compress_init(BOOL);
+BOOL compress_type(char *);
+int compress_encoding(struct http_request *, char *);
+char *compress_file(struct fentry *, int, size_t *);
+struct zstream *zstream_open(struct conn *, int);
+void zstream_write(struct zstream *, char *, size_t);
+size_t zstream_close(struct zstream *);
+
+#endif /* !_COMPRESS_H_ */
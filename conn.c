@@ -0,0 +1,714 @@
+/*
+ * This program contains the connection buffering used by
+ * all serving models. It reads the request head of a client
+ * and queues the response until it can be written out.
+ *
+ * Every function works on blocking and non-blocking sockets:
+ * on a non-blocking socket conn_read() and conn_flush() return
+ * CONN_AGAIN when the caller has to wait for the socket.
+ *
+ * On Linux files are sent with sendfile(2), or splice(2) if
+ * that fails, and read(2)/write(2) through the stage buffer
+ * is the last resort.
+ */
+#ifdef _LINUX_
+#define _GNU_SOURCE	/* splice(2) */
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef _LINUX_
+#include <sys/sendfile.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "macros.h"
+#include "http.h"
+#include "conn.h"
+#include "fcache.h"
+
+#define DEFAULT_BUFFSIZE 512
+#define CONN_SEGSIZE 4096
+
+/* buffer of a producer segment, filled at once */
+#define CONN_FILLSIZE 32768
+
+/* bytes moved through the pipe at once, its default capacity */
+#define CONN_PIPESIZE 65536
+
+/* the file can't be sent this way, try the next one */
+#define CONN_FALLBACK -1
+
+static BOOL scan_head(struct conn *);
+static struct conn_seg *new_seg(struct conn *, size_t);
+static void free_seg(struct conn_seg *);
+static int flush_file(struct conn *, struct conn_seg *);
+#ifdef _LINUX_
+static int sendfile_seg(struct conn *, struct conn_seg *);
+static int splice_seg(struct conn *, struct conn_seg *);
+static BOOL has_file(struct conn *);
+static void set_cork(struct conn *, BOOL);
+#endif
+
+/* 
+ * All live connections, the most recently active first. It
+ * is used to close idle connections and to drop them in
+ * forked children.
+ */
+static struct conn *conns;
+static struct conn *conns_tail;
+
+struct conn *
+conn_create(int fd, struct sockaddr *client)
+{
+	struct conn *c;
+
+	MALLOC(c, struct conn, 1);
+	memset(c, 0, sizeof(struct conn));
+
+	c->fd = fd;
+	c->state = CONN_READING;
+	c->keep_alive = FALSE;
+	c->pipe_fd[0] = -1;
+	c->pipe_fd[1] = -1;
+	http_parser_init(&c->parser);
+	get_ip(c->client_ip, client);
+
+	c->prev = NULL;
+	c->next = conns;
+	if (conns != NULL)
+		conns->prev = c;
+	else
+		conns_tail = c;
+	conns = c;
+	c->last_active = time(NULL);
+
+	return c;
+}
+
+/*
+ * This function reads the next part of the request head and
+ * looks for the empty line that ends it.
+ */
+int
+conn_read(struct conn *c)
+{
+	ssize_t count;
+	size_t room;
+
+	if ((room = conn_room(c)) == 0)
+		return CONN_FULL;
+
+	count = read(c->fd, c->head + c->head_len, room);
+	if (count == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return CONN_AGAIN;
+		return CONN_ERROR;
+	}
+	if (count == 0)
+		return CONN_EOF;
+
+	return conn_received(c, count);
+}
+
+/*
+ * This function returns the free space at the end of head[],
+ * where the next bytes of the request are read to.
+ */
+size_t
+conn_room(struct conn *c)
+{
+	/* move a request head left unfinished to the buffer start */
+	if (c->head_len == HTTP_REQUEST_MAX_LENGTH - 1 && c->head_start > 0) {
+		(void)memmove(c->head, c->head + c->head_start,
+		              c->head_len - c->head_start);
+		c->head_len -= c->head_start;
+		c->head_start = 0;
+	}
+
+	return HTTP_REQUEST_MAX_LENGTH - 1 - c->head_len;
+}
+
+/*
+ * This function takes count bytes read to the space given
+ * by conn_room() and looks for the end of the request head.
+ */
+int
+conn_received(struct conn *c, size_t count)
+{
+	c->head_len += count;
+
+	if (scan_head(c) == TRUE)
+		return CONN_DONE;
+
+	/* the request head must fit into the buffer */
+	if (c->head_len == HTTP_REQUEST_MAX_LENGTH - 1)
+		return CONN_FULL;
+
+	return CONN_AGAIN;
+}
+
+/*
+ * This function drops the request head that was handled.
+ * Bytes the client sent after it are kept as the start of
+ * the next request; it returns TRUE if they already form
+ * a complete request head. Nothing is copied here, the
+ * buffer is only compacted by conn_read() when it's full.
+ */
+BOOL
+conn_next(struct conn *c)
+{
+	if (c->head_end == 0)
+		return FALSE;
+
+	c->head_start = c->head_end;
+	c->head_end = 0;
+	http_parser_init(&c->parser);
+
+	if (c->head_start == c->head_len) {
+		c->head_start = 0;
+		c->head_len = 0;
+		return FALSE;
+	}
+
+	return scan_head(c);
+}
+
+/*
+ * This function marks the connection as active, so it's
+ * the last one to be closed for being idle.
+ */
+void
+conn_touch(struct conn *c)
+{
+	c->last_active = time(NULL);
+	if (c == conns)
+		return;
+
+	c->prev->next = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	else
+		conns_tail = c->prev;
+
+	c->prev = NULL;
+	c->next = conns;
+	conns->prev = c;
+	conns = c;
+}
+
+/* return the connection which was idle for the longest time */
+struct conn *
+conn_oldest(void)
+{
+	return conns_tail;
+}
+
+/*
+ * This function copies len bytes to the end of the output
+ * queue. Small pieces are packed into the same segment.
+ */
+void
+conn_queue(struct conn *c, char *buf, size_t len)
+{
+	struct conn_seg *seg;
+
+	seg = c->out_last;
+	if (seg == NULL || seg->fd != -1 || seg->fe != NULL ||
+	    seg->fill != NULL || seg->cap - seg->len < len)
+		seg = new_seg(c, len > CONN_SEGSIZE ? len : CONN_SEGSIZE);
+
+	(void)memcpy(seg->buf + seg->len, buf, len);
+	seg->len += len;
+}
+
+/*
+ * This function queues len bytes of the file starting at
+ * offset. The connection takes over fd and closes it.
+ */
+void
+conn_queue_file(struct conn *c, int fd, off_t offset, size_t len)
+{
+	struct conn_seg *seg;
+
+	seg = new_seg(c, 0);
+	seg->fd = fd;
+	seg->offset = offset;
+	seg->len = len;
+}
+
+/*
+ * Like conn_queue_file(), but the file is sent from the open
+ * fd of a cache entry. The caller's reference is taken over.
+ */
+void
+conn_queue_entry(struct conn *c, struct fentry *fe, off_t offset, size_t len)
+{
+	struct conn_seg *seg;
+
+	seg = new_seg(c, 0);
+	seg->fd = fe->fd;
+	seg->fe = fe;
+	seg->offset = offset;
+	seg->len = len;
+}
+
+/*
+ * This function queues len bytes of a file body kept in the
+ * cache without copying them. The caller's reference to the
+ * entry fe is taken over.
+ */
+void
+conn_queue_body(struct conn *c, struct fentry *fe, char *body, size_t len)
+{
+	struct conn_seg *seg;
+
+	seg = new_seg(c, 0);
+	seg->buf = body;
+	seg->fe = fe;
+	seg->len = len;
+}
+
+/*
+ * This function queues output which is produced while it's
+ * sent, such as the index of a huge directory, so it never
+ * has to be held in memory at once. See struct conn_seg.
+ */
+void
+conn_queue_producer(struct conn *c, size_t (*fill)(void *, char *, size_t),
+                    void (*release)(void *), void *arg)
+{
+	struct conn_seg *seg;
+
+	seg = new_seg(c, CONN_FILLSIZE);
+	seg->fill = fill;
+	seg->release = release;
+	seg->arg = arg;
+}
+
+BOOL
+conn_pending(struct conn *c)
+{
+	return c->out_first != NULL;
+}
+
+/*
+ * This function writes the output queue to the client. It
+ * returns CONN_DONE once everything was sent. Memory
+ * segments in a row, e.g. the responses to pipelined
+ * requests, are gathered into one writev(2). While a file
+ * is sent the socket is corked, so a response head goes
+ * out in the same packet as the first bytes of the file.
+ */
+int
+conn_flush(struct conn *c)
+{
+	struct conn_seg *seg;
+	struct iovec iov[CONN_IOV_MAX];
+	ssize_t count;
+	int n, result;
+
+#ifdef _LINUX_
+	if (c->corked == FALSE && has_file(c) == TRUE)
+		set_cork(c, TRUE);
+#endif
+
+	while ((seg = c->out_first) != NULL) {
+		if (seg->fd != -1) {
+			if ((result = flush_file(c, seg)) != CONN_DONE)
+				return result;
+			conn_drop(c);
+			continue;
+		}
+
+		n = conn_iov(c, iov, CONN_IOV_MAX);
+		count = writev(c->fd, iov, n);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return CONN_AGAIN;
+			return CONN_ERROR;
+		}
+
+		conn_written(c, count);
+	}
+
+#ifdef _LINUX_
+	if (c->corked == TRUE)
+		set_cork(c, FALSE);
+#endif
+	return CONN_DONE;
+}
+
+/*
+ * This function fills iov with the memory segments at the
+ * start of the output queue and returns their number. A
+ * producer segment which was written out is filled again;
+ * the segments after it wait until it's finished.
+ */
+int
+conn_iov(struct conn *c, struct iovec *iov, int max)
+{
+	struct conn_seg *seg;
+	int n;
+
+	for (n = 0, seg = c->out_first; seg != NULL && seg->fd == -1 &&
+	     n < max; seg = seg->next, n++) {
+		if (seg->fill != NULL && seg->pos == seg->len) {
+			seg->pos = 0;
+			seg->len = seg->fill(seg->arg, seg->buf, seg->cap);
+			if (seg->len == 0) {
+				seg->release(seg->arg);
+				seg->fill = NULL;
+			}
+		}
+		iov[n].iov_base = seg->buf + seg->pos;
+		iov[n].iov_len = seg->len - seg->pos;
+		if (seg->fill != NULL) {
+			n++;
+			break;
+		}
+	}
+	return n;
+}
+
+/* drop count bytes written from the segments given by conn_iov() */
+void
+conn_written(struct conn *c, size_t count)
+{
+	struct conn_seg *seg;
+
+	while ((seg = c->out_first) != NULL && seg->fd == -1 &&
+	       count >= seg->len - seg->pos) {
+		count -= seg->len - seg->pos;
+		/* a producer is kept to be filled again */
+		if (seg->fill != NULL) {
+			seg->pos = seg->len;
+			return;
+		}
+		conn_drop(c);
+	}
+	if (count > 0)
+		seg->pos += count;
+}
+
+/* remove the first segment of the output queue */
+void
+conn_drop(struct conn *c)
+{
+	struct conn_seg *seg;
+
+	seg = c->out_first;
+	c->out_first = seg->next;
+	if (c->out_first == NULL)
+		c->out_last = NULL;
+	free_seg(seg);
+}
+
+/*
+ * A forked child must not keep the sockets of other clients
+ * open, or those clients won't see their connection closed.
+ */
+void
+conn_close_others(struct conn *c)
+{
+	struct conn *p;
+
+	for (p = conns; p != NULL; p = p->next)
+		if (p != c)
+			(void)close(p->fd);
+}
+
+void
+conn_free(struct conn *c)
+{
+	struct conn_seg *seg;
+
+	while ((seg = c->out_first) != NULL) {
+		c->out_first = seg->next;
+		free_seg(seg);
+	}
+
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		conns = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	else
+		conns_tail = c->prev;
+
+	(void)close(c->fd);
+	if (c->pipe_fd[0] != -1) {
+		(void)close(c->pipe_fd[0]);
+		(void)close(c->pipe_fd[1]);
+	}
+	free(c->stage);
+	free(c);
+}
+
+void
+get_ip(char *ip, struct sockaddr *addr)
+{
+	void *in_addr;
+
+	if (addr->sa_family == AF_INET)
+		in_addr =
+			(void *)&((struct sockaddr_in *)addr)->sin_addr;
+	else if (addr->sa_family == AF_INET6)
+		in_addr =
+			(void *)&((struct sockaddr_in6 *)addr)->sin6_addr;
+
+	(void)inet_ntop(addr->sa_family, in_addr,
+					ip, INET6_ADDRSTRLEN);
+}
+
+/*
+ * This function parses the bytes of the request head which were
+ * read since the last call. The head is complete when the parser
+ * is done with it, or when it found an error, which request()
+ * reports.
+ */
+static BOOL
+scan_head(struct conn *c)
+{
+	if (http_parse(&c->parser, c->head + c->head_start,
+	               c->head_len - c->head_start) == HTTP_PARSE_AGAIN)
+		return FALSE;
+
+	c->head_end = c->head_start + c->parser.pos;
+	return TRUE;
+}
+
+static struct conn_seg *
+new_seg(struct conn *c, size_t cap)
+{
+	struct conn_seg *seg;
+
+	MALLOC(seg, struct conn_seg, 1);
+	seg->buf = NULL;
+	if (cap > 0)
+		MALLOC(seg->buf, char, cap);
+	seg->cap = cap;
+	seg->fd = -1;
+	seg->fe = NULL;
+	seg->xfer = CONN_XFER_SENDFILE;
+	seg->offset = 0;
+	seg->len = 0;
+	seg->pos = 0;
+	seg->fill = NULL;
+	seg->release = NULL;
+	seg->arg = NULL;
+	seg->next = NULL;
+
+	if (c->out_last != NULL)
+		c->out_last->next = seg;
+	else
+		c->out_first = seg;
+	c->out_last = seg;
+
+	return seg;
+}
+
+static void
+free_seg(struct conn_seg *seg)
+{
+	if (seg->fe != NULL)
+		fcache_put(seg->fe);
+	else {
+		if (seg->fill != NULL)
+			seg->release(seg->arg);
+		if (seg->fd != -1)
+			(void)close(seg->fd);
+		free(seg->buf);
+	}
+	free(seg);
+}
+
+/*
+ * The file is sent with the first method that works. If
+ * sendfile(2) or splice(2) can't be used for the file, the
+ * segment falls back to the next method, starting at the
+ * bytes which were already sent.
+ *
+ * For the copy, the file is read into the stage buffer. pos
+ * counts the bytes read from the file, so the segment is
+ * finished when all of them were read and the stage buffer
+ * is empty.
+ */
+static int
+flush_file(struct conn *c, struct conn_seg *seg)
+{
+	ssize_t count;
+	size_t len;
+#ifdef _LINUX_
+	int result;
+
+	if (seg->xfer == CONN_XFER_SENDFILE) {
+		if ((result = sendfile_seg(c, seg)) != CONN_FALLBACK)
+			return result;
+		seg->xfer = CONN_XFER_SPLICE;
+	}
+	if (seg->xfer == CONN_XFER_SPLICE) {
+		if ((result = splice_seg(c, seg)) != CONN_FALLBACK)
+			return result;
+		seg->xfer = CONN_XFER_COPY;
+	}
+#endif
+
+	if (c->stage == NULL)
+		MALLOC(c->stage, char, DEFAULT_BUFFSIZE);
+
+	for (;;) {
+		if (c->stage_off == c->stage_len) {
+			if (seg->pos == seg->len)
+				return CONN_DONE;
+
+			len = seg->len - seg->pos;
+			if (len > DEFAULT_BUFFSIZE)
+				len = DEFAULT_BUFFSIZE;
+
+			count = pread(seg->fd, c->stage, len, seg->offset + seg->pos);
+			if (count == -1 && errno == EINTR)
+				continue;
+			/* the file shrank, the promised length can't be kept */
+			if (count <= 0)
+				return CONN_ERROR;
+
+			seg->pos += count;
+			c->stage_off = 0;
+			c->stage_len = count;
+		}
+
+		count = write(c->fd, c->stage + c->stage_off,
+		              c->stage_len - c->stage_off);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return CONN_AGAIN;
+			return CONN_ERROR;
+		}
+		c->stage_off += count;
+	}
+}
+
+#ifdef _LINUX_
+/* the kernel copies the file to the socket, pos counts the bytes sent */
+static int
+sendfile_seg(struct conn *c, struct conn_seg *seg)
+{
+	off_t offset;
+	ssize_t count;
+
+	while (seg->pos < seg->len) {
+		offset = seg->offset + seg->pos;
+		count = sendfile(c->fd, seg->fd, &offset, seg->len - seg->pos);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return CONN_AGAIN;
+			if (errno == EINVAL || errno == ENOSYS)
+				return CONN_FALLBACK;
+			return CONN_ERROR;
+		}
+		/* the file shrank, the promised length can't be kept */
+		if (count == 0)
+			return CONN_ERROR;
+		seg->pos += count;
+	}
+
+	return CONN_DONE;
+}
+
+/*
+ * The file is moved to the socket through a pipe. Like the
+ * stage buffer, pos counts the bytes moved into the pipe
+ * and piped the ones still waiting in it.
+ */
+static int
+splice_seg(struct conn *c, struct conn_seg *seg)
+{
+	loff_t offset;
+	ssize_t count;
+	size_t len;
+
+	if (c->pipe_fd[0] == -1 && pipe2(c->pipe_fd, O_CLOEXEC) == -1) {
+		c->pipe_fd[0] = -1;
+		return CONN_FALLBACK;
+	}
+
+	for (;;) {
+		if (c->piped == 0) {
+			if (seg->pos == seg->len)
+				return CONN_DONE;
+
+			len = seg->len - seg->pos;
+			if (len > CONN_PIPESIZE)
+				len = CONN_PIPESIZE;
+
+			offset = seg->offset + seg->pos;
+			count = splice(seg->fd, &offset, c->pipe_fd[1], NULL,
+			               len, SPLICE_F_MOVE);
+			if (count == -1) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EINVAL || errno == ENOSYS)
+					return CONN_FALLBACK;
+				return CONN_ERROR;
+			}
+			if (count == 0)
+				return CONN_ERROR;
+
+			seg->pos += count;
+			c->piped = count;
+		}
+
+		count = splice(c->pipe_fd[0], NULL, c->fd, NULL,
+		               c->piped, SPLICE_F_MOVE);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return CONN_AGAIN;
+			return CONN_ERROR;
+		}
+		c->piped -= count;
+	}
+}
+
+static BOOL
+has_file(struct conn *c)
+{
+	struct conn_seg *seg;
+
+	for (seg = c->out_first; seg != NULL; seg = seg->next)
+		if (seg->fd != -1)
+			return TRUE;
+	return FALSE;
+}
+
+static void
+set_cork(struct conn *c, BOOL flag)
+{
+	int on;
+
+	on = flag == TRUE ? 1 : 0;
+	(void)setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	c->corked = flag;
+}
+#endif /* _LINUX_ */
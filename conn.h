@@ -0,0 +1,115 @@
+#ifndef _CONN_H_
+#define _CONN_H_
+
+/* connection states */
+#define CONN_READING	1
+#define CONN_WRITING	2
+#define CONN_CLOSING	3
+
+/* responses queued before they are written at once */
+#define CONN_PIPELINE_MAX	16
+
+/* iovecs gathered by one writev(2) */
+#define CONN_IOV_MAX		64
+
+/* how a file segment is sent */
+#define CONN_XFER_SENDFILE	0
+#define CONN_XFER_SPLICE	1
+#define CONN_XFER_COPY		2
+
+/* return values of conn_read(1) and conn_flush(1) */
+#define CONN_DONE		0
+#define CONN_AGAIN		1
+#define CONN_EOF		2
+#define CONN_FULL		3
+#define CONN_ERROR		4
+
+struct fentry;
+
+/*
+ * conn_seg
+ * One piece of pending output. A memory segment (fd == -1) owns
+ * buf, unless it sends the body of the cache entry fe; a file
+ * segment owns fd, or holds a reference to the cache entry fe
+ * the fd belongs to, and sends len bytes of the file starting
+ * at offset. pos counts the bytes already consumed.
+ * xfer is the best way to send the file that still works.
+ *
+ * A producer segment is a memory segment whose buf is filled
+ * by calling fill(arg, buf, cap) whenever it was written out,
+ * until fill returns 0. Then release(arg) is called, and the
+ * segments queued after it are sent.
+ */
+struct conn_seg {
+	char *buf;
+	size_t cap;
+	int fd;
+	struct fentry *fe;
+	int xfer;
+	off_t offset;
+	size_t len;
+	size_t pos;
+	size_t (*fill)(void *, char *, size_t);
+	void (*release)(void *);
+	void *arg;
+	struct conn_seg *next;
+};
+
+/*
+ * conn
+ * This structure keeps the state of one client connection. The
+ * request head is read into head[] and the response is queued as
+ * a list of segments, so the same http code can be driven either
+ * by blocking I/O in a forked child or by the event loop.
+ *
+ * head[] may hold several pipelined requests: the one to handle
+ * next starts at head_start and, once it's complete, ends at
+ * head_end. parser splits it as its bytes arrive.
+ */
+struct conn {
+	int fd;
+	int state;
+	char client_ip[INET6_ADDRSTRLEN];
+	char head[HTTP_REQUEST_MAX_LENGTH];
+	size_t head_len;	/* bytes read into head[] */
+	size_t head_start;	/* start of the current request head */
+	size_t head_end;	/* end of the current request head, or 0 */
+	struct http_parser parser;
+	BOOL keep_alive;	/* wait for another request after this one */
+	int nrequests;		/* requests served on this connection */
+	time_t last_active;
+	struct conn_seg *out_first;
+	struct conn_seg *out_last;
+	char *stage;		/* file data read but not yet written */
+	size_t stage_off;
+	size_t stage_len;
+	int pipe_fd[2];		/* splice(2) buffer, or -1 */
+	size_t piped;		/* file data in the pipe */
+	BOOL corked;		/* TCP_CORK is set on fd */
+	struct conn *prev;
+	struct conn *next;
+};
+
+struct conn *conn_create(int, struct sockaddr *);
+int conn_read(struct conn *);
+size_t conn_room(struct conn *);
+int conn_received(struct conn *, size_t);
+BOOL conn_next(struct conn *);
+void conn_touch(struct conn *);
+struct conn *conn_oldest(void);
+void conn_queue(struct conn *, char *, size_t);
+void conn_queue_file(struct conn *, int, off_t, size_t);
+void conn_queue_entry(struct conn *, struct fentry *, off_t, size_t);
+void conn_queue_body(struct conn *, struct fentry *, char *, size_t);
+void conn_queue_producer(struct conn *, size_t (*)(void *, char *, size_t),
+                         void (*)(void *), void *);
+BOOL conn_pending(struct conn *);
+int conn_flush(struct conn *);
+int conn_iov(struct conn *, struct iovec *, int);
+void conn_written(struct conn *, size_t);
+void conn_drop(struct conn *);
+void conn_close_others(struct conn *);
+void conn_free(struct conn *);
+void get_ip(char *, struct sockaddr *);
+
+#endif /* !_CONN_H_ */
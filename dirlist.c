@@ -0,0 +1,794 @@
+/*
+ * This program renders the index of a directory without an
+ * index.html file.
+ *
+ * The entries are read in batches of DIRLIST_BATCH bytes, with
+ * getdents64(2) on Linux and readdir(3) elsewhere, and their
+ * names are packed into one buffer, so reading a directory takes
+ * a few allocations however many entries it has.
+ *
+ * A directory of up to DIRLIST_SORT_MAX entries is rendered into
+ * one buffer in sorted order, which the file cache keeps. A larger
+ * one is streamed: its entries are rendered in the order they are
+ * read while the response is written, in HTTP/1.1 chunks or up to
+ * the end of the connection, so the memory used stays the same.
+ *
+ * With "?page=" or "?limit=" a window of limit entries is rendered
+ * instead, with links to the pages around it. Pages follow the
+ * order of the directory, which doesn't change while the entries
+ * do not; the entries on a page are sorted.
+ *
+ * Besides HTML, the index can be a JSON array or NDJSON, one object
+ * per line, with the type, size, modification time and ETag of each
+ * entry, so a client learns them without a HEAD request per file.
+ * The entries are looked up with fstatat(2) relative to the open
+ * directory, which saves resolving the path of each one. Such an
+ * index is never cached, as the size of a file changes without a
+ * change of the directory.
+ */
+#ifdef _LINUX_
+#define _GNU_SOURCE	/* syscall(2) */
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#ifdef _LINUX_
+#include <sys/syscall.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "macros.h"
+#include "http.h"
+#include "conn.h"
+#include "dirlist.h"
+
+/* the states of a stream, the part it renders next */
+#define STREAM_HEAD	0
+#define STREAM_ENTRIES	1
+#define STREAM_TAIL	2
+#define STREAM_DONE	3
+
+/* a chunk starts with its size in six hex digits */
+#define CHUNK_HEAD	8
+#define CHUNK_END	"0\r\n\r\n"
+
+/*
+ * reader
+ * An open directory and the batch of entries read last.
+ */
+struct reader {
+#ifdef _LINUX_
+	int fd;
+	char *batch;
+	size_t len;
+	size_t pos;
+#else
+	DIR *dp;
+#endif
+};
+
+#ifdef _LINUX_
+/* the record getdents64(2) returns for each entry */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+/*
+ * names
+ * The names read from a directory, packed one after another,
+ * each ended by '\0'. off holds the start of each one.
+ */
+struct names {
+	char *buf;
+	size_t len;
+	size_t cap;
+	size_t *off;
+	size_t n;
+	size_t max;
+};
+
+struct dirstream {
+	struct reader r;
+	char *uri;
+	int format;
+	BOOL chunked;
+	int state;
+	size_t count;		/* entries rendered */
+	char *pending;		/* name which didn't fit the last fill */
+};
+
+static int reader_open(struct reader *, int);
+static char *reader_next(struct reader *);
+static int reader_fd(struct reader *);
+static void reader_close(struct reader *);
+static void add_name(struct names *, char *);
+static char *render(struct reader *, char *, int, struct names *, char *,
+                    size_t *);
+static size_t fill(void *, char *, size_t);
+static size_t head_size(int, char *);
+static char *put_head(char *, int, char *);
+static size_t entry_size(int, size_t);
+static char *put_entry(char *, int, int, char *, size_t *);
+static size_t tail_size(int, char *);
+static char *put_tail(char *, int, char *);
+static char *put_json_string(char *, char *);
+static int accept_format(char *);
+static int range_format(char *, size_t);
+static int range_q(char *, size_t);
+static long parse_number(char *, size_t);
+static int compare(const void *, const void *);
+static char *append_text(char *, char *, size_t);
+
+/* the types of the formats, by their number in dirlist.h */
+static char *types[] = {
+	"text/html",
+	"application/json",
+	"application/x-ndjson"
+};
+
+static char tag_before_title[] =
+	"<!DOCTYPE html>\n"
+	"<html>\n"
+	"\t<head><title>Index of ";
+static char tag_before_h1[] =
+	"</title></head>\n"
+	"\t<body>\n"
+	"\t\t<h1>Index of ";
+static char tag_before_li[] =
+	"</h1>\n"
+	"\t\t<ul>\n";
+static char tag_left_li[] = "\t\t\t<li><a href=\"";
+static char tag_middle_li[] = "\"> ";
+static char tag_right_li[] = "</a></li>\n";
+static char tag_after_ul[] = "\t\t</ul>\n";
+static char tag_end[] = "\t</body>\n</html>";
+
+static char json_end[] = "\n]\n";
+
+#define TAG_LEN(tag)	(sizeof(tag) - 1)
+
+/* the longest JSON object of an entry besides its escaped name */
+#define JSON_ENTRY_MAX	(HTTP_ETAG_MAX * 2 + 128)
+
+/* the bytes of an entry besides its name, which is written twice */
+#define LI_LEN	(TAG_LEN(tag_left_li) + TAG_LEN(tag_middle_li) + \
+		 TAG_LEN(tag_right_li))
+
+/*
+ * This function reads the page and the number of entries on it
+ * from the query string query, which may be NULL. It returns FALSE
+ * if neither is given, so the whole directory is listed.
+ */
+BOOL
+dirlist_query(char *query, long *page, long *limit)
+{
+	char *p;
+	size_t len;
+	BOOL found;
+
+	*page = 1;
+	*limit = DIRLIST_LIMIT;
+	found = FALSE;
+	if (query == NULL)
+		return FALSE;
+
+	for (p = query; *p != '\0'; p += len + (p[len] == '&')) {
+		len = strcspn(p, "&");
+		if (strncmp(p, "page=", 5) == 0) {
+			*page = parse_number(p + 5, len - 5);
+			found = TRUE;
+		} else if (strncmp(p, "limit=", 6) == 0) {
+			*limit = parse_number(p + 6, len - 6);
+			found = TRUE;
+		}
+	}
+
+	if (*limit < 1)
+		*limit = DIRLIST_LIMIT;
+	else if (*limit > DIRLIST_LIMIT_MAX)
+		*limit = DIRLIST_LIMIT_MAX;
+	if (*page < 1)
+		*page = 1;
+	else if (*page > LONG_MAX / DIRLIST_LIMIT_MAX)
+		*page = LONG_MAX / DIRLIST_LIMIT_MAX;
+	return found;
+}
+
+/*
+ * This function returns the format of the index for the query
+ * string query, which may be NULL: the one named by "format=" if
+ * there is, or else the one the Accept header accept prefers. It's
+ * HTML by default.
+ */
+int
+dirlist_format(char *query, char *accept)
+{
+	char *p;
+	size_t len;
+
+	if (query != NULL)
+		for (p = query; *p != '\0'; p += len + (p[len] == '&')) {
+			len = strcspn(p, "&");
+			if (len == 11 && strncmp(p, "format=json", 11) == 0)
+				return DIRLIST_JSON;
+			if (len == 13 && strncmp(p, "format=ndjson", 13) == 0)
+				return DIRLIST_NDJSON;
+			if (len == 11 && strncmp(p, "format=html", 11) == 0)
+				return DIRLIST_HTML;
+		}
+
+	return accept != NULL ? accept_format(accept) : DIRLIST_HTML;
+}
+
+/* the Content-Type of an index in format */
+char *
+dirlist_type(int format)
+{
+	return types[format];
+}
+
+/*
+ * This function renders the index of the open directory fd, which
+ * it closes, requested as uri, in format into a new buffer and stores its
+ * length in len. page 0 renders all entries; a larger page renders
+ * limit entries after the ones of the pages before. It returns
+ * NULL and sets status if the directory can't be read, or sets
+ * status to 0 if it has too many entries to be sorted.
+ */
+char *
+dirlist_render(int fd, char *uri, int format, long page, long limit,
+               size_t *len, int *status)
+{
+	struct reader r;
+	struct names names;
+	char nav[128];
+	char *name, *html;
+	long skip;
+	BOOL more;
+	int n;
+
+	if ((*status = reader_open(&r, fd)) != 0)
+		return NULL;
+
+	names.buf = NULL;
+	names.len = names.cap = 0;
+	names.off = NULL;
+	names.n = names.max = 0;
+
+	skip = page > 0 ? (page - 1) * limit : 0;
+	more = FALSE;
+	while ((name = reader_next(&r)) != NULL) {
+		if (skip > 0) {
+			skip--;
+			continue;
+		}
+		if ((page > 0 && names.n == (size_t)limit) ||
+		    names.n == DIRLIST_SORT_MAX) {
+			more = TRUE;
+			break;
+		}
+		add_name(&names, name);
+	}
+
+	nav[0] = '\0';
+	if (page == 0 && more) {
+		reader_close(&r);
+		free(names.buf);
+		free(names.off);
+		return NULL;
+	} else if (page > 0 && format == DIRLIST_HTML) {
+		n = snprintf(nav, sizeof(nav), "\t\t<p>");
+		if (page > 1)
+			n += snprintf(nav + n, sizeof(nav) - n,
+			              "<a href=\"?page=%ld&limit=%ld\">previous</a> ",
+			              page - 1, limit);
+		if (more)
+			n += snprintf(nav + n, sizeof(nav) - n,
+			              "<a href=\"?page=%ld&limit=%ld\">next</a>",
+			              page + 1, limit);
+		(void)snprintf(nav + n, sizeof(nav) - n, "</p>\n");
+	}
+
+	html = render(&r, uri, format, &names, nav, len);
+	reader_close(&r);
+	free(names.buf);
+	free(names.off);
+	return html;
+}
+
+/*
+ * This function takes the open directory fd to be streamed as uri
+ * in format. It returns NULL, closes fd and sets status if the
+ * directory can't be read.
+ */
+struct dirstream *
+dirlist_stream(int fd, char *uri, int format, BOOL chunked, int *status)
+{
+	struct dirstream *ds;
+
+	MALLOC(ds, struct dirstream, 1);
+	if ((*status = reader_open(&ds->r, fd)) != 0) {
+		free(ds);
+		return NULL;
+	}
+
+	MALLOC(ds->uri, char, strlen(uri) + 1);
+	(void)strcpy(ds->uri, uri);
+	ds->format = format;
+	ds->chunked = chunked;
+	ds->state = STREAM_HEAD;
+	ds->count = 0;
+	ds->pending = NULL;
+	return ds;
+}
+
+/* the connection renders the stream while it's sent and closes it */
+void
+dirlist_queue(struct conn *c, struct dirstream *ds)
+{
+	conn_queue_producer(c, fill, dirlist_close, ds);
+}
+
+void
+dirlist_close(void *arg)
+{
+	struct dirstream *ds;
+
+	/* the directory is closed once the stream is rendered */
+	ds = arg;
+	if (ds->state != STREAM_DONE)
+		reader_close(&ds->r);
+	free(ds->uri);
+	free(ds);
+}
+
+/*
+ * Render the next part of a stream into buf, framed as a chunk
+ * if the stream is chunked. A chunk is never empty, since one
+ * entry always fits into an empty buffer.
+ */
+static size_t
+fill(void *arg, char *buf, size_t cap)
+{
+	struct dirstream *ds;
+	char *p, *end, *body;
+	size_t len;
+	char size[CHUNK_HEAD + 1];
+
+	ds = arg;
+	if (ds->state == STREAM_DONE)
+		return 0;
+
+	body = ds->chunked ? buf + CHUNK_HEAD : buf;
+	end = ds->chunked ? buf + cap - 2 - TAG_LEN(CHUNK_END) : buf + cap;
+	p = body;
+
+	if (ds->state == STREAM_HEAD) {
+		p = put_head(p, ds->format, ds->uri);
+		ds->state = STREAM_ENTRIES;
+	}
+
+	while (ds->state == STREAM_ENTRIES) {
+		if (ds->pending == NULL &&
+		    (ds->pending = reader_next(&ds->r)) == NULL) {
+			ds->state = STREAM_TAIL;
+			break;
+		}
+		len = entry_size(ds->format, strlen(ds->pending));
+		if ((size_t)(end - p) < len)
+			break;
+		p = put_entry(p, ds->format, reader_fd(&ds->r), ds->pending,
+		              &ds->count);
+		ds->pending = NULL;
+	}
+
+	if (ds->state == STREAM_TAIL &&
+	    (size_t)(end - p) >= tail_size(ds->format, "")) {
+		reader_close(&ds->r);
+		p = put_tail(p, ds->format, "");
+		ds->state = STREAM_DONE;
+	}
+
+	if (!ds->chunked)
+		return p - buf;
+
+	len = p - body;
+	(void)snprintf(size, sizeof(size), "%06zx\r\n", len);
+	(void)memcpy(buf, size, CHUNK_HEAD);
+	p = append_text(p, "\r\n", 2);
+	if (ds->state == STREAM_DONE)
+		p = append_text(p, CHUNK_END, TAG_LEN(CHUNK_END));
+	return p - buf;
+}
+
+/*
+ * Render the page of the names read by r in sorted order. An HTML
+ * page has the exact length of its buffer.
+ */
+static char *
+render(struct reader *r, char *uri, int format, struct names *names,
+       char *nav, size_t *len)
+{
+	char **sorted;
+	char *html, *p;
+	size_t i, bodylen, count;
+
+	MALLOC(sorted, char *, names->n > 0 ? names->n : 1);
+	for (i = 0; i < names->n; i++)
+		sorted[i] = names->buf + names->off[i];
+	qsort(sorted, names->n, sizeof(char *), compare);
+
+	bodylen = head_size(format, uri) + tail_size(format, nav);
+	for (i = 0; i < names->n; i++)
+		bodylen += entry_size(format, strlen(sorted[i]));
+
+	MALLOC(html, char, bodylen);
+	p = put_head(html, format, uri);
+	for (i = 0, count = 0; i < names->n; i++)
+		p = put_entry(p, format, reader_fd(r), sorted[i], &count);
+	p = put_tail(p, format, nav);
+
+	free(sorted);
+	*len = p - html;
+	return html;
+}
+
+static size_t
+head_size(int format, char *uri)
+{
+	if (format == DIRLIST_HTML)
+		return TAG_LEN(tag_before_title) + TAG_LEN(tag_before_h1) +
+		       TAG_LEN(tag_before_li) + strlen(uri) * 2;
+	return format == DIRLIST_JSON ? 1 : 0;
+}
+
+static char *
+put_head(char *p, int format, char *uri)
+{
+	size_t uri_len;
+
+	if (format == DIRLIST_JSON)
+		return append_text(p, "[", 1);
+	if (format != DIRLIST_HTML)
+		return p;
+
+	uri_len = strlen(uri);
+	p = append_text(p, tag_before_title, TAG_LEN(tag_before_title));
+	p = append_text(p, uri, uri_len);
+	p = append_text(p, tag_before_h1, TAG_LEN(tag_before_h1));
+	p = append_text(p, uri, uri_len);
+	return append_text(p, tag_before_li, TAG_LEN(tag_before_li));
+}
+
+/* the most bytes the entry of a name of len bytes takes */
+static size_t
+entry_size(int format, size_t len)
+{
+	/* each name is written twice in HTML, a JSON escape takes 6 */
+	if (format == DIRLIST_HTML)
+		return LI_LEN + len * 2;
+	return JSON_ENTRY_MAX + len * 6;
+}
+
+/*
+ * Write the entry of name, in the directory dirfd. count is the
+ * number of entries written before; a JSON entry which is gone
+ * is left out.
+ */
+static char *
+put_entry(char *p, int format, int dirfd, char *name, size_t *count)
+{
+	struct stat st;
+	char etag[HTTP_ETAG_MAX];
+	char *type;
+	size_t len;
+
+	if (format == DIRLIST_HTML) {
+		len = strlen(name);
+		p = append_text(p, tag_left_li, TAG_LEN(tag_left_li));
+		p = append_text(p, name, len);
+		p = append_text(p, tag_middle_li, TAG_LEN(tag_middle_li));
+		p = append_text(p, name, len);
+		(*count)++;
+		return append_text(p, tag_right_li, TAG_LEN(tag_right_li));
+	}
+
+	/* a link may point out of the root, only the link itself is told */
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+		return p;
+
+	if (S_ISREG(st.st_mode))
+		type = "file";
+	else if (S_ISDIR(st.st_mode))
+		type = "dir";
+	else if (S_ISLNK(st.st_mode))
+		type = "link";
+	else
+		type = "other";
+
+	if (format == DIRLIST_JSON)
+		p = append_text(p, *count > 0 ? ",\n" : "\n", *count > 0 ? 2 : 1);
+	p = append_text(p, "{\"name\":\"", 9);
+	p = put_json_string(p, name);
+	p += sprintf(p, "\",\"type\":\"%s\",\"size\":%lld,\"mtime\":%lld", type,
+	             (long long)st.st_size, (long long)st.st_mtime);
+	if (S_ISREG(st.st_mode)) {
+		/* the same tag send_file() gives the file */
+		make_etag(etag, sizeof(etag), st.st_ino, st.st_size, st.st_mtime,
+		          ENCODING_NONE);
+		p = append_text(p, ",\"etag\":\"", 9);
+		p = put_json_string(p, etag);
+		p = append_text(p, "\"", 1);
+	}
+	p = append_text(p, "}", 1);
+	if (format == DIRLIST_NDJSON)
+		p = append_text(p, "\n", 1);
+	(*count)++;
+	return p;
+}
+
+static size_t
+tail_size(int format, char *nav)
+{
+	if (format == DIRLIST_HTML)
+		return TAG_LEN(tag_after_ul) + strlen(nav) + TAG_LEN(tag_end);
+	return format == DIRLIST_JSON ? TAG_LEN(json_end) : 0;
+}
+
+static char *
+put_tail(char *p, int format, char *nav)
+{
+	if (format == DIRLIST_JSON)
+		return append_text(p, json_end, TAG_LEN(json_end));
+	if (format != DIRLIST_HTML)
+		return p;
+
+	p = append_text(p, tag_after_ul, TAG_LEN(tag_after_ul));
+	p = append_text(p, nav, strlen(nav));
+	return append_text(p, tag_end, TAG_LEN(tag_end));
+}
+
+/*
+ * Write s escaped for a JSON string. Bytes above 0x7f are copied,
+ * a name which is no UTF-8 stays as it is.
+ */
+static char *
+put_json_string(char *p, char *s)
+{
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\') {
+			*p++ = '\\';
+			*p++ = *s;
+		} else if ((unsigned char)*s < 0x20)
+			p += sprintf(p, "\\u%04x", (unsigned char)*s);
+		else
+			*p++ = *s;
+	}
+	return p;
+}
+
+/*
+ * The format of the media range with the highest q-value in an
+ * Accept header. HTML, any text type and any type at all count for
+ * HTML, which also wins a tie.
+ */
+static int
+accept_format(char *accept)
+{
+	char *p;
+	size_t len;
+	int format, best, best_q, q;
+
+	best = DIRLIST_HTML;
+	best_q = 0;
+	for (p = accept; *p != '\0'; p += len + (p[len] == ',')) {
+		p += strspn(p, " \t");
+		len = strcspn(p, ",");
+		if ((format = range_format(p, strcspn(p, ";, \t"))) == -1)
+			continue;
+		q = range_q(p, len);
+		if (q > best_q || (q == best_q && format == DIRLIST_HTML)) {
+			best = format;
+			best_q = q;
+		}
+	}
+	return best;
+}
+
+/* the format of a media range of len bytes, -1 if there is none */
+static int
+range_format(char *range, size_t len)
+{
+	int i;
+
+	for (i = DIRLIST_HTML; i <= DIRLIST_NDJSON; i++)
+		if (len == strlen(types[i]) &&
+		    strncasecmp(range, types[i], len) == 0)
+			return i;
+	if ((len == 6 && strncasecmp(range, "text/*", 6) == 0) ||
+	    (len == 3 && strncmp(range, "*/*", 3) == 0))
+		return DIRLIST_HTML;
+	return -1;
+}
+
+/* the q-value of a media range of len bytes, in thousandths */
+static int
+range_q(char *range, size_t len)
+{
+	char *p, *end;
+	int q, i;
+
+	end = range + len;
+	for (p = range; p + 2 < end; p++)
+		if ((*p == ';' || *p == ' ') && p[1] == 'q' && p[2] == '=')
+			break;
+	if (p + 2 >= end)
+		return 1000;
+
+	p += 3;
+	if (p == end || *p != '0')
+		return 1000;
+	q = 0;
+	if (++p < end && *p == '.')
+		for (p++, i = 0; i < 3; i++) {
+			q *= 10;
+			if (p < end && *p >= '0' && *p <= '9')
+				q += *p++ - '0';
+		}
+	return q;
+}
+
+static void
+add_name(struct names *names, char *name)
+{
+	size_t len;
+
+	len = strlen(name) + 1;
+	while (names->cap - names->len < len) {
+		names->cap = names->cap == 0 ? DIRLIST_BATCH : names->cap * 2;
+		REALLOC(names->buf, char, names->cap);
+	}
+	if (names->n == names->max) {
+		names->max = names->max == 0 ? 256 : names->max * 2;
+		REALLOC(names->off, size_t, names->max);
+	}
+
+	names->off[names->n++] = names->len;
+	(void)memcpy(names->buf + names->len, name, len);
+	names->len += len;
+}
+
+/*
+ * Read the open directory fd, which the reader owns from now on.
+ * Return 0 or the status of the error.
+ */
+static int
+reader_open(struct reader *r, int fd)
+{
+#ifdef _LINUX_
+	r->fd = fd;
+	MALLOC(r->batch, char, DIRLIST_BATCH);
+	r->len = r->pos = 0;
+	return 0;
+#else
+	if ((r->dp = fdopendir(fd)) != NULL)
+		return 0;
+	(void)close(fd);
+#endif
+
+	if (errno == ENOENT || errno == ENOTDIR)
+		return Not_Found;
+	else if (errno == EACCES)
+		return Forbidden;
+	else
+		return Internal_Server_Error;
+}
+
+/*
+ * Return the name of the next entry, or NULL at the end. Files
+ * starting with a '.' are ignored. The name is valid until the
+ * next call.
+ */
+static char *
+reader_next(struct reader *r)
+{
+#ifdef _LINUX_
+	struct linux_dirent64 *d;
+	long count;
+
+	for (;;) {
+		if (r->pos == r->len) {
+			count = syscall(SYS_getdents64, r->fd, r->batch,
+			                DIRLIST_BATCH);
+			if (count == -1 && errno == EINTR)
+				continue;
+			/* an error ends the listing like the end of it */
+			if (count <= 0)
+				return NULL;
+			r->len = count;
+			r->pos = 0;
+		}
+		d = (struct linux_dirent64 *)(r->batch + r->pos);
+		r->pos += d->d_reclen;
+		if (d->d_name[0] != '.')
+			return d->d_name;
+	}
+#else
+	struct dirent *dirp;
+
+	while ((dirp = readdir(r->dp)) != NULL)
+		if (dirp->d_name[0] != '.')
+			return dirp->d_name;
+	return NULL;
+#endif
+}
+
+static int
+reader_fd(struct reader *r)
+{
+#ifdef _LINUX_
+	return r->fd;
+#else
+	return dirfd(r->dp);
+#endif
+}
+
+static void
+reader_close(struct reader *r)
+{
+#ifdef _LINUX_
+	(void)close(r->fd);
+	free(r->batch);
+#else
+	(void)closedir(r->dp);
+#endif
+}
+
+/* a number of at most 9 digits, -1 if there is none */
+static long
+parse_number(char *s, size_t len)
+{
+	long n;
+	size_t i;
+
+	if (len == 0 || len > 9)
+		return -1;
+	for (n = 0, i = 0; i < len; i++) {
+		if (s[i] < '0' || s[i] > '9')
+			return -1;
+		n = n * 10 + s[i] - '0';
+	}
+	return n;
+}
+
+static int
+compare(const void *p1, const void *p2)
+{
+	return strcmp(*(char * const *)p1, *(char * const *)p2);
+}
+
+static char *
+append_text(char *p, char *text, size_t len)
+{
+	(void)memcpy(p, text, len);
+	return p + len;
+}
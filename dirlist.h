@@ -0,0 +1,29 @@
+#ifndef _DIRLIST_H_
+#define _DIRLIST_H_
+
+/* larger directories are sent in the order they are read, unsorted */
+#define DIRLIST_SORT_MAX	4096
+
+/* bytes of directory entries read at once */
+#define DIRLIST_BATCH		32768
+
+/* entries on a page by default and at most */
+#define DIRLIST_LIMIT		100
+#define DIRLIST_LIMIT_MAX	1000
+
+/* formats of an index */
+#define DIRLIST_HTML		0
+#define DIRLIST_JSON		1
+#define DIRLIST_NDJSON		2
+
+struct dirstream;
+
+BOOL dirlist_query(char *, long *, long *);
+int dirlist_format(char *, char *);
+char *dirlist_type(int);
+char *dirlist_render(int, char *, int, long, long, size_t *, int *);
+struct dirstream *dirlist_stream(int, char *, int, BOOL, int *);
+void dirlist_queue(struct conn *, struct dirstream *);
+void dirlist_close(void *);
+
+#endif /* !_DIRLIST_H_ */
@@ -0,0 +1,329 @@
+/*
+ * This program contains the event loop of the server. A
+ * single process multiplexes all client connections with
+ * epoll(7). Every connection moves from reading its request
+ * head to writing the queued response; a persistent connection
+ * then goes back to reading, the others are closed. Connections
+ * which stay idle for HTTP_KEEPALIVE_TIMEOUT seconds are closed.
+ */
+#ifdef _LINUX_
+
+#define _GNU_SOURCE	/* accept4(2) */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <bsd/stdlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jstring.h"
+#include "macros.h"
+#include "sws.h"
+#include "http.h"
+#include "conn.h"
+#include "net.h"
+#include "fcache.h"
+#include "event.h"
+
+static void accept_conns(int, int);
+static void handle_conn(struct swsopt *, int, struct conn *);
+static void serve_conn(struct swsopt *, int, struct conn *, int);
+static BOOL write_conn(int, struct conn *);
+static BOOL watch_conn(int, struct conn *, uint32_t);
+static void close_conn(int, struct conn *);
+static int next_timeout(void);
+static void close_idle(int);
+static void set_accepting(int, int, BOOL);
+static void perror_exit(char *);
+
+static int listen_fd;
+static int watch_fd;
+static int nconns;
+static int max_conns;
+static BOOL accepting;
+
+/*
+ * This function runs the event loop on the listening
+ * socket sfd. It never returns.
+ */
+void
+event_loop(struct swsopt *so, int sfd)
+{
+	int efd, i, n;
+	struct epoll_event ev, events[EVENT_MAX_EVENTS];
+
+	listen_fd = sfd;
+
+	/* -d only allows one connection at a time */
+	max_conns = so->opt['d'] == TRUE ? 1 : INT_MAX;
+
+	if (fcntl(sfd, F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(sfd, F_SETFD, FD_CLOEXEC) == -1)
+		perror_exit("set listening socket error");
+
+	if ((efd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		perror_exit("create epoll error");
+
+	/* a NULL pointer denotes the listening socket */
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev) == -1)
+		perror_exit("add listening socket error");
+	accepting = TRUE;
+
+	/* changes of cached files, see fcache.c */
+	if ((watch_fd = fcache_watch()) != -1) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &watch_fd;
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, watch_fd, &ev) == -1)
+			perror_exit("add file cache watch error");
+	}
+
+	/*
+	 * Writes to a closed connection must not kill the
+	 * server, and cgi children are reaped automatically.
+	 */
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR ||
+	    signal(SIGCHLD, SIG_IGN) == SIG_ERR)
+		perror_exit("signal error");
+
+	for (;;) {
+		n = epoll_wait(efd, events, EVENT_MAX_EVENTS, next_timeout());
+		fcache_report();
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror_exit("epoll_wait error");
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL)
+				accept_conns(efd, sfd);
+			else if (events[i].data.ptr == &watch_fd)
+				fcache_events();
+			else
+				handle_conn(so, efd,
+				            (struct conn *)events[i].data.ptr);
+		}
+
+		close_idle(efd);
+	}
+}
+
+static void
+accept_conns(int efd, int sfd)
+{
+	int cfd;
+	struct conn *c;
+	struct sockaddr_storage client;
+	socklen_t client_len;
+	struct epoll_event ev;
+
+	while (nconns < max_conns) {
+		client_len = sizeof(struct sockaddr_storage);
+		cfd = accept4(sfd, (struct sockaddr *)&client, &client_len,
+		              SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cfd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			/* wait until a connection was closed */
+			if ((errno == EMFILE || errno == ENFILE) && nconns > 0)
+				set_accepting(efd, sfd, FALSE);
+			return;
+		}
+
+		c = conn_create(cfd, (struct sockaddr *)&client);
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, cfd, &ev) == -1) {
+			conn_free(c);
+			continue;
+		}
+		nconns++;
+	}
+
+	set_accepting(efd, sfd, FALSE);
+}
+
+/*
+ * This function moves the connection to its next state
+ * when its socket became readable or writable.
+ */
+static void
+handle_conn(struct swsopt *so, int efd, struct conn *c)
+{
+	int result;
+
+	conn_touch(c);
+
+	if (c->state == CONN_WRITING) {
+		/* a pipelined request may be waiting in the buffer */
+		if (write_conn(efd, c) == TRUE && c->head_end != 0)
+			serve_conn(so, efd, c, CONN_DONE);
+		return;
+	}
+
+	result = conn_read(c);
+	if (result != CONN_AGAIN)
+		serve_conn(so, efd, c, result);
+}
+
+/*
+ * This function handles the result of reading a request
+ * head. All requests the client already sent, up to
+ * CONN_PIPELINE_MAX, are answered before the responses
+ * are written together.
+ */
+static void
+serve_conn(struct swsopt *so, int efd, struct conn *c, int result)
+{
+	int n;
+
+	if (result != CONN_DONE) {
+		if (result == CONN_ERROR || c->head_len == c->head_start)
+			close_conn(efd, c);
+		else {
+			send_err(c, Bad_Request);
+			(void)write_conn(efd, c);
+		}
+		return;
+	}
+
+	do {
+		for (n = 1; ; n++) {
+			do_http(so, c);
+
+			/* the connection was handed over to a cgi child process */
+			if (c->state == CONN_CLOSING) {
+				close_conn(efd, c);
+				return;
+			}
+
+			if (c->keep_alive == FALSE || conn_next(c) == FALSE ||
+			    n == CONN_PIPELINE_MAX)
+				break;
+		}
+	} while (write_conn(efd, c) == TRUE && c->head_end != 0);
+}
+
+/*
+ * This function writes the queued response. It returns
+ * TRUE when the response was sent and the connection
+ * waits for the next request.
+ */
+static BOOL
+write_conn(int efd, struct conn *c)
+{
+	int result;
+
+	result = conn_flush(c);
+	if (result == CONN_AGAIN) {
+		if (c->state != CONN_WRITING) {
+			c->state = CONN_WRITING;
+			(void)watch_conn(efd, c, EPOLLOUT);
+		}
+		return FALSE;
+	}
+
+	if (result == CONN_ERROR || c->keep_alive == FALSE) {
+		close_conn(efd, c);
+		return FALSE;
+	}
+
+	if (c->state == CONN_WRITING) {
+		c->state = CONN_READING;
+		return watch_conn(efd, c, EPOLLIN);
+	}
+	return TRUE;
+}
+
+static BOOL
+watch_conn(int efd, struct conn *c, uint32_t events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = c;
+	if (epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &ev) == -1) {
+		close_conn(efd, c);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+close_conn(int efd, struct conn *c)
+{
+	/*
+	 * A cgi child may still hold the socket, so it has to
+	 * be removed from the epoll set explicitly.
+	 */
+	(void)epoll_ctl(efd, EPOLL_CTL_DEL, c->fd, NULL);
+	conn_free(c);
+	nconns--;
+
+	if (accepting == FALSE && nconns < max_conns)
+		set_accepting(efd, listen_fd, TRUE);
+}
+
+/* return the milliseconds until the next connection gets idle */
+static int
+next_timeout(void)
+{
+	struct conn *c;
+	time_t left;
+
+	if ((c = conn_oldest()) == NULL)
+		return -1;
+
+	left = c->last_active + HTTP_KEEPALIVE_TIMEOUT - time(NULL);
+	return left > 0 ? (int)left * 1000 : 0;
+}
+
+static void
+close_idle(int efd)
+{
+	struct conn *c;
+	time_t now;
+
+	now = time(NULL);
+	while ((c = conn_oldest()) != NULL &&
+	       now - c->last_active >= HTTP_KEEPALIVE_TIMEOUT)
+		close_conn(efd, c);
+}
+
+static void
+set_accepting(int efd, int sfd, BOOL flag)
+{
+	struct epoll_event ev;
+
+	if (accepting == flag)
+		return;
+
+	ev.events = flag == TRUE ? EPOLLIN : 0;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(efd, EPOLL_CTL_MOD, sfd, &ev) == -1)
+		perror_exit("change listening socket error");
+	accepting = flag;
+}
+
+static void
+perror_exit(char *message)
+{
+	fprintf(stderr, "%s: ", getprogname());
+	perror(message);
+	exit(EXIT_FAILURE);
+}
+
+#endif /* _LINUX_ */
@@ -0,0 +1,9 @@
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+#define EVENT_MAX_EVENTS 256
+
+/* serve all connections of the listening socket in this process */
+void event_loop(struct swsopt *, int);
+
+#endif /* !_EVENT_H_ */
@@ -0,0 +1,939 @@
+/*
+ * This program runs the scripts named in the file given by -f as
+ * FastCGI applications, so an interpreter is started once for many
+ * requests instead of once for each. One script per line:
+ *
+ *	/app.fcgi	2	8	1000
+ *
+ * is /cgi-bin/app.fcgi, the file app.fcgi in the directory of -c,
+ * with at least 2 and at most 8 workers, each of which is replaced
+ * after 1000 requests (0 keeps it). The path after the name of the
+ * script is its PATH_INFO.
+ *
+ * A manager process forked at startup owns the workers. Each one
+ * is the script, started with a listening socket of its own as
+ * FCGI_LISTENSOCK_FILENO. A request leases a worker: the process
+ * serving it connects to the manager and names the script, and the
+ * manager answers with an idle worker, starts one below the maximum,
+ * or queues the request until one is free. The serving process then
+ * talks to the worker over its socket with the FastCGI records and
+ * copies FCGI_STDOUT to the client, as the output of a CGI program.
+ * Closing the connection to the manager gives the worker back, so a
+ * serving process that dies can't keep it.
+ */
+#ifdef _LINUX_
+#include <sys/prctl.h>
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#ifdef _LINUX_
+#include <bsd/stdlib.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jstring.h"
+#include "macros.h"
+#include "http.h"
+#include "cgi.h"
+#include "fastcgi.h"
+
+/* the records of the FastCGI specification used here */
+#define FCGI_VERSION_1			1
+#define FCGI_BEGIN_REQUEST		1
+#define FCGI_END_REQUEST		3
+#define FCGI_PARAMS				4
+#define FCGI_STDIN				5
+#define FCGI_STDOUT				6
+#define FCGI_STDERR				7
+#define FCGI_RESPONDER			1
+#define FCGI_HEADER_LEN			8
+#define FCGI_LISTENSOCK_FILENO	0
+
+/* one request per connection, it always has the same id */
+#define FCGI_REQUEST_ID			1
+
+/* the parameters of a request fit into one record */
+#define FCGI_PARAMS_MAX		(2 * HTTP_REQUEST_MAX_LENGTH + 2 * PATH_MAX)
+
+/*
+ * worker
+ * A running script, listening on the socket named by the index of
+ * its pool and id. client holds the lease, NULL when it's idle;
+ * broken tells that it failed a request and must not get another.
+ */
+struct worker {
+	pid_t pid;
+	int id;
+	int served;
+	struct client *client;
+	BOOL broken;
+	time_t started;
+	time_t since;		/* idle or leased since */
+	struct worker *next;
+};
+
+/*
+ * pool
+ * A script of the file and its workers. A worker which died within
+ * a second of its start stops more from being started until failed
+ * is a second ago.
+ */
+struct pool {
+	char *name;			/* beneath the cgi directory, from '/' */
+	size_t len;
+	char *path;			/* absolute name of the script */
+	char *dir;			/* its directory, the working directory */
+	int min;
+	int max;
+	int recycle;		/* requests before a worker is replaced, or 0 */
+	struct worker *workers;
+	int nworkers;
+	int nqueued;
+	int next_id;
+	time_t failed;
+};
+
+/*
+ * client
+ * A connection to the manager: pool is -1 until it named the script,
+ * then it waits in the queue of the pool until it's leased.
+ */
+struct client {
+	int fd;
+	int pool;
+	BOOL leased;
+	struct worker *w;	/* NULL if it was stopped during the lease */
+	struct client *prev;
+	struct client *next;
+};
+
+static void load_error(char *, int, char *);
+static int find_pool(char *);
+static void socket_addr(struct sockaddr_un *, int, int);
+static int connect_to(struct sockaddr_un *);
+static BOOL read_full(int, char *, size_t, time_t);
+static BOOL write_full(int, char *, size_t);
+static int exchange(struct cgi_request *, struct http_response *, int,
+                    char *, int, BOOL *);
+static size_t add_record(char *, int, size_t);
+static BOOL add_param(char *, size_t *, char *, char *);
+static char *method_name(int);
+static void manage(int);
+static void stop_manager(int);
+static void accept_client(int);
+static void readable(struct client *);
+static void drop_client(struct client *);
+static void tend(struct pool *, time_t);
+static struct worker *spawn(struct pool *, time_t);
+static void run_worker(struct pool *, int);
+static void retire(struct pool *, struct worker *, int);
+static void reap(time_t);
+
+static struct pool pools[FCGI_SCRIPTS_MAX];
+static int npools;
+
+static char sock_dir[] = FCGI_SOCKET_DIR;
+static pid_t server_pid;
+static volatile sig_atomic_t stopping;
+
+/* the connections to the manager in the order they came */
+static struct client *clients;
+static struct client *clients_tail;
+static int nclients;
+
+/* the environment of a worker, a request brings its own variables */
+static char *worker_env[] = {
+	"GATEWAY_INTERFACE=CGI/1.1",
+	"SERVER_SOFTWARE=" HTTP_SERVER_NAME,
+	NULL
+};
+
+/*
+ * This function reads the script file and exits if it's not valid,
+ * or if a script isn't an executable file of the cgi directory.
+ */
+void
+fcgi_load(char *file, char *cgi_dir)
+{
+	FILE *fp;
+	char line[FCGI_LINE_MAX];
+	char *name, *field[3], *p, *last, *end;
+	long value[3];
+	struct pool *pl;
+	struct stat buf;
+	int lineno, i;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		(void)fprintf(stderr, "%s: %s: %s\n", getprogname(), file,
+		              strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (lineno = 1; fgets(line, sizeof(line), fp) != NULL; lineno++) {
+		if (strchr(line, '\n') == NULL && !feof(fp))
+			load_error(file, lineno, "line too long");
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+
+		if ((name = strtok_r(line, " \t\r\n", &last)) == NULL)
+			continue;
+		for (i = 0; i < 3; i++) {
+			if ((field[i] = strtok_r(NULL, " \t\r\n", &last)) == NULL)
+				load_error(file, lineno, "missing pool sizes");
+			value[i] = strtol(field[i], &end, 10);
+			if (*end != '\0' || value[i] < 0 ||
+			    value[i] > (i < 2 ? FCGI_WORKERS_MAX : INT_MAX))
+				load_error(file, lineno, "invalid pool size");
+		}
+		if (strtok_r(NULL, " \t\r\n", &last) != NULL)
+			load_error(file, lineno, "trailing fields");
+		if (name[0] != '/' || name[strlen(name) - 1] == '/' ||
+		    strstr(name, "/.") != NULL)
+			load_error(file, lineno, "invalid script name");
+		if (value[1] < 1 || value[0] > value[1])
+			load_error(file, lineno, "invalid pool size");
+		if (find_pool(name) != -1)
+			load_error(file, lineno, "script given twice");
+		if (npools == FCGI_SCRIPTS_MAX)
+			load_error(file, lineno, "too many scripts");
+
+		pl = &pools[npools];
+		pl->len = strlen(name);
+		MALLOC(pl->name, char, pl->len + 1);
+		(void)strcpy(pl->name, name);
+		MALLOC(pl->path, char, strlen(cgi_dir) + pl->len + 1);
+		(void)strcpy(pl->path, cgi_dir);
+		(void)strcat(pl->path, name);
+		MALLOC(pl->dir, char, strlen(pl->path) + 1);
+		(void)strcpy(pl->dir, pl->path);
+		*strrchr(pl->dir, '/') = '\0';
+		if (pl->dir[0] == '\0')
+			(void)strcpy(pl->dir, "/");
+		pl->min = (int)value[0];
+		pl->max = (int)value[1];
+		pl->recycle = (int)value[2];
+
+		if (stat(pl->path, &buf) == -1 || !S_ISREG(buf.st_mode) ||
+		    access(pl->path, X_OK) == -1)
+			load_error(file, lineno, "script is not an executable file");
+		npools++;
+	}
+
+	(void)fclose(fp);
+}
+
+/*
+ * This function starts the manager process and returns 0, or -1
+ * and sets errno. Its socket listens before the server does, so
+ * no request finds it missing.
+ */
+int
+fcgi_start(void)
+{
+	struct sockaddr_un addr;
+	int lfd;
+	pid_t pid;
+
+	if (mkdtemp(sock_dir) == NULL)
+		return -1;
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	socket_addr(&addr, -1, 0);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(lfd, SOMAXCONN) == -1 ||
+	    fcntl(lfd, F_SETFD, FD_CLOEXEC) == -1) {
+		(void)close(lfd);
+		return -1;
+	}
+
+	server_pid = getpid();
+	if ((pid = fork()) == -1) {
+		(void)close(lfd);
+		return -1;
+	}
+	if (pid > 0) {
+		(void)close(lfd);
+		return 0;
+	}
+
+	manage(lfd);
+	_exit(EXIT_SUCCESS);
+}
+
+/* This function tells if url is one of the scripts of the file. */
+BOOL
+is_fastcgi_call(char *url)
+{
+	if (npools == 0 || strncmp(url, "/cgi-bin", 8) != 0)
+		return FALSE;
+	return find_pool(url + 8) != -1;
+}
+
+/*
+ * This function serves a request with a worker of its script, see
+ * call_cgi(). It returns OK once the output was sent, or an http
+ * error status code if nothing was.
+ */
+int
+call_fastcgi(struct cgi_request *cgi_req, struct http_response *h_res)
+{
+	struct sockaddr_un addr;
+	int pool, id, mfd, wfd, status;
+	BOOL broken;
+
+	/* the name of the script and PATH_INFO follow /cgi-bin */
+	jstr_trunc(cgi_req->uri, 8, jstr_length(cgi_req->uri) - 8);
+	if ((pool = find_pool(jstr_cstr(cgi_req->uri))) == -1)
+		return Not_Found;
+
+	/* a worker is leased from the manager, it may queue the request */
+	socket_addr(&addr, -1, 0);
+	if ((mfd = connect_to(&addr)) == -1)
+		return Service_Unavailable;
+	if (write_full(mfd, (char *)&pool, sizeof(pool)) == FALSE ||
+	    read_full(mfd, (char *)&id, sizeof(id),
+	              time(NULL) + FCGI_QUEUE_TIMEOUT) == FALSE) {
+		(void)close(mfd);
+		return Service_Unavailable;
+	}
+	if (id < 0) {
+		(void)close(mfd);
+		return -id;
+	}
+
+	socket_addr(&addr, pool, id);
+	broken = TRUE;
+	if ((wfd = connect_to(&addr)) == -1)
+		status = Bad_Gateway;
+	else {
+		status = exchange(cgi_req, h_res, pool,
+		                  jstr_cstr(cgi_req->uri) + pools[pool].len,
+		                  wfd, &broken);
+		(void)close(wfd);
+	}
+
+	/* a worker which failed the request is replaced */
+	if (broken == TRUE)
+		(void)write_full(mfd, "x", 1);
+	(void)close(mfd);
+	return status;
+}
+
+/* The index of the pool of the script which name starts, or -1. */
+static int
+find_pool(char *name)
+{
+	int i;
+
+	for (i = 0; i < npools; i++)
+		if (strncmp(name, pools[i].name, pools[i].len) == 0 &&
+		    (name[pools[i].len] == '\0' || name[pools[i].len] == '/'))
+			return i;
+	return -1;
+}
+
+/* the socket of worker id of pool, or of the manager if pool is -1 */
+static void
+socket_addr(struct sockaddr_un *addr, int pool, int id)
+{
+	(void)memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (pool == -1)
+		(void)snprintf(addr->sun_path, sizeof(addr->sun_path),
+		               "%s/manager", sock_dir);
+	else
+		(void)snprintf(addr->sun_path, sizeof(addr->sun_path),
+		               "%s/%d.%d", sock_dir, pool, id);
+}
+
+static int
+connect_to(struct sockaddr_un *addr)
+{
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) == -1) {
+		(void)close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* read len bytes unless the connection ends or deadline passes */
+static BOOL
+read_full(int fd, char *buf, size_t len, time_t deadline)
+{
+	struct pollfd pfd;
+	ssize_t n;
+	time_t now;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (len > 0) {
+		if ((now = time(NULL)) >= deadline)
+			return FALSE;
+		if ((n = poll(&pfd, 1, (int)(deadline - now) * 1000)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		if (n == 0)
+			continue;
+		if ((n = read(fd, buf, len)) == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FALSE;
+		buf += n;
+		len -= n;
+	}
+	return TRUE;
+}
+
+static BOOL
+write_full(int fd, char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		buf += n;
+		len -= n;
+	}
+	return TRUE;
+}
+
+/*
+ * This function sends the request to the worker on wfd and copies
+ * its output to the client. The head of the response goes out with
+ * the first output, so a worker that fails before is a 502, or a 504
+ * when it takes longer than MAX_CGI_EXEC_TIME. broken is set unless
+ * the worker ended the request.
+ */
+static int
+exchange(struct cgi_request *cgi_req, struct http_response *h_res,
+         int pool, char *path_info, int wfd, BOOL *broken)
+{
+	char req[FCGI_HEADER_LEN * 4 + 8 + FCGI_PARAMS_MAX];
+	char rec[FCGI_HEADER_LEN + 65535 + 255];
+	char resp_buf[HTTP_RESPONSE_MAX_LENGTH];
+	unsigned char *h;
+	size_t len, plen, size;
+	time_t deadline;
+	BOOL started;
+	int type;
+
+	/* FCGI_BEGIN_REQUEST for a responder, the connection is closed */
+	len = add_record(req, FCGI_BEGIN_REQUEST, 8);
+	(void)memset(req + FCGI_HEADER_LEN, 0, 8);
+	req[FCGI_HEADER_LEN + 1] = FCGI_RESPONDER;
+
+	/* the meta variables of call_cgi() and SCRIPT_FILENAME */
+	plen = 0;
+	h = (unsigned char *)req + len + FCGI_HEADER_LEN;
+	if (add_param((char *)h, &plen, "GATEWAY_INTERFACE", "CGI/1.1") == FALSE ||
+	    add_param((char *)h, &plen, "QUERY_STRING",
+	              jstr_cstr(cgi_req->query)) == FALSE ||
+	    add_param((char *)h, &plen, "REMOTE_ADDR",
+	              cgi_req->client_ip) == FALSE ||
+	    add_param((char *)h, &plen, "REQUEST_METHOD",
+	              method_name(cgi_req->request_method)) == FALSE ||
+	    add_param((char *)h, &plen, "SCRIPT_NAME", pools[pool].path) == FALSE ||
+	    add_param((char *)h, &plen, "SCRIPT_FILENAME",
+	              pools[pool].path) == FALSE ||
+	    add_param((char *)h, &plen, "SERVER_NAME",
+	              cgi_req->server_name) == FALSE ||
+	    add_param((char *)h, &plen, "SERVER_PORT",
+	              cgi_req->server_port) == FALSE ||
+	    add_param((char *)h, &plen, "SERVER_PROTOCOL", HTTP_VERSION) == FALSE ||
+	    add_param((char *)h, &plen, "SERVER_SOFTWARE",
+	              HTTP_SERVER_NAME) == FALSE ||
+	    (*path_info != '\0' &&
+	     add_param((char *)h, &plen, "PATH_INFO", path_info) == FALSE) ||
+	    (cgi_req->host != NULL &&
+	     add_param((char *)h, &plen, "HTTP_HOST", cgi_req->host) == FALSE) ||
+	    (cgi_req->user_agent != NULL &&
+	     add_param((char *)h, &plen, "HTTP_USER_AGENT",
+	               cgi_req->user_agent) == FALSE)) {
+		*broken = FALSE;
+		return Internal_Server_Error;
+	}
+	len += add_record(req + len, FCGI_PARAMS, plen);
+
+	/* the ends of the parameters and of the empty body */
+	len += add_record(req + len, FCGI_PARAMS, 0);
+	len += add_record(req + len, FCGI_STDIN, 0);
+	if (write_full(wfd, req, len) == FALSE)
+		return Bad_Gateway;
+
+	started = FALSE;
+	deadline = time(NULL) + MAX_CGI_EXEC_TIME;
+	h = (unsigned char *)rec;
+	for (;;) {
+		if (read_full(wfd, rec, FCGI_HEADER_LEN, deadline) == FALSE)
+			break;
+		type = h[1];
+		len = (size_t)h[4] << 8 | h[5];
+		if (h[0] != FCGI_VERSION_1 ||
+		    read_full(wfd, rec, len + h[6], deadline) == FALSE)
+			break;
+
+		if (type == FCGI_STDOUT && len > 0) {
+			if (started == FALSE) {
+				h_res->last_modified = time(NULL);
+				h_res->http_status = OK;
+				h_res->body_flag = 0;
+				size = 0;
+				(void)cgi_response(h_res, resp_buf,
+				                   HTTP_RESPONSE_MAX_LENGTH, &size);
+				if (write_full(cgi_req->cfd, resp_buf, size) == FALSE)
+					return OK;
+				started = TRUE;
+			}
+			/* the client is gone, the worker learns it from the close */
+			if (write_full(cgi_req->cfd, rec, len) == FALSE)
+				return OK;
+		} else if (type == FCGI_STDERR)
+			(void)write_full(STDERR_FILENO, rec, len);
+		else if (type == FCGI_END_REQUEST) {
+			*broken = FALSE;
+			return started == TRUE ? OK : Bad_Gateway;
+		}
+	}
+
+	if (started == TRUE)
+		return OK;
+	return time(NULL) >= deadline ? Gateway_Timeout : Bad_Gateway;
+}
+
+/*
+ * Write the header of a record of type with len bytes of content
+ * to buf, the content follows it. It returns the size of the header
+ * and the content; there's no padding.
+ */
+static size_t
+add_record(char *buf, int type, size_t len)
+{
+	buf[0] = FCGI_VERSION_1;
+	buf[1] = (char)type;
+	buf[2] = 0;
+	buf[3] = FCGI_REQUEST_ID;
+	buf[4] = (char)(len >> 8);
+	buf[5] = (char)len;
+	buf[6] = 0;
+	buf[7] = 0;
+	return FCGI_HEADER_LEN + len;
+}
+
+/*
+ * Add a name-value pair to the len bytes of parameters in buf, each
+ * length in one byte below 128 and in four otherwise. It returns
+ * FALSE if they don't fit into FCGI_PARAMS_MAX bytes.
+ */
+static BOOL
+add_param(char *buf, size_t *len, char *name, char *value)
+{
+	size_t n[2], i;
+	char *s[2];
+	int k;
+
+	s[0] = name;
+	s[1] = value;
+	n[0] = strlen(name);
+	n[1] = strlen(value);
+	if (*len + n[0] + n[1] + 8 > FCGI_PARAMS_MAX)
+		return FALSE;
+
+	i = *len;
+	for (k = 0; k < 2; k++)
+		if (n[k] < 128)
+			buf[i++] = (char)n[k];
+		else {
+			buf[i++] = (char)(n[k] >> 24 | 0x80);
+			buf[i++] = (char)(n[k] >> 16);
+			buf[i++] = (char)(n[k] >> 8);
+			buf[i++] = (char)n[k];
+		}
+	for (k = 0; k < 2; k++) {
+		(void)memcpy(buf + i, s[k], n[k]);
+		i += n[k];
+	}
+	*len = i;
+	return TRUE;
+}
+
+static char *
+method_name(int method)
+{
+	if (method == GET)
+		return "GET";
+	else if (method == POST)
+		return "POST";
+	else if (method == HEAD)
+		return "HEAD";
+	return "";
+}
+
+static void
+load_error(char *file, int lineno, char *msg)
+{
+	(void)fprintf(stderr, "%s: %s:%d: %s\n", getprogname(), file, lineno,
+	              msg);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * The loop of the manager. It starts the minimum of workers, leases
+ * them to the requests in the order they came, and stops with the
+ * server, taking its workers and sockets along.
+ */
+static void
+manage(int lfd)
+{
+	struct sockaddr_un addr;
+	struct pollfd *pfd;
+	struct client *c, *next;
+	struct worker *w;
+	time_t now;
+	int i, n;
+
+	if (signal(SIGTERM, &stop_manager) == SIG_ERR ||
+	    signal(SIGINT, &stop_manager) == SIG_ERR ||
+	    signal(SIGCHLD, SIG_DFL) == SIG_ERR ||
+	    signal(SIGPIPE, SIG_IGN) == SIG_ERR ||
+	    signal(SIGHUP, SIG_IGN) == SIG_ERR ||
+	    signal(SIGUSR1, SIG_IGN) == SIG_ERR)
+		_exit(EXIT_FAILURE);
+
+	MALLOC(pfd, struct pollfd, FCGI_CLIENTS_MAX + 1);
+	while (stopping == 0 && getppid() == server_pid) {
+		now = time(NULL);
+		reap(now);
+		for (i = 0; i < npools; i++)
+			tend(&pools[i], now);
+
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		n = 1;
+		for (c = clients; c != NULL; c = c->next) {
+			pfd[n].fd = c->fd;
+			pfd[n++].events = POLLIN;
+		}
+		if (poll(pfd, n, 1000) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* the clients are in the order of pfd */
+		n = 1;
+		for (c = clients; c != NULL; c = next) {
+			next = c->next;
+			if (pfd[n++].revents != 0)
+				readable(c);
+		}
+		if (pfd[0].revents & POLLIN)
+			accept_client(lfd);
+	}
+
+	for (i = 0; i < npools; i++)
+		while ((w = pools[i].workers) != NULL)
+			retire(&pools[i], w, SIGTERM);
+	socket_addr(&addr, -1, 0);
+	(void)unlink(addr.sun_path);
+	(void)rmdir(sock_dir);
+}
+
+static void
+stop_manager(int signum)
+{
+	stopping = 1;
+}
+
+static void
+accept_client(int lfd)
+{
+	struct client *c;
+	int fd;
+
+	if ((fd = accept(lfd, NULL, NULL)) == -1)
+		return;
+	if (nclients == FCGI_CLIENTS_MAX ||
+	    fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+		(void)close(fd);
+		return;
+	}
+
+	MALLOC(c, struct client, 1);
+	c->fd = fd;
+	c->pool = -1;
+	c->leased = FALSE;
+	c->w = NULL;
+	c->prev = clients_tail;
+	c->next = NULL;
+	if (clients_tail != NULL)
+		clients_tail->next = c;
+	else
+		clients = c;
+	clients_tail = c;
+	nclients++;
+}
+
+/*
+ * A client names its script, and then only writes to tell that
+ * its worker failed, before it closes the connection.
+ */
+static void
+readable(struct client *c)
+{
+	int pool, status;
+	char byte;
+
+	if (c->pool == -1) {
+		if (read(c->fd, &pool, sizeof(pool)) != sizeof(pool) ||
+		    pool < 0 || pool >= npools) {
+			drop_client(c);
+			return;
+		}
+		if (pools[pool].nqueued == FCGI_QUEUE_MAX) {
+			status = -Service_Unavailable;
+			(void)write(c->fd, &status, sizeof(status));
+			drop_client(c);
+			return;
+		}
+		c->pool = pool;
+		pools[pool].nqueued++;
+		return;
+	}
+
+	if (c->leased == TRUE && read(c->fd, &byte, 1) == 1) {
+		if (c->w != NULL)
+			c->w->broken = TRUE;
+		return;
+	}
+	drop_client(c);
+}
+
+/*
+ * Close the connection of a client and give its worker back, which
+ * is replaced if it failed or served as many requests as it may.
+ */
+static void
+drop_client(struct client *c)
+{
+	struct worker *w;
+	struct pool *pl;
+
+	if (c->pool != -1) {
+		pl = &pools[c->pool];
+		if (c->leased == FALSE)
+			pl->nqueued--;
+		else if ((w = c->w) != NULL) {
+			w->client = NULL;
+			w->since = time(NULL);
+			if (w->broken == TRUE)
+				retire(pl, w, SIGKILL);
+			else if (pl->recycle > 0 && w->served >= pl->recycle)
+				retire(pl, w, SIGTERM);
+		}
+	}
+
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		clients = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	else
+		clients_tail = c->prev;
+	nclients--;
+	(void)close(c->fd);
+	free(c);
+}
+
+/*
+ * Lease idle workers, or new ones up to the maximum, to the queued
+ * requests of a pool, keep its minimum running, and stop workers
+ * idle for FCGI_IDLE_TIMEOUT above the minimum or leased for longer
+ * than MAX_CGI_EXEC_TIME.
+ */
+static void
+tend(struct pool *pl, time_t now)
+{
+	struct client *c, *next;
+	struct worker *w, *wnext;
+	int pool;
+
+	pool = (int)(pl - pools);
+	for (c = clients; c != NULL && pl->nqueued > 0; c = next) {
+		next = c->next;
+		if (c->pool != pool || c->leased == TRUE)
+			continue;
+		for (w = pl->workers; w != NULL; w = w->next)
+			if (w->client == NULL)
+				break;
+		if (w == NULL && (w = spawn(pl, now)) == NULL)
+			break;
+		if (write_full(c->fd, (char *)&w->id, sizeof(w->id)) == FALSE) {
+			drop_client(c);
+			continue;
+		}
+		pl->nqueued--;
+		c->leased = TRUE;
+		c->w = w;
+		w->client = c;
+		w->served++;
+		w->since = now;
+	}
+
+	while (pl->nworkers < pl->min && spawn(pl, now) != NULL)
+		;
+
+	for (w = pl->workers; w != NULL; w = wnext) {
+		wnext = w->next;
+		if (w->client == NULL && pl->nworkers > pl->min &&
+		    now - w->since >= FCGI_IDLE_TIMEOUT)
+			retire(pl, w, SIGTERM);
+		else if (w->client != NULL && now - w->since > MAX_CGI_EXEC_TIME)
+			retire(pl, w, SIGKILL);
+	}
+}
+
+/* start a worker of a pool, NULL at the maximum or after a failure */
+static struct worker *
+spawn(struct pool *pl, time_t now)
+{
+	struct sockaddr_un addr;
+	struct worker *w;
+	int lfd, id;
+	pid_t pid;
+
+	if (pl->nworkers >= pl->max || now - pl->failed < 1)
+		return NULL;
+
+	id = pl->next_id++;
+	socket_addr(&addr, (int)(pl - pools), id);
+	(void)unlink(addr.sun_path);
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return NULL;
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(lfd, FCGI_BACKLOG) == -1 ||
+	    (pid = fork()) == -1) {
+		perror("start fastcgi worker error");
+		(void)close(lfd);
+		(void)unlink(addr.sun_path);
+		pl->failed = now;
+		return NULL;
+	}
+	if (pid == 0)
+		run_worker(pl, lfd);
+	(void)close(lfd);
+
+	MALLOC(w, struct worker, 1);
+	w->pid = pid;
+	w->id = id;
+	w->served = 0;
+	w->client = NULL;
+	w->broken = FALSE;
+	w->started = now;
+	w->since = now;
+	w->next = pl->workers;
+	pl->workers = w;
+	pl->nworkers++;
+	return w;
+}
+
+/* the child of spawn() runs the script with its socket */
+static void
+run_worker(struct pool *pl, int lfd)
+{
+	if (lfd != FCGI_LISTENSOCK_FILENO) {
+		if (dup2(lfd, FCGI_LISTENSOCK_FILENO) == -1)
+			_exit(EXIT_FAILURE);
+		(void)close(lfd);
+	}
+	closefrom(STDERR_FILENO + 1);
+
+	/* ignored signals stay ignored across exec */
+	(void)signal(SIGPIPE, SIG_DFL);
+	(void)signal(SIGHUP, SIG_DFL);
+	(void)signal(SIGUSR1, SIG_DFL);
+#ifdef _LINUX_
+	/* the manager may be killed before it can stop its workers */
+	(void)prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+
+	if (chdir(pl->dir) == -1)
+		perror("chdir error: ");
+	if (execle(pl->path, pl->path, (char *)NULL, worker_env) == -1)
+		perror("exec error: ");
+	_exit(EXIT_FAILURE);
+}
+
+/*
+ * Stop a worker with signo and forget it; reap() collects the
+ * process. A lease it's under ends with the connection of its
+ * client, see call_fastcgi().
+ */
+static void
+retire(struct pool *pl, struct worker *w, int signo)
+{
+	struct sockaddr_un addr;
+	struct worker **pp;
+
+	(void)kill(w->pid, signo);
+	socket_addr(&addr, (int)(pl - pools), w->id);
+	(void)unlink(addr.sun_path);
+	if (w->client != NULL)
+		w->client->w = NULL;
+
+	for (pp = &pl->workers; *pp != w; pp = &(*pp)->next)
+		;
+	*pp = w->next;
+	pl->nworkers--;
+	free(w);
+}
+
+/*
+ * Collect the workers which exited. One that wasn't stopped is
+ * forgotten, and if it didn't live for a second, no other worker
+ * of its script is started for a second.
+ */
+static void
+reap(time_t now)
+{
+	struct worker *w;
+	pid_t pid;
+	int i;
+
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+		for (i = 0; i < npools; i++) {
+			for (w = pools[i].workers; w != NULL; w = w->next)
+				if (w->pid == pid)
+					break;
+			if (w == NULL)
+				continue;
+			if (now - w->started < 1)
+				pools[i].failed = now;
+			retire(&pools[i], w, 0);
+			break;
+		}
+}
@@ -0,0 +1,32 @@
+#ifndef _FASTCGI_H_
+#define _FASTCGI_H_
+
+/* scripts read from the file given by -f at most, and its longest line */
+#define FCGI_SCRIPTS_MAX	64
+#define FCGI_LINE_MAX		1024
+
+/* workers of one script at most */
+#define FCGI_WORKERS_MAX	256
+
+/* requests waiting for a worker of a script at most, and how long */
+#define FCGI_QUEUE_MAX		128
+#define FCGI_QUEUE_TIMEOUT	10	/* seconds */
+
+/* requests the manager holds at once, leased or waiting */
+#define FCGI_CLIENTS_MAX	1024
+
+/* a worker above the minimum of its script stops when idle this long */
+#define FCGI_IDLE_TIMEOUT	60	/* seconds */
+
+/* connections waiting on the socket of a worker */
+#define FCGI_BACKLOG		4
+
+/* where the sockets of the manager and the workers are made */
+#define FCGI_SOCKET_DIR		"/tmp/sws.XXXXXX"
+
+void fcgi_load(char *, char *);
+int fcgi_start(void);
+BOOL is_fastcgi_call(char *);
+int call_fastcgi(struct cgi_request *, struct http_response *);
+
+#endif /* !_FASTCGI_H_ */
@@ -0,0 +1,881 @@
+/*
+ * This program contains the cache of file metadata used to serve
+ * static content. For each path it keeps the open file and what
+ * fstat(2) returned for it, so requests for a hot file need no
+ * system call to find it. A file is opened beneath its root with
+ * canon_open(), which walks only the path under the root.
+ *
+ * An entry expires after the lifetime given by -t. On Linux the
+ * directories of cached entries are watched with inotify(7), and
+ * all entries of a directory are dropped as soon as something in
+ * it changes; the event loops call fcache_events() when the
+ * descriptor returned by fcache_watch() becomes readable.
+ *
+ * The content of small files and their response head are kept
+ * in memory as well, so such a hit costs no disk I/O at all, and
+ * so are the rendered indexes of directories. They share the
+ * budget given by -M; when it's used up, the least recently used
+ * entries are dropped. An entry whose lifetime is over is kept
+ * with all of it if fstatat(2) shows the same version of the file.
+ * SIGUSR1 makes the server report how many bodies were served from
+ * memory.
+ *
+ * Paths which don't exist are kept as well, up to FCACHE_MISSING_MAX
+ * of them, so a flood of requests for them costs no system call.
+ * Such a path can only come into being in the deepest directory of
+ * it which exists, so that one is watched, and its modification time
+ * is compared when the entry expires. A Bloom filter of the missing
+ * paths is tested first, so a path looked up for the first time
+ * isn't searched for among them.
+ */
+#ifdef _LINUX_
+#define _GNU_SOURCE	/* O_PATH */
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _LINUX_
+#include <sys/inotify.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "macros.h"
+#include "canon.h"
+#include "fcache.h"
+
+/* the name of the entry e beneath its root */
+#define REL(e)			((e)->path + (e)->rel)
+
+/* nanoseconds of the modification time in a struct stat */
+#ifdef _LINUX_
+#define MTIME_NSEC(st)	((st).st_mtim.tv_nsec)
+#else
+#define MTIME_NSEC(st)	((st).st_mtimespec.tv_nsec)
+#endif
+
+#ifdef _LINUX_
+#define FCACHE_EVENTS \
+	(IN_ATTRIB | IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | \
+	 IN_DELETE_SELF | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+#endif
+
+/*
+ * A path found missing, which is known to be so until dir changes,
+ * the deepest directory on the path which exists. Its name beneath
+ * root is the path from rel up to dir_len.
+ */
+struct missing {
+	char *path;
+	unsigned hash;
+	int root;
+	size_t rel;
+	size_t dir_len;
+	time_t dir_mtime;
+	long dir_mtime_nsec;
+	time_t expires;
+	int wd;
+	struct missing *hnext;
+	struct missing *prev;
+	struct missing *next;
+};
+
+static struct fentry *load(char *, int, char *);
+static BOOL revalidate(struct fentry *, time_t);
+static BOOL make_room(struct fentry *, size_t);
+static void insert(struct fentry *, unsigned, time_t);
+static void drop(struct fentry *);
+static void touch(struct fentry *);
+static unsigned hash(char *);
+static BOOL find_missing(char *, unsigned, time_t);
+static void add_missing(char *, unsigned, int, char *, time_t);
+static BOOL stat_dir(struct missing *, struct stat *);
+static void forget(struct missing *);
+static void bloom_add(unsigned);
+static BOOL bloom_test(unsigned);
+static void request_report(int);
+#ifdef _LINUX_
+static void add_watches(struct fentry *);
+static void drop_watched(int);
+#endif
+
+static int ttl = FCACHE_TTL;
+static int watch_fd = -1;
+static struct fentry *buckets[FCACHE_BUCKETS];
+static int nentries;
+
+static size_t mem_max = FCACHE_MEM * 1024 * 1024;
+static size_t mem_used;
+static unsigned long hits;
+static unsigned long misses;
+static int report_fd = STDERR_FILENO;
+static volatile sig_atomic_t report;
+
+/* all entries, the most recently used first */
+static struct fentry *entries;
+static struct fentry *entries_tail;
+
+/* the missing paths, the most recently used first, and their filter */
+static struct missing *missing_buckets[FCACHE_MISSING_BUCKETS];
+static struct missing *missing;
+static struct missing *missing_tail;
+static int nmissing;
+static int bloom_removed;	/* paths forgotten since it was built */
+static unsigned char bloom[FCACHE_BLOOM_BITS / 8];
+static unsigned long missing_hits;
+
+/*
+ * This function sets the lifetime of entries, 0 disables the
+ * cache, and the memory for file bodies. Reports are written
+ * to fd.
+ */
+void
+fcache_init(int seconds, size_t mem, int fd)
+{
+	ttl = seconds;
+	mem_max = mem;
+	report_fd = fd;
+}
+
+/*
+ * This function starts watching the cached files and returns
+ * the inotify descriptor to poll, or -1. Every process which
+ * serves requests must call it for itself, and then call
+ * fcache_report() whenever it was interrupted by a signal.
+ */
+int
+fcache_watch(void)
+{
+	(void)signal(SIGUSR1, request_report);
+#ifdef _LINUX_
+	if (ttl > 0 && watch_fd == -1)
+		watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+	return watch_fd;
+}
+
+/* drop the entries of every directory reported as changed */
+void
+fcache_events(void)
+{
+#ifdef _LINUX_
+	union {
+		struct inotify_event event;
+		char buf[4096];
+	} u;
+	struct inotify_event *event;
+	ssize_t count;
+	char *p;
+
+	if (watch_fd == -1)
+		return;
+
+	while ((count = read(watch_fd, u.buf, sizeof(u.buf))) > 0) {
+		for (p = u.buf; p < u.buf + count;
+		     p += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event *)p;
+			/* events were lost, nothing can be trusted */
+			if (event->mask & IN_Q_OVERFLOW) {
+				while (entries != NULL)
+					drop(entries);
+				while (missing != NULL)
+					forget(missing);
+			} else
+				drop_watched(event->wd);
+		}
+	}
+#endif
+}
+
+/* write the counters if SIGUSR1 asked for them */
+void
+fcache_report(void)
+{
+	char buf[256];
+	int len;
+
+	if (report == 0)
+		return;
+	report = 0;
+
+	len = snprintf(buf, sizeof(buf),
+	               "file cache: %lu hits, %lu misses, %d entries, "
+	               "%lu of %lu bytes, %lu of %d missing paths\n",
+	               hits, misses, nentries,
+	               (unsigned long)mem_used, (unsigned long)mem_max,
+	               missing_hits, nmissing);
+	(void)write(report_fd, buf, len);
+}
+
+/*
+ * This function returns the entry of path with a reference
+ * the caller has to give back with fcache_put(). rel is the end
+ * of path, its name beneath the open root dir. If it can't be
+ * opened, it returns NULL and errno is set; ENOENT for a path
+ * known to be missing.
+ */
+struct fentry *
+fcache_get(char *path, int dir, char *rel)
+{
+	struct fentry *e;
+	unsigned hv, h;
+	time_t now;
+
+	now = time(NULL);
+	hv = hash(path);
+	h = hv % FCACHE_BUCKETS;
+	for (e = buckets[h]; e != NULL; e = e->hnext)
+		if (strcmp(e->path, path) == 0)
+			break;
+
+	if (e != NULL) {
+		if (now < e->expires || revalidate(e, now)) {
+			touch(e);
+			e->refs++;
+			return e;
+		}
+		drop(e);
+	}
+
+	if (ttl > 0 && find_missing(path, hv, now) == TRUE) {
+		missing_hits++;
+		errno = ENOENT;
+		return NULL;
+	}
+
+	if ((e = load(path, dir, rel)) == NULL) {
+		if (ttl > 0 && (errno == ENOENT || errno == ENOTDIR)) {
+			add_missing(path, hv, dir, rel, now);
+			errno = ENOENT;
+		}
+		return NULL;
+	}
+	if (ttl > 0)
+		insert(e, h, now);
+	return e;
+}
+
+/*
+ * This function opens the file of the entry unless it's open
+ * already. It returns -1 and sets errno if that fails.
+ */
+int
+fcache_open(struct fentry *e)
+{
+	if (e->fd == -1)
+		e->fd = canon_open(e->dir, REL(e), O_RDONLY | O_CLOEXEC);
+	return e->fd;
+}
+
+/*
+ * This function returns the content of a small file, reading
+ * it into memory on the first call. It returns NULL if the body
+ * isn't kept in memory; the file has to be sent from fd then.
+ */
+char *
+fcache_body(struct fentry *e)
+{
+	char *body;
+	size_t size;
+	ssize_t count;
+	off_t offset;
+
+	if (e->body != NULL) {
+		hits++;
+		return e->body;
+	}
+	misses++;
+
+	size = e->size;
+	if (e->expires == 0 || size > FCACHE_BODY_MAX || size > mem_max)
+		return NULL;
+	if (fcache_open(e) == -1)
+		return NULL;
+
+	MALLOC(body, char, size + 1);
+	for (offset = 0; offset < e->size; offset += count) {
+		count = pread(e->fd, body + offset, size - offset, offset);
+		if (count == -1 && errno == EINTR)
+			count = 0;
+		else if (count <= 0) {
+			free(body);
+			return NULL;
+		}
+	}
+
+	if (!make_room(e, size)) {
+		free(body);
+		return NULL;
+	}
+
+	e->body = body;
+	mem_used += size;
+	return body;
+}
+
+/*
+ * This function returns the response head built for the entry
+ * if it's still valid: it was built in this second and has the
+ * same Connection header, content coding, Vary and caching rule.
+ * A precompressed file is sent both as itself and in place of the
+ * original, a file varies once a copy appears next to it, and the
+ * rules depend on the path of the request.
+ */
+char *
+fcache_head(struct fentry *e, BOOL keep_alive, int encoding, int vary,
+            int rule, size_t *len)
+{
+	if (e->head == NULL || e->head_date != time(NULL) ||
+	    e->head_keep_alive != keep_alive || e->head_encoding != encoding ||
+	    e->head_vary != vary || e->head_rule != rule)
+		return NULL;
+
+	*len = e->head_len;
+	return e->head;
+}
+
+void
+fcache_set_head(struct fentry *e, BOOL keep_alive, int encoding, int vary,
+                int rule, char *head, size_t len)
+{
+	if (e->expires == 0)
+		return;
+
+	if (e->head == NULL || e->head_len < len)
+		REALLOC(e->head, char, len);
+	(void)memcpy(e->head, head, len);
+	e->head_len = len;
+	e->head_date = time(NULL);
+	e->head_keep_alive = keep_alive;
+	e->head_encoding = encoding;
+	e->head_vary = vary;
+	e->head_rule = rule;
+}
+
+/*
+ * This function returns the index of a directory rendered for
+ * the request path uri, or NULL if there is none.
+ */
+char *
+fcache_listing(struct fentry *e, char *uri, size_t *len)
+{
+	if (e->listing == NULL || strcmp(e->listing_uri, uri) != 0)
+		return NULL;
+
+	*len = e->listing_len;
+	return e->listing;
+}
+
+/*
+ * This function keeps the rendered index of a directory, which
+ * then belongs to the entry. It returns FALSE if the index can't
+ * be kept; the caller has to free it then. The one kept isn't
+ * replaced while a queued segment may send it: the cache and the
+ * caller hold a reference, any other is such a segment.
+ */
+BOOL
+fcache_set_listing(struct fentry *e, char *uri, char *listing, size_t len)
+{
+	if (e->expires == 0)
+		return FALSE;
+	if (e->listing != NULL && e->refs > 2)
+		return FALSE;
+
+	if (e->listing != NULL) {
+		mem_used -= e->listing_len;
+		free(e->listing);
+		free(e->listing_uri);
+		e->listing = NULL;
+	}
+	if (!make_room(e, len))
+		return FALSE;
+
+	MALLOC(e->listing_uri, char, strlen(uri) + 1);
+	(void)strcpy(e->listing_uri, uri);
+	e->listing = listing;
+	e->listing_len = len;
+	mem_used += len;
+	return TRUE;
+}
+
+/* take another reference, for each segment that sends from e */
+void
+fcache_hold(struct fentry *e)
+{
+	e->refs++;
+}
+
+/* give back a reference, the last one frees the entry */
+void
+fcache_put(struct fentry *e)
+{
+	if (--e->refs > 0)
+		return;
+
+	if (e->fd != -1)
+		(void)close(e->fd);
+	free(e->body);
+	free(e->head);
+	free(e->listing);
+	free(e->listing_uri);
+	free(e->path);
+	free(e);
+}
+
+/*
+ * Open the file and take its metadata from the descriptor, which
+ * is kept for a regular file. It's opened without blocking, as it
+ * may be a FIFO, and only for its metadata if it can't be read,
+ * so a directory which can only be searched may have an index.
+ */
+static struct fentry *
+load(char *path, int dir, char *rel)
+{
+	struct fentry *e;
+	struct stat buf;
+	size_t len;
+	BOOL readable;
+	int fd;
+
+	readable = TRUE;
+	fd = canon_open(dir, rel, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+#ifdef _LINUX_
+	if (fd == -1 && errno == EACCES) {
+		fd = canon_open(dir, rel, O_PATH | O_CLOEXEC);
+		readable = FALSE;
+	}
+#endif
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &buf) == -1) {
+		(void)close(fd);
+		return NULL;
+	}
+
+	MALLOC(e, struct fentry, 1);
+	len = strlen(path);
+	MALLOC(e->path, char, len + 1);
+	(void)memcpy(e->path, path, len + 1);
+
+	e->dir = dir;
+	e->rel = (size_t)(rel - path);
+	e->fd = -1;
+	e->ino = buf.st_ino;
+	e->mode = buf.st_mode;
+	e->size = buf.st_size;
+	e->mtime = buf.st_mtime;
+	e->mtime_nsec = MTIME_NSEC(buf);
+	e->has_index = FALSE;
+	e->body = NULL;
+	e->head = NULL;
+	e->head_len = 0;
+	e->listing = NULL;
+	e->listing_len = 0;
+	e->listing_uri = NULL;
+	e->expires = 0;
+	e->wd = -1;
+	e->dir_wd = -1;
+	e->refs = 1;
+
+	if (S_ISDIR(buf.st_mode) &&
+	    fstatat(fd, "index.html", &buf, 0) != -1 && S_ISREG(buf.st_mode))
+		e->has_index = TRUE;
+
+	/* a regular file is kept open to be read, in blocking mode */
+	if (readable == TRUE && S_ISREG(e->mode) && fcntl(fd, F_SETFL, 0) != -1)
+		e->fd = fd;
+	else
+		(void)close(fd);
+
+	return e;
+}
+
+/*
+ * An entry which outlived its lifetime is still good if the file
+ * is the same: same inode, size, type and modification time.
+ */
+static BOOL
+revalidate(struct fentry *e, time_t now)
+{
+	struct stat buf;
+
+	if (fstatat(e->dir, *REL(e) != '\0' ? REL(e) : ".", &buf, 0) == -1 ||
+	    buf.st_ino != e->ino ||
+	    buf.st_size != e->size || buf.st_mode != e->mode ||
+	    buf.st_mtime != e->mtime || MTIME_NSEC(buf) != e->mtime_nsec)
+		return FALSE;
+
+	e->expires = now + ttl;
+	return TRUE;
+}
+
+/*
+ * Make room for size bytes in memory, dropping the least recently
+ * used entries but not e itself, which was used just now.
+ */
+static BOOL
+make_room(struct fentry *e, size_t size)
+{
+	while (mem_used + size > mem_max && entries_tail != e)
+		drop(entries_tail);
+	return mem_used + size <= mem_max;
+}
+
+/* add a loaded entry to the cache, the oldest one makes room */
+static void
+insert(struct fentry *e, unsigned h, time_t now)
+{
+	if (nentries == FCACHE_MAX)
+		drop(entries_tail);
+
+	e->refs++;
+	e->expires = now + ttl;
+	e->hnext = buckets[h];
+	buckets[h] = e;
+
+	e->prev = NULL;
+	e->next = entries;
+	if (entries != NULL)
+		entries->prev = e;
+	else
+		entries_tail = e;
+	entries = e;
+	nentries++;
+
+#ifdef _LINUX_
+	if (watch_fd != -1)
+		add_watches(e);
+#endif
+}
+
+/* remove the entry from the cache, users keep their references */
+static void
+drop(struct fentry *e)
+{
+	struct fentry **pp;
+
+	for (pp = &buckets[hash(e->path) % FCACHE_BUCKETS]; *pp != e;
+	     pp = &(*pp)->hnext)
+		;
+	*pp = e->hnext;
+	e->expires = 0;
+
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		entries = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		entries_tail = e->prev;
+
+	nentries--;
+	if (e->body != NULL)
+		mem_used -= e->size;
+	if (e->listing != NULL)
+		mem_used -= e->listing_len;
+	fcache_put(e);
+}
+
+static void
+touch(struct fentry *e)
+{
+	if (e == entries)
+		return;
+
+	e->prev->next = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		entries_tail = e->prev;
+
+	e->prev = NULL;
+	e->next = entries;
+	entries->prev = e;
+	entries = e;
+}
+
+/*
+ * Tell if path is known to be missing. An expired entry is good
+ * for another lifetime if its directory wasn't modified.
+ */
+static BOOL
+find_missing(char *path, unsigned hv, time_t now)
+{
+	struct missing *m;
+	struct stat buf;
+
+	if (bloom_test(hv) == FALSE)
+		return FALSE;
+
+	for (m = missing_buckets[hv % FCACHE_MISSING_BUCKETS]; m != NULL;
+	     m = m->hnext)
+		if (m->hash == hv && strcmp(m->path, path) == 0)
+			break;
+	if (m == NULL)
+		return FALSE;
+
+	if (now >= m->expires) {
+		if (stat_dir(m, &buf) == FALSE ||
+		    buf.st_mtime != m->dir_mtime ||
+		    MTIME_NSEC(buf) != m->dir_mtime_nsec) {
+			forget(m);
+			return FALSE;
+		}
+		m->expires = now + ttl;
+	}
+
+	/* the most recently used first */
+	if (m != missing) {
+		m->prev->next = m->next;
+		if (m->next != NULL)
+			m->next->prev = m->prev;
+		else
+			missing_tail = m->prev;
+		m->prev = NULL;
+		m->next = missing;
+		missing->prev = m;
+		missing = m;
+	}
+	return TRUE;
+}
+
+/*
+ * Remember that path beneath the open root dir, at rel, is missing.
+ * Its deepest directory which exists is searched from the parent
+ * up to the root; the oldest path makes room.
+ */
+static void
+add_missing(char *path, unsigned hv, int dir, char *rel, time_t now)
+{
+	struct missing *m;
+	struct stat buf;
+	size_t len, n;
+	char c;
+	int ret;
+
+	MALLOC(m, struct missing, 1);
+	len = strlen(path);
+	MALLOC(m->path, char, len + 1);
+	(void)memcpy(m->path, path, len + 1);
+	m->hash = hv;
+	m->root = dir;
+	m->rel = (size_t)(rel - path);
+	m->wd = -1;
+
+	/* the names of the directories end before a '/' */
+	m->dir_len = len;
+	for (;;) {
+		while (m->dir_len > m->rel && m->path[m->dir_len - 1] != '/')
+			m->dir_len--;
+		if (m->dir_len > m->rel)
+			m->dir_len--;
+		if (stat_dir(m, &buf) == TRUE && S_ISDIR(buf.st_mode))
+			break;
+		if (m->dir_len <= m->rel) {
+			free(m->path);
+			free(m);
+			return;
+		}
+	}
+	m->dir_mtime = buf.st_mtime;
+	m->dir_mtime_nsec = MTIME_NSEC(buf);
+	m->expires = now + ttl;
+
+	/* a dangling link in it is missing until another directory changes */
+	n = m->dir_len > m->rel ? m->dir_len + 1 : m->rel;
+	n += strcspn(m->path + n, "/");
+	c = m->path[n];
+	m->path[n] = '\0';
+	ret = fstatat(m->root, m->path + m->rel, &buf, AT_SYMLINK_NOFOLLOW);
+	m->path[n] = c;
+	if (ret != -1 && S_ISLNK(buf.st_mode)) {
+		free(m->path);
+		free(m);
+		return;
+	}
+
+#ifdef _LINUX_
+	if (watch_fd != -1) {
+		c = m->path[m->dir_len];
+		m->path[m->dir_len] = '\0';
+		m->wd = inotify_add_watch(watch_fd,
+		                          m->dir_len > 0 ? m->path : "/",
+		                          FCACHE_EVENTS);
+		m->path[m->dir_len] = c;
+	}
+#endif
+
+	if (nmissing == FCACHE_MISSING_MAX)
+		forget(missing_tail);
+
+	m->hnext = missing_buckets[hv % FCACHE_MISSING_BUCKETS];
+	missing_buckets[hv % FCACHE_MISSING_BUCKETS] = m;
+	m->prev = NULL;
+	m->next = missing;
+	if (missing != NULL)
+		missing->prev = m;
+	else
+		missing_tail = m;
+	missing = m;
+	nmissing++;
+	bloom_add(hv);
+}
+
+/* fstatat(2) the directory of m beneath its root */
+static BOOL
+stat_dir(struct missing *m, struct stat *buf)
+{
+	char c;
+	int ret;
+
+	if (m->dir_len <= m->rel)
+		return fstatat(m->root, ".", buf, 0) != -1;
+
+	c = m->path[m->dir_len];
+	m->path[m->dir_len] = '\0';
+	ret = fstatat(m->root, m->path + m->rel, buf, 0);
+	m->path[m->dir_len] = c;
+	return ret != -1;
+}
+
+/*
+ * Remove a missing path. The filter can't forget it, so it's built
+ * again from the paths left once as many were removed as it holds.
+ */
+static void
+forget(struct missing *m)
+{
+	struct missing **pp;
+
+	for (pp = &missing_buckets[m->hash % FCACHE_MISSING_BUCKETS];
+	     *pp != m; pp = &(*pp)->hnext)
+		;
+	*pp = m->hnext;
+
+	if (m->prev != NULL)
+		m->prev->next = m->next;
+	else
+		missing = m->next;
+	if (m->next != NULL)
+		m->next->prev = m->prev;
+	else
+		missing_tail = m->prev;
+	nmissing--;
+	free(m->path);
+	free(m);
+
+	if (++bloom_removed >= FCACHE_MISSING_MAX) {
+		(void)memset(bloom, 0, sizeof(bloom));
+		for (m = missing; m != NULL; m = m->next)
+			bloom_add(m->hash);
+		bloom_removed = 0;
+	}
+}
+
+/*
+ * The filter sets FCACHE_BLOOM_HASHES bits for a hash, found by
+ * double hashing: the second hash is the first one mixed again.
+ */
+static void
+bloom_add(unsigned hv)
+{
+	unsigned h2, bit;
+	int i;
+
+	h2 = (hv * 0x9e3779b1U) >> 7 | 1;
+	for (i = 0; i < FCACHE_BLOOM_HASHES; i++) {
+		bit = (hv + i * h2) % FCACHE_BLOOM_BITS;
+		bloom[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+static BOOL
+bloom_test(unsigned hv)
+{
+	unsigned h2, bit;
+	int i;
+
+	h2 = (hv * 0x9e3779b1U) >> 7 | 1;
+	for (i = 0; i < FCACHE_BLOOM_HASHES; i++) {
+		bit = (hv + i * h2) % FCACHE_BLOOM_BITS;
+		if ((bloom[bit / 8] & 1 << (bit % 8)) == 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* FNV-1a */
+static unsigned
+hash(char *s)
+{
+	unsigned h;
+
+	for (h = 2166136261U; *s != '\0'; s++)
+		h = (h ^ (unsigned char)*s) * 16777619U;
+	return h;
+}
+
+static void
+request_report(int signo)
+{
+	report = 1;
+}
+
+#ifdef _LINUX_
+/*
+ * A file changes in its parent directory. A directory is
+ * watched itself as well, since has_index depends on it.
+ */
+static void
+add_watches(struct fentry *e)
+{
+	char *parent;
+	size_t len;
+
+	len = strlen(e->path);
+	while (len > 1 && e->path[len - 1] == '/')
+		len--;
+	while (len > 0 && e->path[len - 1] != '/')
+		len--;
+
+	MALLOC(parent, char, len + 2);
+	if (len == 0)
+		(void)strcpy(parent, ".");
+	else {
+		(void)memcpy(parent, e->path, len);
+		parent[len] = '\0';
+	}
+	e->wd = inotify_add_watch(watch_fd, parent, FCACHE_EVENTS);
+	free(parent);
+
+	if (S_ISDIR(e->mode))
+		e->dir_wd = inotify_add_watch(watch_fd, e->path, FCACHE_EVENTS);
+}
+
+static void
+drop_watched(int wd)
+{
+	struct fentry *e, *next;
+	struct missing *m, *mnext;
+
+	for (e = entries; e != NULL; e = next) {
+		next = e->next;
+		if (e->wd == wd || e->dir_wd == wd)
+			drop(e);
+	}
+	for (m = missing; m != NULL; m = mnext) {
+		mnext = m->next;
+		if (m->wd == wd)
+			forget(m);
+	}
+}
+#endif /* _LINUX_ */
@@ -0,0 +1,85 @@
+#ifndef _FCACHE_H_
+#define _FCACHE_H_
+
+/* default lifetime of an entry in seconds, set by -t */
+#define FCACHE_TTL		10
+
+/* entries kept at most, each may hold an open file */
+#define FCACHE_MAX		256
+#define FCACHE_BUCKETS	512
+
+/* paths known to be missing kept at most, see fcache_get() */
+#define FCACHE_MISSING_MAX		1024
+#define FCACHE_MISSING_BUCKETS	1024
+
+/* bits of the Bloom filter of missing paths and bits set for each */
+#define FCACHE_BLOOM_BITS		65536
+#define FCACHE_BLOOM_HASHES		3
+
+/* files up to this size are kept in memory, in a budget set by -M */
+#define FCACHE_BODY_MAX	65536
+#define FCACHE_MEM		32		/* megabytes */
+
+/*
+ * fentry
+ * The metadata of one file or directory, keyed by its path. The
+ * file is opened beneath the root dir by the name at rel in path,
+ * see canon.c, and its metadata comes from fstat(2) on it. A
+ * regular file keeps fd open until the entry is dropped.
+ * A small file's content is kept in body, and head holds the
+ * 200 response head built for it in the second head_date, for
+ * the content coding head_encoding, head_vary if it varied by the
+ * coding, and the caching rule head_rule it was served with.
+ * has_index tells if a directory contains an index.html file,
+ * listing holds the index rendered for it, for the request path
+ * listing_uri, since the path is part of the page.
+ *
+ * Every user holds a reference: the cache itself, a request
+ * being handled and each queued segment that sends from fd.
+ */
+struct fentry {
+	char *path;
+	int dir;			/* the open root of the path */
+	size_t rel;			/* the name beneath dir starts here */
+	int fd;
+	ino_t ino;
+	mode_t mode;
+	off_t size;
+	time_t mtime;
+	long mtime_nsec;
+	BOOL has_index;
+	char *body;
+	char *head;
+	size_t head_len;
+	time_t head_date;
+	BOOL head_keep_alive;
+	int head_encoding;
+	int head_vary;
+	int head_rule;
+	char *listing;
+	size_t listing_len;
+	char *listing_uri;
+	time_t expires;		/* 0 once the entry left the cache */
+	int wd;				/* inotify watch of the parent directory */
+	int dir_wd;			/* inotify watch of a directory itself */
+	int refs;
+	struct fentry *hnext;
+	struct fentry *prev;
+	struct fentry *next;
+};
+
+void fcache_init(int, size_t, int);
+int fcache_watch(void);
+void fcache_events(void);
+void fcache_report(void);
+struct fentry *fcache_get(char *, int, char *);
+int fcache_open(struct fentry *);
+char *fcache_body(struct fentry *);
+char *fcache_head(struct fentry *, BOOL, int, int, int, size_t *);
+void fcache_set_head(struct fentry *, BOOL, int, int, int, char *, size_t);
+char *fcache_listing(struct fentry *, char *, size_t *);
+BOOL fcache_set_listing(struct fentry *, char *, char *, size_t);
+void fcache_hold(struct fentry *);
+void fcache_put(struct fentry *);
+
+#endif /* !_FCACHE_H_ */
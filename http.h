@@ -5,6 +5,7 @@
 #define Created					201
 #define Accepted				202
 #define No_Content				204
+#define Partial_Content			206
 #define Moved_Permanently		301
 #define Moved_Temporarily		302
 #define Not_Modified			304
@@ -12,10 +13,12 @@
 #define Unauthorized			401
 #define Forbidden				403
 #define Not_Found				404
+#define Range_Not_Satisfiable	416
 #define Internal_Server_Error	500
 #define Not_Implemented			501
 #define Bad_Gateway				502
 #define Service_Unavailable		503
+#define Gateway_Timeout			504
 
 #define GET				1
 #define HEAD			2
@@ -24,10 +27,58 @@
 #define HTTP_REQUEST_MAX_LENGTH	 8192
 #define HTTP_RESPONSE_MAX_LENGTH 8192
 
-#define HTTP_IMPL_VERSION 1.0
-#define HTTP_VERSION "HTTP/1.0"
+#define HTTP_IMPL_VERSION 1.1
+#define HTTP_VERSION "HTTP/1.1"
 #define HTTP_SERVER_NAME "Trinity/1.0"
 
+/* limits of persistent connections */
+#define HTTP_KEEPALIVE_TIMEOUT		5	/* seconds */
+#define HTTP_KEEPALIVE_MAX			100	/* requests */
+
+/* byte ranges served for one request at most */
+#define HTTP_RANGES_MAX			16
+
+/*
+ * content codings of the responses, the ones a file may be stored
+ * in next to itself are preferred in this order when the client
+ * likes them equally; deflate is only made by the server
+ */
+#define HTTP_ENCODINGS			4
+#define ENCODING_NONE			-1
+#define ENCODING_BR				0
+#define ENCODING_ZSTD			1
+#define ENCODING_GZIP			2
+#define ENCODING_DEFLATE		3
+
+/* "W/", the quoted tag and the coding it belongs to */
+#define HTTP_ETAG_MAX			80
+
+/* header fields of a request head kept at most */
+#define HTTP_HEADERS_MAX		100
+
+/* return values of http_parse(3) */
+#define HTTP_PARSE_AGAIN		0
+#define HTTP_PARSE_DONE			1
+#define HTTP_PARSE_ERROR		2
+
+/* values of http_request.if_range_flag */
+#define IF_RANGE_NONE			0
+#define IF_RANGE_DATE			1
+#define IF_RANGE_ETAG			2
+
+/* values of http_request.transfer_encoding */
+#define TRANSFER_NONE			0
+#define TRANSFER_CHUNKED		1	/* chunked is the last coding */
+#define TRANSFER_OTHER			2
+
+/* flags of http_decoding(3) */
+#define HTTP_DECODE_PLUS		1	/* '+' is a space, as in a form */
+
+/* values of http_request.connection */
+#define CONNECTION_DEFAULT		0
+#define CONNECTION_CLOSE		1
+#define CONNECTION_KEEPALIVE	2
+
 /*
  * http_request
  * This structure provides a interface between main program and http
@@ -38,11 +89,75 @@
 struct http_request
 {
 	int method_type;
-	char *request_URL;
+	char *request_URL;     /* the decoded path */
+	char *query;           /* the query string as sent, or NULL */
 	float http_version;
 	int if_modified_flag;  /* 1 for yes */
 	time_t if_modified_since;
+	int connection;        /* value of the Connection header */
+	char *range;           /* value of the Range header, or NULL */
+	int if_range_flag;     /* kind of validator in If-Range */
+	time_t if_range_date;
+	char *if_range_etag;
+	int encoding_q[HTTP_ENCODINGS]; /* q-values of Accept-Encoding * 1000 */
+	char *if_none_match;   /* list of entity tags, or NULL */
+	char *accept;          /* value of the Accept header, or NULL */
+	char *host;            /* value of the Host header, or NULL */
+	char *user_agent;      /* value of the User-Agent header, or NULL */
+	char *content_type;    /* value of the Content-Type header, or NULL */
+	off_t content_length;  /* of the request body, or -1 */
+	int transfer_encoding; /* TRANSFER_NONE or the last coding */
+};
+
+/* caching directives for some responses, see cachectl.c */
+struct cache_rule
+{
+	int index;             /* position in the rule file */
+	long max_age;          /* seconds until Expires, or -1 */
+	char *value;           /* of the Cache-Control header */
+};
+
+/* one byte range of a Range header, both offsets included */
+struct http_range
+{
+	off_t first;
+	off_t last;
 };
+/*
+ * http_header
+ * A header field of a request head, as the offsets of its name
+ * and of its value without the white space around it.
+ */
+struct http_header
+{
+	size_t name;
+	size_t name_len;
+	size_t value;
+	size_t value_len;
+};
+
+/*
+ * http_parser
+ * The state of parsing one request head, which may arrive in any
+ * number of reads. Every offset is relative to the start of the
+ * request, so it stays valid when the buffer is compacted; pos is
+ * where the next call goes on, no byte is looked at twice.
+ */
+struct http_parser
+{
+	int state;
+	size_t pos;            /* bytes parsed */
+	size_t mark;           /* start of the token being parsed */
+	size_t end;            /* end of the value without white space */
+	size_t method_len;     /* the method starts the request */
+	size_t target;
+	size_t target_len;
+	size_t version;
+	size_t version_len;    /* 0 until the request line is complete */
+	struct http_header headers[HTTP_HEADERS_MAX];
+	int nheaders;
+};
+
 /*
  * http_response
  * This structure provides a interface between main program and http
@@ -56,6 +171,18 @@ struct http_response
         size_t content_length;
         int http_status;
         int body_flag;
+        int keep_alive;        /* 1 for a persistent connection */
+        off_t range_first;     /* Content-Range of a single part 206 */
+        off_t range_last;
+        off_t file_size;       /* complete length for Content-Range */
+        char *boundary;        /* separator of a multipart 206, or NULL */
+        int content_encoding;  /* ENCODING_NONE or the coding of the body */
+        int chunked;           /* 1 if the length of the body is unknown */
+        char *etag;            /* entity tag of the file, or NULL */
+        struct cache_rule *cache_rule; /* matched by the request, or NULL */
+        char *content_type;    /* instead of the one of file_path, or NULL */
+        int vary_accept;       /* 1 if the body was chosen by Accept */
+        int vary_encoding;     /* 1 if it's chosen by Accept-Encoding */
 };
 /*
  * set_logging
@@ -73,17 +200,42 @@ struct set_logging
 	size_t content_length;
 	time_t receive_time;/* already set up in request */
 };
+/*
+ * http_parse(3) goes on parsing the request head in the len bytes
+ * of buf. It returns HTTP_PARSE_AGAIN until the head is complete.
+ */
+void http_parser_init(struct http_parser *hp);
+int http_parse(struct http_parser *hp, char *buf, size_t len);
 /* 
- * request(3) processes http request line and request headers,
- * if there is syntax problem in the http request message, it 
- * will return larger than 0. This function will fill http request
- * information to the http_request structure and the set_logging 
- * structure.
+ * request(4) processes http request line and request headers
+ * found by the parser in buf, if there is syntax problem in the
+ * http request message, it will return larger than 0. This
+ * function will fill http request information to the http_request
+ * structure and the set_logging structure.
  */
-int request(char *buf, struct http_request *request_info, 
+int request(char *buf, struct http_parser *hp,
+		struct http_request *request_info,
 		struct set_logging *logging_info);
 /* release the memory of http_requst */ 
 void clean_request(struct http_request *request_info);
+/*
+ * http_decoding(3) decodes the escapes of the len bytes of url in
+ * place and returns the new length, or -1 if an escape is invalid,
+ * gives a NUL or makes the URL ill-formed UTF-8.
+ */
+ssize_t http_decoding(char *url, size_t len, int flags);
+/*
+ * parse_range(4) resolves the ranges of a Range header against a
+ * file of the given size. It returns the number of satisfiable
+ * ranges, 0 if none is, or -1 if the header has to be ignored.
+ */
+int parse_range(char *spec, off_t size, struct http_range *ranges, int max);
+/*
+ * match_etag(3) checks if an entity tag is in the list of an
+ * If-None-Match or If-Range header, "*" matches any tag. With
+ * strong comparison, weak tags never match.
+ */
+int match_etag(char *list, char *etag, int strong);
 
 /* 
  * response(4) processes http response status line and response
@@ -92,6 +244,13 @@ void clean_request(struct http_request *request_info);
  */
 int response(struct http_response *response_info, char *resp_buf, 
 		size_t capacity, size_t *size);
+/* get the content type from the extension of a file */
+char *get_content_type(char *file_path);
+/* get the name of a content coding, such as "gzip" */
+char *encoding_name(int encoding);
+/* build the entity tag of a version of a file in a content coding */
+void make_etag(char *buf, size_t capacity, ino_t ino, off_t size,
+               time_t mtime, int encoding);
 /* deal with cgi response, the idea of this is same as response(4) */
 int cgi_response(struct http_response *response_info, char *resp_buf, 
 		size_t capacity, size_t *size);
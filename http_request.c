@@ -1,234 +1,571 @@
+#include <sys/types.h>
+
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <time.h>
 
 #include "http.h"
+#include "httpdate.h"
+#include "scan.h"
 
-#define HEADER_FIELD	1
 #define LOGGING_BUF		4096
 
-int process_header(char *Header_Field, struct http_request *request_info);
+/* header fields used, HF_NONE for any other */
+#define HF_NONE				-1
+#define HF_IF_MODIFIED_SINCE	0
+#define HF_CONNECTION		1
+#define HF_RANGE			2
+#define HF_IF_RANGE			3
+#define HF_ACCEPT_ENCODING	4
+#define HF_IF_NONE_MATCH	5
+#define HF_ACCEPT			6
+#define HF_HOST				7
+#define HF_CONTENT_LENGTH	8
+#define HF_CONTENT_TYPE		9
+#define HF_TRANSFER_ENCODING 10
+#define HF_USER_AGENT		11
+
+/* slots of the perfect hash of their names, see header_field() */
+#define HEADER_HASH			16
+
+/* states of http_parse(), the part of the head it's in */
+#define HP_METHOD		0
+#define HP_TARGET		1
+#define HP_VERSION		2
+#define HP_LINE_LF		3
+#define HP_NAME_START	4
+#define HP_NAME			5
+#define HP_VALUE_START	6
+#define HP_VALUE		7
+#define HP_VALUE_LF		8
+#define HP_END_LF		9
+#define HP_DONE			10
+#define HP_ERROR		11
+
+/*
+ * Skip a run of the bytes of a class: the first SCAN_SHORT in place,
+ * as most runs are shorter, the rest with a kernel of scan.c.
+ */
+#define RUN(class, kernel) \
+	for (stop = i + SCAN_SHORT < len ? i + SCAN_SHORT : len; i < stop && \
+	    (scan_class[(unsigned char)buf[i]] & (class)) != 0; i++) \
+		; \
+	if (i == stop && i < len) \
+		i += kernel(buf + i, len - i)
+
+/* skip a run, wait for more at the end of the buffer */
+#define SKIP(class, kernel) \
+	RUN(class, kernel); \
+	if (i == len) \
+		goto again
+
+int process_header(int field, char *header_value,
+		struct http_request *request_info);
 char *set_request(char *request_val);
-int check_num(char *check_val);
-int check_tm(struct tm *http_data);
-int get_datenum(char *date_list[], char *sub);
-int set_asctime(struct tm *http_date, char *request_val);
-int set_method(char *method, struct http_request *request_info);
-int set_rfc1123(struct tm *http_date, char *request_val);
-int set_rfc850(struct tm *http_date, char *request_val);
-char *http_decoding(struct http_request *request_info, char *http_url);
-int to_num(char *header);
-int htod(char hex1, char hex2);
+int set_method(char *buf, struct http_parser *hp,
+		struct http_request *request_info);
+int check_utf8(unsigned char *s, size_t len);
+int header_field(char *name, size_t len);
+int set_content_length(char *request_val, struct http_request *request_info);
+int set_transfer_encoding(char *request_val);
+int set_connection(char *request_val);
+void set_if_range(char *request_val, struct http_request *request_info);
+void set_accept_encoding(char *request_val, struct http_request *request_info);
+int parse_qvalue(char *params);
+int parse_offset(char **p, off_t *offset);
 time_t set_date(char *request_val, struct http_request *request_info);
-char *split_str(char *source, char **rest);
+char *copy_view(char *view, size_t len);
 int check_version(char *http_version);
-int check_format(char *method);
 
-static char *wkday[] = { "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun", NULL };
-static char *weekday[] = { "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday", "Sunday", NULL };
-static char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec", NULL };
+/*
+ * The names of the header fields used, in a perfect hash table:
+ * a name can only be in slot (length + assoc[first byte] +
+ * assoc[last byte]) % HEADER_HASH. assoc[] gives both cases of a
+ * letter the same value, so the case of a name doesn't matter.
+ * The values were found by a search, as gperf(1) does; adding a
+ * field means searching again.
+ */
+static const unsigned char assoc[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 14, 0, 7, 0, 10, 0, 7, 11, 13, 0, 0, 0, 0, 2, 0,
+	0, 0, 7, 0, 10, 6, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 14, 0, 7, 0, 10, 0, 7, 11, 13, 0, 0, 0, 0, 2, 0,
+	0, 0, 7, 0, 10, 6, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+static const struct {
+	char *name;
+	size_t len;
+	int field;
+} header_names[HEADER_HASH] = {
+	{ "Content-Length", 14, HF_CONTENT_LENGTH },
+	{ "", 0, HF_NONE },
+	{ "Transfer-Encoding", 17, HF_TRANSFER_ENCODING },
+	{ "Connection", 10, HF_CONNECTION },
+	{ "Accept-Encoding", 15, HF_ACCEPT_ENCODING },
+	{ "If-None-Match", 13, HF_IF_NONE_MATCH },
+	{ "Range", 5, HF_RANGE },
+	{ "", 0, HF_NONE },
+	{ "If-Modified-Since", 17, HF_IF_MODIFIED_SINCE },
+	{ "Host", 4, HF_HOST },
+	{ "User-Agent", 10, HF_USER_AGENT },
+	{ "", 0, HF_NONE },
+	{ "", 0, HF_NONE },
+	{ "Content-Type", 12, HF_CONTENT_TYPE },
+	{ "Accept", 6, HF_ACCEPT },
+	{ "If-Range", 8, HF_IF_RANGE },
+
+};
+
+/* the values of hex digits, -1 for other bytes */
+static const signed char hex_values[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
 
 int q_err; /* error number for following function to return */
 
+/*
+ * This function starts parsing a new request head.
+ */
+void
+http_parser_init(struct http_parser *hp)
+{
+	hp->state = HP_METHOD;
+	hp->pos = 0;
+	hp->mark = 0;
+	hp->method_len = 0;
+	hp->version_len = 0;
+	hp->nheaders = 0;
+}
+
+/*
+ * This function parses the request head at the start of buf, of
+ * which len bytes were read, from where the last call stopped.
+ * The request line is split into the method, the target and the
+ * version, the header lines into names and values; nothing is
+ * copied or changed. Each token, target and value is skipped up
+ * to the byte which ends it by its class in scan_class[] or, past
+ * SCAN_SHORT bytes, by a kernel of scan.c, which looks at 16 or 32
+ * bytes at once. A bare LF, a line folded onto the one before it
+ * or more than HTTP_HEADERS_MAX fields are an error. Once the head
+ * is complete, pos is its length.
+ */
+int
+http_parse(struct http_parser *hp, char *buf, size_t len)
+{
+	struct http_header *h;
+	size_t i, start, stop;
+
+	if (hp->state == HP_DONE)
+		return HTTP_PARSE_DONE;
+	if (hp->state == HP_ERROR)
+		return HTTP_PARSE_ERROR;
+
+	h = &hp->headers[hp->nheaders];
+	for (i = hp->pos; i < len; i++) {
+		switch (hp->state) {
+		case HP_METHOD:
+			SKIP(SCAN_TOKEN, scan_token);
+			if (buf[i] != ' ' || i == 0)
+				goto error;
+			hp->method_len = i;
+			hp->mark = i + 1;
+			hp->state = HP_TARGET;
+			break;
+		case HP_TARGET:
+			SKIP(SCAN_TARGET, scan_target);
+			if (buf[i] != ' ' || i == hp->mark)
+				goto error;
+			hp->target = hp->mark;
+			hp->target_len = i - hp->mark;
+			hp->mark = i + 1;
+			hp->state = HP_VERSION;
+			break;
+		case HP_VERSION:
+			SKIP(SCAN_TARGET, scan_target);
+			if (buf[i] != '\r' || i == hp->mark)
+				goto error;
+			hp->version = hp->mark;
+			hp->version_len = i - hp->mark;
+			hp->state = HP_LINE_LF;
+			break;
+		case HP_LINE_LF:
+		case HP_VALUE_LF:
+			if (buf[i] != '\n')
+				goto error;
+			if (hp->state == HP_VALUE_LF)
+				h = &hp->headers[++hp->nheaders];
+			hp->state = HP_NAME_START;
+			break;
+		case HP_NAME_START:
+			if (buf[i] == '\r') {
+				hp->state = HP_END_LF;
+				break;
+			}
+			if (hp->nheaders == HTTP_HEADERS_MAX)
+				goto error;
+			hp->mark = i;
+			hp->state = HP_NAME;
+			/* FALLTHROUGH */
+		case HP_NAME:
+			SKIP(SCAN_TOKEN, scan_token);
+			if (buf[i] != ':' || i == hp->mark)
+				goto error;
+			h->name = hp->mark;
+			h->name_len = i - hp->mark;
+			hp->state = HP_VALUE_START;
+			break;
+		case HP_VALUE_START:
+			if (buf[i] == ' ' || buf[i] == '\t')
+				break;
+			hp->mark = i;
+			hp->end = i;
+			hp->state = HP_VALUE;
+			/* FALLTHROUGH */
+		case HP_VALUE:
+			/*
+			 * The value ends at the CR; an LF or a NUL before
+			 * it is an error. White space inside it is kept,
+			 * not at its end.
+			 */
+			start = i;
+			RUN(SCAN_VALUE, scan_value);
+			if (i < len && buf[i] != '\r')
+				goto error;
+			for (stop = i; stop > start && (buf[stop - 1] == ' ' ||
+			     buf[stop - 1] == '\t'); stop--)
+				;
+			if (stop > start)
+				hp->end = stop;
+			if (i == len)
+				goto again;
+			h->value = hp->mark;
+			h->value_len = hp->end - hp->mark;
+			hp->state = HP_VALUE_LF;
+			break;
+		case HP_END_LF:
+			if (buf[i] != '\n')
+				goto error;
+			hp->pos = i + 1;
+			hp->state = HP_DONE;
+			return HTTP_PARSE_DONE;
+		}
+	}
+
+again:
+	hp->pos = len;
+	return HTTP_PARSE_AGAIN;
+
+error:
+	hp->pos = i + 1;
+	hp->state = HP_ERROR;
+	return HTTP_PARSE_ERROR;
+}
+
 /* This function processes http request header fields.
  * This function will set values for http_request structure
  * and set_logging structure to communicate with other functions
- * This function will return 0 if succeed, larger than 0 if error.
+ * The head was split by http_parse(); the values are ended with
+ * '\0' in place. This function will return 0 if succeed, larger
+ * than 0 if error.
  */
 int 
-request(char *buf, struct http_request *request_info, 
+request(char *buf, struct http_parser *hp, struct http_request *request_info, 
 		struct set_logging *logging_info)
 {
-	char *request_head = buf;
-	char *Header_Field;
-	char *method;
+	struct http_header *h;
 	int ret;
+	int i;
 	q_err = 0;
 	/* initial structure */
 	request_info->http_version = -1;
 	request_info->if_modified_flag = 0;
+	request_info->connection = CONNECTION_DEFAULT;
+	request_info->range = NULL;
+	request_info->if_range_flag = IF_RANGE_NONE;
+	request_info->if_range_etag = NULL;
+	for (i = 0; i < HTTP_ENCODINGS; i++)
+		request_info->encoding_q[i] = 0;
+	request_info->if_none_match = NULL;
+	request_info->accept = NULL;
+	request_info->host = NULL;
+	request_info->user_agent = NULL;
+	request_info->content_type = NULL;
+	request_info->content_length = -1;
+	request_info->transfer_encoding = TRANSFER_NONE;
 	request_info->method_type = 0;
 	request_info->request_URL = NULL;
+	request_info->query = NULL;
 
 	logging_info->first_line = NULL;
 	logging_info->receive_time = 0;
-	/* process the first line of http request */
-	method = split_str(NULL, &request_head);
-	if (method == NULL)
+	/* set logging information once the first line is complete */
+	if (hp->version_len > 0) {
+		logging_info->first_line = copy_view(buf,
+				hp->version + hp->version_len);
+		time(&logging_info->receive_time);
+	}
+	if (hp->state != HP_DONE)
 		return 1;
-	/* set logging information */
-	logging_info->first_line = set_request(method);
-	time(&logging_info->receive_time);
 
-	ret = set_method(method, request_info);
+	/* process the first line of http request */
+	ret = set_method(buf, hp, request_info);
 	if (ret)
 		return q_err;
-	if (strcmp(request_head, "") == 0)
-		return 1;
 	/* process the following header fields */
-	while(1){
-		Header_Field = split_str(NULL, &request_head);
-		if (Header_Field == NULL)
-			return 1;
-		if (strcmp(Header_Field, "") == 0)
-			break;/* end of http request */
-		ret = process_header(Header_Field, request_info);
+	for (i = 0; i < hp->nheaders; i++) {
+		h = &hp->headers[i];
+		buf[h->value + h->value_len] = '\0';
+		ret = process_header(header_field(buf + h->name, h->name_len),
+				buf + h->value, request_info);
 		if (ret > 0)
 			return q_err;
 	}
+	/*
+	 * A body must end with the last chunk, never at a length
+	 * given as well, or the next request can't be found.
+	 */
+	if (request_info->transfer_encoding == TRANSFER_OTHER ||
+			(request_info->transfer_encoding == TRANSFER_CHUNKED &&
+			 request_info->content_length >= 0))
+		q_err = 8;
 	return q_err;
 }
-/* http decoding */
-char *
-http_decoding(struct http_request *request_info, char *http_url)
+
+/*
+ * Decode the escapes of the len bytes of url in place and return
+ * the length of the result, -1 if an escape isn't two hex digits,
+ * gives a NUL or starts a UTF-8 sequence which is overlong, a
+ * surrogate or cut off. The plain runs between escapes are found
+ * by scan_plain() and moved down as a whole; with HTTP_DECODE_PLUS
+ * a '+' is a space, as in a form.
+ */
+ssize_t
+http_decoding(char *url, size_t len, int flags)
 {
-	/* if error, set q_err to 6*/
-	char *decoded_url;
-	int len = strlen(http_url);
-	int i = 0;
-	int j = 0;
-	char hex1;
-	char hex2;
-	int decimal_str;
-
-	decoded_url = (char *)malloc(sizeof(char)*(len + 1));
-	if (decoded_url == NULL){
-		q_err = 7;
-		return NULL;
-	}
-	decoded_url[len] = '\0';
-	for (i = 0, j = 0; i < len; i++, j++)
-	{
-		if (http_url[j] == '%'){
-			hex1 = http_url[j + 1];
-			hex2 = http_url[j + 2];
-			decimal_str = htod(hex1, hex2);
-			if (decimal_str < 0 || !isascii(decimal_str)){
-				q_err = 7;
-				return NULL;
-			}
-			decoded_url[i] = (char)decimal_str;
-			j += 2;
+	size_t i, j, n, stop;
+	int hi, lo, high;
+
+	high = 0;
+	for (i = j = 0; i < len; ) {
+		/* as RUN(), the first SCAN_SHORT bytes are copied in place */
+		for (stop = i + SCAN_SHORT < len ? i + SCAN_SHORT : len;
+		     i < stop && (scan_class[(unsigned char)url[i]] & SCAN_PLAIN) != 0;
+		     i++)
+			url[j++] = url[i];
+		if (i == stop && i < len) {
+			n = scan_plain(url + i, len - i);
+			if (i != j)
+				memmove(url + j, url + i, n);
+			i += n;
+			j += n;
 		}
-		else{
-			decoded_url[i] = http_url[j];
+		if (i == len)
+			break;
+		if (url[i] == '+') {
+			url[j++] = (flags & HTTP_DECODE_PLUS) ? ' ' : '+';
+			i++;
+			continue;
 		}
+		if (len - i < 3)
+			return -1;
+		hi = hex_values[(unsigned char)url[i + 1]];
+		lo = hex_values[(unsigned char)url[i + 2]];
+		if ((hi | lo) < 0 || (hi | lo) == 0)
+			return -1;
+		url[j++] = (char)(hi << 4 | lo);
+		high |= hi & 8;
+		i += 3;
 	}
-	return decoded_url;
+	if (high && !check_utf8((unsigned char *)url, j))
+		return -1;
+	return (ssize_t)j;
 }
 
-/* hex to decimal */
-int 
-htod(char hex1, char hex2)
+/*
+ * Check the bytes of a decoded URL above 0x7f, which have to be
+ * well-formed UTF-8 (see table 3-7 of the Unicode standard), so
+ * that "%c0%ae" can't be taken for a '.' by anyone.
+ */
+int
+check_utf8(unsigned char *s, size_t len)
 {
-	int ret = 0;
-	char upper_c;
-	/* check if the hex1 and hex2 is a hex */
-	if (isalnum((int)hex1) && isalnum((int)hex2)){
-		if (isdigit((int)hex1))
-			ret += atoi(&hex1) * 16;
-		else if (isalpha((int)hex1)){
-			upper_c = toupper((int)hex1);
-			if (upper_c >= 'A'&&upper_c <= 'F')
-				ret += (upper_c - 'A' + 10) * 16;
-			else
-				return -1;
-		}
-		else{
-			return -1;
-		}
-		if (isdigit((int)hex2))
-			ret += atoi(&hex2);
-		else if (isalpha((int)hex2)){
-			upper_c = toupper((int)hex2);
-			if (upper_c >= 'A'&&upper_c <= 'F')
-				ret += upper_c - 'A' + 10;
-			else
-				return -1;
-		}
-		else{
-			return -1;
-		}
-		return ret;
+	size_t i, n, k;
+	unsigned char lo, hi;
+
+	for (i = 0; i < len; i += n + 1) {
+		while (s[i] < 0x80)
+			if (++i == len)
+				return 1;
+		lo = 0x80;
+		hi = 0xbf;
+		if (s[i] >= 0xc2 && s[i] <= 0xdf)
+			n = 1;
+		else if (s[i] >= 0xe0 && s[i] <= 0xef) {
+			n = 2;
+			if (s[i] == 0xe0)
+				lo = 0xa0;
+			else if (s[i] == 0xed)
+				hi = 0x9f;
+		} else if (s[i] >= 0xf0 && s[i] <= 0xf4) {
+			n = 3;
+			if (s[i] == 0xf0)
+				lo = 0x90;
+			else if (s[i] == 0xf4)
+				hi = 0x8f;
+		} else
+			return 0;
+		if (len - i <= n || s[i + 1] < lo || s[i + 1] > hi)
+			return 0;
+		for (k = 2; k <= n; k++)
+			if (s[i + k] < 0x80 || s[i + k] > 0xbf)
+				return 0;
 	}
-	return -1;
+	return 1;
 }
 
 /* set http method to http_request, return 1 if error */
 int 
-set_method(char *method, struct http_request *request_info)
+set_method(char *buf, struct http_parser *hp,
+		struct http_request *request_info)
 {
-	char *method_type;
-	char *method_val;
+	char *method_val, *query;
 	char *http_version;
-	char *http_str;
-	char *rest;
-	if (check_format(method)){
+	ssize_t len;
+	if (hp->method_len == 3 && strncmp(buf, "GET", 3) == 0)
+		request_info->method_type = GET;
+	else if (hp->method_len == 4 && strncmp(buf, "HEAD", 4) == 0)
+		request_info->method_type = HEAD;
+	else if (hp->method_len == 4 && strncmp(buf, "POST", 4) == 0)
+		request_info->method_type = POST;
+	else{
 		q_err = 1;
 		return 1;
 	}
-	method_type = strtok_r(method, " ", &rest);
-	method_val = strtok_r(NULL, " ", &rest);
-	http_str = strtok_r(rest, "/", &http_version);
-	if (method_type&&method_val&&http_version&&http_str)
-	{
-		if (strcmp(method_type, "GET") == 0)
-			request_info->method_type = GET;
-		else if (strcmp(method_type, "HEAD") == 0)
-			request_info->method_type = HEAD;
-		else if (strcmp(method_type, "POST") == 0)
-			request_info->method_type = POST;
-		else{
-			q_err = 1;
-			return 1;
-		}
-		if (strcmp(http_str, "HTTP") != 0 || method_val[0] != '/') {
-			q_err = 1;
-			return 1;
-		}
-		/* decoding */
-		request_info->request_URL = http_decoding(request_info, method_val);
-		if (check_version(http_version))
-			request_info->http_version = atof(http_version);
-		else{
-			q_err = 1;
-			return 1;
-		}
-		return 0;
+	/* the target and the version end with the space and the CR */
+	method_val = buf + hp->target;
+	method_val[hp->target_len] = '\0';
+	http_version = buf + hp->version;
+	http_version[hp->version_len] = '\0';
+	if (strncmp(http_version, "HTTP/", 5) != 0 || method_val[0] != '/') {
+		q_err = 1;
+		return 1;
 	}
-	q_err = 1;
-	return 1;
+	http_version += 5;
+	/* the path is decoded in place, the query string is kept as sent */
+	if ((query = strchr(method_val, '?')) != NULL) {
+		*query++ = '\0';
+		request_info->query = query;
+	}
+	if ((len = http_decoding(method_val, strlen(method_val), 0)) < 0) {
+		q_err = 7;
+		return 1;
+	}
+	method_val[len] = '\0';
+	request_info->request_URL = method_val;
+	if (check_version(http_version))
+		request_info->http_version = atof(http_version);
+	else{
+		q_err = 1;
+		return 1;
+	}
+	return 0;
 }
 
 /* 
- * Process http request headers. This function will split one header to 
- * header field and header value. Ignore header field if it is not 
- * If-Modified-Since. Return 2 if error and 0 if succeed.
+ * Process http request headers. field is the number header_field()
+ * gives the name of the header, fields which are not used are
+ * ignored. The values are kept in the typed fields of request_info.
+ * Return 0, errors of the values are left in q_err.
  */
 int 
-process_header(char *Header_Field, struct http_request *request_info)
+process_header(int field, char *header_value,
+		struct http_request *request_info)
 {
-	char *header;
-	char *header_value;
-	header = strtok_r(Header_Field, ":", &header_value);
-	header_value += 1;
-	if (header == NULL&&header_value == NULL){
-		q_err = 2;
-		return 2;
-	}
-	switch (to_num(header))
+	switch (field)
 	{
-	case 0:		/*If-Modified-Since*/
+	case HF_IF_MODIFIED_SINCE:
 		request_info->if_modified_since = set_date(header_value, request_info);
 		if (request_info->if_modified_since < 0)
 			request_info->if_modified_flag = 0;
 		else
 			request_info->if_modified_flag = 1;
 		break;
+	case HF_CONNECTION:
+		request_info->connection = set_connection(header_value);
+		break;
+	case HF_RANGE:
+		free(request_info->range);
+		request_info->range = set_request(header_value);
+		break;
+	case HF_IF_RANGE:
+		set_if_range(header_value, request_info);
+		break;
+	case HF_ACCEPT_ENCODING:
+		set_accept_encoding(header_value, request_info);
+		break;
+	case HF_IF_NONE_MATCH:
+		free(request_info->if_none_match);
+		request_info->if_none_match = set_request(header_value);
+		break;
+	case HF_ACCEPT:
+		free(request_info->accept);
+		request_info->accept = set_request(header_value);
+		break;
+	case HF_HOST:
+		/* a request may only name one host */
+		if (request_info->host != NULL) {
+			q_err = 8;
+			return 1;
+		}
+		request_info->host = set_request(header_value);
+		break;
+	case HF_USER_AGENT:
+		free(request_info->user_agent);
+		request_info->user_agent = set_request(header_value);
+		break;
+	case HF_CONTENT_TYPE:
+		free(request_info->content_type);
+		request_info->content_type = set_request(header_value);
+		break;
+	case HF_CONTENT_LENGTH:
+		if (set_content_length(header_value, request_info))
+			return 1;
+		break;
+	case HF_TRANSFER_ENCODING:
+		request_info->transfer_encoding =
+			set_transfer_encoding(header_value);
+		break;
 	default:
 		break;
 	}
@@ -248,251 +585,338 @@ set_request(char *request_val)
 	return request_type;
 }
 
-/* set tm from rfc850 format date, return 1 if error */
-int 
-set_rfc850(struct tm *http_date, char *request_val)
+/*
+ * Get the time of an HTTP date in any of its three forms (see
+ * httpdate.c), -1 with q_err set if it isn't one.
+ */
+time_t 
+set_date(char *request_val, struct http_request *request_info)
 {
-	char *rest;
-	char *week;
-	char *hour;
-	char *minute;
-	char *second;
-	char *year;
-	char *month;
-	char *day;
-	int n_week;
-	int n_month;
-	week = strtok_r(request_val, ",", &rest);
-	day = strtok_r(NULL, "-", &rest);
-	/* delete " " in day */
-	strtok_r(NULL, " ", &day);
-	month = strtok_r(NULL, "-", &rest);
-	year = strtok_r(NULL, " ", &rest);
-	hour = strtok_r(NULL, ":", &rest);
-	minute = strtok_r(NULL, ":", &rest);
-	second = strtok_r(NULL, " ", &rest);
-	if (week&&day&&month&&year&&hour&&minute&&second)
-	{
-		if ((n_week = get_datenum(weekday, week)) == -1)
-			return 3;
-		if ((n_month = get_datenum(months, month)) == -1)
-			return 3;
-		if (check_num(day) && check_num(year) && check_num(hour) && 
-				check_num(minute) && check_num(second))
-		{
-			http_date->tm_hour = atoi(hour);
-			http_date->tm_min = atoi(minute);
-			http_date->tm_sec = atoi(second);
-			if (atoi(year) <= 50)
-				http_date->tm_year = atoi(year) + 100;
-			else
-				http_date->tm_year = atoi(year);
-			http_date->tm_mon = n_month;
-			http_date->tm_mday = atoi(day);
-			http_date->tm_wday = n_week;
-			http_date->tm_isdst = 0;
-			if (check_tm(http_date))
-				return 3;
-			return 0;
-		}
-	}
-	return 3;
+	time_t t;
+	if ((t = http_date_parse(request_val)) == -1)
+		q_err = 4;
+	return t;
 }
 
-/* set tm from rfc1123 format date, return 1 if error */
-int 
-set_rfc1123(struct tm *http_date, char *request_val)
+/*
+ * Get the HF_ number of a header field from its name, HF_NONE if
+ * it isn't used. One slot of header_names[] is compared.
+ */
+int
+header_field(char *name, size_t len)
+{
+	int slot;
+
+	slot = (len + assoc[(unsigned char)name[0]] +
+			assoc[(unsigned char)name[len - 1]]) % HEADER_HASH;
+	if (header_names[slot].len == len &&
+			strncasecmp(name, header_names[slot].name, len) == 0)
+		return header_names[slot].field;
+	return HF_NONE;
+}
+
+/* 
+ * get the connection option from the comma separated tokens
+ * of Connection header, return CONNECTION_DEFAULT if neither
+ * close nor keep-alive is given.
+ */
+int
+set_connection(char *request_val)
 {
+	char *token;
 	char *rest;
-	char *week;
-	char *hour;
-	char *minute;
-	char *second;
-	char *year;
-	char *month;
-	char *day;
-	int n_week;
-	int n_month;
-	//Date:Mon, 02 Jun 1982 23:59:59 GMT
-	week = strtok_r(request_val, ",", &rest);
-	day = strtok_r(NULL, " ", &rest);
-	month = strtok_r(NULL, " ", &rest);
-	year = strtok_r(NULL, " ", &rest);
-	hour = strtok_r(NULL, ":", &rest);
-	minute = strtok_r(NULL, ":", &rest);
-	second = strtok_r(NULL, " ", &rest);
-	if (week&&day&&month&&year&&hour&&minute&&second)
+	int ret = CONNECTION_DEFAULT;
+	for (token = strtok_r(request_val, ", \t", &rest); token != NULL;
+			token = strtok_r(NULL, ", \t", &rest))
 	{
-		if ((n_week = get_datenum(wkday, week)) == -1)
-			return 4;
-		if ((n_month = get_datenum(months, month)) == -1)
-			return 4;
-		if (check_num(day) && check_num(year) && check_num(hour) && 
-				check_num(minute) && check_num(second))
-		{
-			http_date->tm_hour = atoi(hour);
-			http_date->tm_min = atoi(minute);
-			http_date->tm_sec = atoi(second);
-			http_date->tm_year = atoi(year) - 1900;
-			http_date->tm_mon = n_month;
-			http_date->tm_mday = atoi(day);
-			http_date->tm_wday = n_week;
-			http_date->tm_isdst = 0;
-			if (check_tm(http_date))
-				return 4;
-			return 0;
-		}
+		if (strcasecmp(token, "close") == 0)
+			return CONNECTION_CLOSE;
+		if (strcasecmp(token, "keep-alive") == 0)
+			ret = CONNECTION_KEEPALIVE;
 	}
-	return 4;
+	return ret;
 }
 
-/* set tm from asctime format date, return 1 if error */
-int 
-set_asctime(struct tm *http_date, char *request_val)
+/*
+ * Content-Length is a number of digits; a second one must repeat
+ * it. Anything else makes the length of the body unknown, which
+ * is an error. Return 1 if error.
+ */
+int
+set_content_length(char *request_val, struct http_request *request_info)
 {
-	char *rest;
-	char *week;
-	char *hour;
-	char *minute;
-	char *second;
-	char *year;
-	char *month;
-	char *day;
-	int n_week;
-	int n_month;
-	//Date:Mon Jun  2 23:12:26 2010
-	week = strtok_r(request_val, " ", &rest);
-	month = strtok_r(NULL, " ", &rest);
-	day = strtok_r(NULL, " ", &rest);
-	hour = strtok_r(NULL, ":", &rest);
-	minute = strtok_r(NULL, ":", &rest);
-	second = strtok_r(NULL, " ", &rest);
-	year = strtok_r(NULL, " ", &rest);
-
-	if (week&&day&&month&&year&&hour&&minute&&second)
+	off_t length = 0;
+	size_t i;
+	for (i = 0; isdigit((unsigned char)request_val[i]); i++)
 	{
-		if ((n_week = get_datenum(wkday, week)) == -1)
-			return 5;
-		if ((n_month = get_datenum(months, month)) == -1)
-			return 5;
-		if (check_num(day) && check_num(year) && check_num(hour) && 
-				check_num(minute) && check_num(second))
-		{
-			http_date->tm_hour = atoi(hour);
-			http_date->tm_min = atoi(minute);
-			http_date->tm_sec = atoi(second);
-			http_date->tm_year = atoi(year) - 1900;
-			http_date->tm_mon = n_month;
-			http_date->tm_mday = atoi(day);
-			http_date->tm_wday = n_week;
-			http_date->tm_isdst = 0;
-			if (check_tm(http_date))
-				return 5;
-			return 0;
-		}
+		if (i == 18)
+			break;
+		length = length * 10 + (request_val[i] - '0');
+	}
+	if (i == 0 || request_val[i] != '\0' ||
+			(request_info->content_length >= 0 &&
+			 request_info->content_length != length))
+	{
+		q_err = 8;
+		return 1;
 	}
-	return 5;
+	request_info->content_length = length;
+	return 0;
 }
 
 /*
-rfc1123-date   = wkday "," SP date1 SP time SP "GMT"
-Mon, 02 Jun 1982 23:59:59 GMT
+ * Only the last coding of Transfer-Encoding tells how the body
+ * ends, TRANSFER_CHUNKED if it's chunked.
+ */
+int
+set_transfer_encoding(char *request_val)
+{
+	char *coding;
+	size_t len;
+	if ((coding = strrchr(request_val, ',')) == NULL)
+		coding = request_val;
+	else
+		coding++;
+	coding += strspn(coding, " \t");
+	len = strcspn(coding, " \t;");
+	if (len == 7 && strncasecmp(coding, "chunked", 7) == 0)
+		return TRANSFER_CHUNKED;
+	return TRANSFER_OTHER;
+}
 
-rfc850-date    = weekday "," SP date2 SP time SP "GMT"
-Monday, 02-Jun-82 23:59:59 GMT
+/*
+ * If-Range holds an entity tag or a date. A date that can't be
+ * parsed matches nothing, so the whole file is sent.
+ */
+void
+set_if_range(char *request_val, struct http_request *request_info)
+{
+	int saved_err;
+	if (request_val[0] == '"' || strncmp(request_val, "W/", 2) == 0) {
+		free(request_info->if_range_etag);
+		request_info->if_range_etag = set_request(request_val);
+		request_info->if_range_flag = IF_RANGE_ETAG;
+		return;
+	}
+	saved_err = q_err;
+	request_info->if_range_date = set_date(request_val, request_info);
+	if (q_err != 0 || request_info->if_range_date < 0)
+		request_info->if_range_date = -1;
+	request_info->if_range_flag = IF_RANGE_DATE;
+	q_err = saved_err;
+}
 
-asctime-date   = wkday SP date3 SP time SP 4DIGIT
-Mon Jun  2 23:59:59 1982
-*/
-time_t 
-set_date(char *request_val, struct http_request *request_info)
+/*
+ * Accept-Encoding lists codings with optional q-values, such as
+ * "br;q=1.0, gzip;q=0.5". The q-value of every coding a file may
+ * be stored in is kept in thousandths, 0 means not acceptable.
+ * "*" stands for all codings which are not listed.
+ */
+void
+set_accept_encoding(char *request_val, struct http_request *request_info)
 {
-	putenv("TZ=GMT");
-	tzset();
-	struct tm http_date;
-	time_t t;
-	if (strstr(request_val, "GMT")){
-		if (strstr(request_val, "-")){
-			//rfc850 
-			//Date:Monday, 02-Jun-02 23:54:07 GMT
-			q_err = set_rfc850(&http_date, request_val);
+	int listed[HTTP_ENCODINGS];
+	char *coding, *params, *end, *last;
+	int i, q, star;
+	star = 0;
+	for (i = 0; i < HTTP_ENCODINGS; i++)
+		listed[i] = 0;
+	for (coding = strtok_r(request_val, ",", &last); coding != NULL;
+	     coding = strtok_r(NULL, ",", &last))
+	{
+		while (*coding == ' ' || *coding == '\t')
+			coding++;
+		q = 1000;
+		if ((params = strchr(coding, ';')) != NULL){
+			*params++ = '\0';
+			q = parse_qvalue(params);
 		}
-		else{
-			//rfc1123
-			//Date:Mon, 02 Jun 1982 23:59:59 GMT
-			q_err = set_rfc1123(&http_date, request_val);
+		end = coding + strlen(coding);
+		while (end > coding && (end[-1] == ' ' || end[-1] == '\t'))
+			*--end = '\0';
+
+		if (strcmp(coding, "*") == 0){
+			star = q;
+			continue;
+		}
+		if (strcasecmp(coding, "x-gzip") == 0)
+			coding = "gzip";
+		for (i = 0; i < HTTP_ENCODINGS; i++)
+		{
+			if (strcasecmp(coding, encoding_name(i)) == 0){
+				request_info->encoding_q[i] = q;
+				listed[i] = 1;
+			}
 		}
 	}
-	else{
-		//asctime
-		//Date:Mon Jun  2 23:12:26 2010
-		q_err = set_asctime(&http_date, request_val);
+	for (i = 0; i < HTTP_ENCODINGS; i++)
+	{
+		if (!listed[i])
+			request_info->encoding_q[i] = star;
 	}
-	t = mktime(&http_date);
-	return t;
 }
 
-/* transform header to category number, return -1 if error */
-int 
-to_num(char *header)
+/*
+ * Return the q-value in the parameters of a coding in thousandths,
+ * 1000 if there is none and 0 if it's malformed.
+ */
+int
+parse_qvalue(char *params)
 {
-	char *hf_list[] = {
-		"If-Modified-Since"
-	};
-	int i = 0;
-	for (i = 0; i < HEADER_FIELD; i++)
-	{
-		if (strcmp(header, hf_list[i]) == 0){
-			return i;
-		}
+	int q, scale;
+	while (*params == ' ' || *params == '\t')
+		params++;
+	if ((params[0] != 'q' && params[0] != 'Q') || params[1] != '=')
+		return 1000;
+	params += 2;
+	if (*params != '0' && *params != '1')
+		return 0;
+	q = (*params++ - '0') * 1000;
+	if (*params == '.'){
+		params++;
+		for (scale = 100; scale > 0 && isdigit((int)*params); scale /= 10)
+			q += (*params++ - '0') * scale;
 	}
-	return -1;
+	if (q > 1000 || (*params != '\0' && *params != ' ' &&
+	    *params != '\t' && *params != ';'))
+		return 0;
+	return q;
 }
 
-/* if check_val is a number string, return 1 , else 0*/
-int 
-check_num(char *check_val)
+/*
+ * Check if etag is in a list of entity tags such as
+ * "W/\"a\", \"b\"" or "*". Weak comparison ignores the W/
+ * of both tags, strong comparison needs two equal strong tags.
+ */
+int
+match_etag(char *list, char *etag, int strong)
 {
-	int i = 0;
-	int ret = 1;
-	for (i = 0; i < strlen(check_val); i++)
-		isdigit((int)check_val[i]) > 0 ? (ret = ret * 1) : (ret = ret * 0);
-	return ret;
+	char *p = list;
+	char *end;
+	size_t len;
+	int weak, etag_weak;
+	etag_weak = strncmp(etag, "W/", 2) == 0;
+	if (etag_weak)
+		etag += 2;
+	len = strlen(etag);
+	while (1)
+	{
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+		if (*p == '\0')
+			return 0;
+		if (*p == '*')
+			return 1;
+		weak = strncmp(p, "W/", 2) == 0;
+		if (weak)
+			p += 2;
+		if (*p != '"' || (end = strchr(p + 1, '"')) == NULL)
+			return 0;
+		end++;
+		if ((size_t)(end - p) == len && strncmp(p, etag, len) == 0 &&
+		    (!strong || (!weak && !etag_weak)))
+			return 1;
+		p = end;
+	}
 }
 
-/* get the index num of month and week, return -1 if error */
-int 
-get_datenum(char *date_list[], char *sub)
+/*
+ * Resolve "bytes=first-last, first-, -suffix" against a file of
+ * size bytes. Return the number of satisfiable ranges stored in
+ * ranges, 0 if none is satisfiable and -1 if the header is not
+ * valid or has more than max ranges; it's ignored then.
+ */
+int
+parse_range(char *spec, off_t size, struct http_range *ranges, int max)
 {
-	int i = 0;
-	for (i = 0; date_list[i] != NULL; i++)
-		if (strcmp(date_list[i], sub) == 0)
-			return i;
-	return -1;
+	char *p = spec;
+	off_t first, last;
+	int n = 0;
+	int has_first, has_last;
+	if (strncmp(p, "bytes=", 6) != 0)
+		return -1;
+	p += 6;
+	while (1)
+	{
+		while (*p == ' ' || *p == '\t')
+			p++;
+		has_first = parse_offset(&p, &first);
+		if (*p++ != '-')
+			return -1;
+		has_last = parse_offset(&p, &last);
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p != ',' && *p != '\0')
+			return -1;
+
+		if (has_first && has_last && last < first)
+			return -1;
+		if (!has_first && !has_last)
+			return -1;
+		if (!has_first){
+			/* the last bytes of the file */
+			if (last > size)
+				last = size;
+			first = size - last;
+			last = size - 1;
+		}
+		else if (!has_last || last >= size)
+			last = size - 1;
+
+		/* a range starting after the end can't be satisfied */
+		if (first < size && first <= last){
+			if (n == max)
+				return -1;
+			ranges[n].first = first;
+			ranges[n].last = last;
+			n++;
+		}
+		if (*p == '\0')
+			break;
+		p++;
+	}
+	return n;
 }
 
-/* check tm value, return 1 if there is an error */
-int 
-check_tm(struct tm *http_data)
+/* read a decimal offset of a range, return 0 if there is none */
+int
+parse_offset(char **p, off_t *offset)
 {
-	if (http_data->tm_hour>23 && http_data->tm_hour < 0)
-		return 1;
-	if (http_data->tm_mday>31 && http_data->tm_mday < 1)
-		return 1;
-	if (http_data->tm_min>59 && http_data->tm_min < 0)
-		return 1;
-	if (http_data->tm_sec>59 && http_data->tm_sec < 0)
-		return 1;
-	if (http_data->tm_year < 0)
-		return 1;
-	return 0;
+	char *s = *p;
+	*offset = 0;
+	while (isdigit((int)*s)){
+		/* larger than any file */
+		if (*offset > ((off_t)1 << 62) / 10)
+			return 0;
+		*offset = *offset * 10 + (*s - '0');
+		s++;
+	}
+	if (s == *p)
+		return 0;
+	*p = s;
+	return 1;
 }
 
 void 
 clean_request(struct http_request *request_info)
 {
-	free(request_info->request_URL);
+	/* the path and the query string are in the buffer of the head */
 	request_info->request_URL = NULL;
+	request_info->query = NULL;
+	free(request_info->range);
+	request_info->range = NULL;
+	free(request_info->if_range_etag);
+	request_info->if_range_etag = NULL;
+	free(request_info->if_none_match);
+	request_info->if_none_match = NULL;
+	free(request_info->accept);
+	request_info->accept = NULL;
+	free(request_info->host);
+	request_info->host = NULL;
+	free(request_info->user_agent);
+	request_info->user_agent = NULL;
+	free(request_info->content_type);
+	request_info->content_type = NULL;
 }
 
 /* Logging writes logging information to logging file.
@@ -504,7 +928,7 @@ int
 logging(struct set_logging *logging_info)
 {
 	char output_buf[LOGGING_BUF];
-	char receive_time[30];
+	char receive_time[HTTP_DATE_SIZE];
 	int ret, len, total;
 	int fd = logging_info->fd;
 	if (logging_info->logging_flag == 0)
@@ -516,9 +940,7 @@ logging(struct set_logging *logging_info)
 		logging_info->receive_time < 0 || 
 		logging_info->state_code < 0)
 		return -1;
-	if (!strftime(receive_time, 30, "%a, %d %b %Y %H:%M:%S GMT", 
-				gmtime(&logging_info->receive_time)))
-		return 0;
+	http_date_format(logging_info->receive_time, receive_time);
 	len = snprintf(output_buf, LOGGING_BUF, "%s %s \"%s\" %d %zu\n",
 		logging_info->client_ip,
 		receive_time,
@@ -548,34 +970,17 @@ clean_logging(struct set_logging *logging_info)
 	logging_info->first_line = NULL;
 }
 
-/* This function will split http headers by \r\n. And this function 
- * can check the format of http request. Return EMPTY "" if it is the 
- * end of request. Return NULL if it is a bad request.
- */
+/* copy len bytes of a view of the head to a new string */
 char *
-split_str(char *source, char **rest)
+copy_view(char *view, size_t len)
 {
-	char *ret;
-	if (source == NULL)
-		source = *rest;
-	ret = source;
-	int len = strlen(source);
-	int i = 0;
-	for (i = 0; i < len; i++)
-	{
-		if (source[i] == '\r'&&source[i + 1] == '\n')
-		{
-			source[i] = '\0';
-			source[i + 1] = '\0';
-			*rest = source + i + 2;
-			return ret;
-		}
-		else if (source[i] == '\r'&&source[i + 1] != '\n')
-			return NULL;
-		else if (source[i] == '\n')
-			return NULL;
-	}
-	return "";
+	char *copy;
+	copy = (char *)malloc((len + 1)*sizeof(char));
+	if (copy == NULL)
+		return NULL;
+	memcpy(copy, view, len);
+	copy[len] = '\0';
+	return copy;
 }
 
 /* check if a http version is correct http version. Return 1 if error. */
@@ -610,20 +1015,3 @@ check_version(char *http_version)
 	else
 		return 0;
 }
-/* check the format of Request-Line, return 1 if error */
-int 
-check_format(char *method)
-{
-	int len = strlen(method);
-	int i;
-	int count_space = 0;
-	for (i = 0; i < len; i++)
-	{
-		if (method[i] == ' ')
-			count_space++;
-	}
-	if (count_space != 2)
-		return 1;
-	else
-		return 0;
-}
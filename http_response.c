@@ -1,3 +1,5 @@
+#include <sys/types.h>
+
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
@@ -7,11 +9,11 @@
 #include <time.h>
 
 #include "http.h"
-
-#define rfc1123_DATE_STR "%a, %d %b %Y %T GMT"
+#include "httpdate.h"
 
 char* status_phrase(int code);
 char* get_content_type(char* file_path);
+char* encoding_name(int encoding);
 
 /* This function processes http response header fields.
  * This function will process http_response structure from net.c
@@ -21,15 +23,17 @@ int
 response(struct http_response *response_info, char *resp_buf, size_t capacity, size_t *size)
 {
 	char buf[capacity];
-	char timestr[64], lastmodstr[64];
-	time_t present;
+	char *timestr, lastmodstr[HTTP_DATE_SIZE], expstr[HTTP_DATE_SIZE];
+	time_t expires;
 	char len[32];
+	char conn[64];
+	char type[128];
+	char range[128];
 	int i = 0;
 
-	/* process the current time and last modified time */
-	time(&present);
-	strftime(timestr, sizeof(timestr), rfc1123_DATE_STR, gmtime(&present));
-	strftime(lastmodstr, sizeof(lastmodstr), rfc1123_DATE_STR, gmtime(&response_info->last_modified));
+	/* the current time, formatted once a second, and last modified time */
+	timestr = http_date_now();
+	http_date_format(response_info->last_modified, lastmodstr);
 
 	if (response_info->http_status == Not_Modified ||
 		response_info->http_status == No_Content) {
@@ -41,19 +45,70 @@ response(struct http_response *response_info, char *resp_buf, size_t capacity, s
 			HTTP_VERSION, response_info->http_status, status_phrase(response_info->http_status),
 			timestr,
 			HTTP_SERVER_NAME);
-	} else if (response_info->http_status == OK) {
-		/* 200 OK */
+		/* the 304 of a variant, as its 200 would */
+		if (response_info->vary_encoding == 1 ||
+			response_info->content_encoding != ENCODING_NONE)
+			strcat(buf, "Vary: Accept-Encoding\r\n");
+		if (response_info->etag != NULL) {
+			sprintf(range, "ETag: %s\r\n", response_info->etag);
+			strncat(buf, range, strlen(range));
+		}
+	} else if (response_info->http_status == OK ||
+		response_info->http_status == Partial_Content) {
+		/* 200 OK and 206, the parts of several ranges have own types */
+		if (response_info->http_status == Partial_Content &&
+			response_info->boundary != NULL)
+			snprintf(type, sizeof(type), "multipart/byteranges; boundary=%s",
+				response_info->boundary);
+		else if (response_info->content_type != NULL)
+			snprintf(type, sizeof(type), "%s", response_info->content_type);
+		else
+			snprintf(type, sizeof(type), "%s",
+				get_content_type(response_info->file_path));
 		sprintf(buf,
 			"%s %d %s\r\n"
 			"Date: %s\r\n"
 			"Server: %s\r\n"
 			"Last-Modified: %s\r\n"
-			"Content-Type: %s\r\n",
+			"Content-Type: %s\r\n"
+			"Accept-Ranges: bytes\r\n",
 			HTTP_VERSION, response_info->http_status, status_phrase(response_info->http_status),
 			timestr,
 			HTTP_SERVER_NAME,
 			lastmodstr,
-			get_content_type(response_info->file_path));
+			type);
+		if (response_info->http_status == Partial_Content &&
+			response_info->boundary == NULL) {
+			sprintf(range, "Content-Range: bytes %lld-%lld/%lld\r\n",
+				(long long)response_info->range_first,
+				(long long)response_info->range_last,
+				(long long)response_info->file_size);
+			strncat(buf, range, strlen(range));
+		}
+		if (response_info->etag != NULL) {
+			sprintf(range, "ETag: %s\r\n", response_info->etag);
+			strncat(buf, range, strlen(range));
+		}
+		/* a precompressed copy of the file, see send_file() in net.c */
+		if (response_info->content_encoding != ENCODING_NONE) {
+			sprintf(range, "Content-Encoding: %s\r\n",
+				encoding_name(response_info->content_encoding));
+			strncat(buf, range, strlen(range));
+		}
+		/*
+		 * a directory index is chosen by Accept, a file with copies
+		 * in other codings by Accept-Encoding, even if it's sent as
+		 * it is
+		 */
+		if (response_info->vary_accept == 1 &&
+			(response_info->vary_encoding == 1 ||
+			 response_info->content_encoding != ENCODING_NONE))
+			strcat(buf, "Vary: Accept, Accept-Encoding\r\n");
+		else if (response_info->vary_accept == 1)
+			strcat(buf, "Vary: Accept\r\n");
+		else if (response_info->vary_encoding == 1 ||
+			response_info->content_encoding != ENCODING_NONE)
+			strcat(buf, "Vary: Accept-Encoding\r\n");
 	} else {
 		/* return type as text/html */
 		sprintf(buf,
@@ -66,8 +121,38 @@ response(struct http_response *response_info, char *resp_buf, size_t capacity, s
 			timestr,
 			HTTP_SERVER_NAME,
 			lastmodstr);
+		/* the complete length, none of the ranges was in it */
+		if (response_info->http_status == Range_Not_Satisfiable) {
+			sprintf(range, "Content-Range: bytes */%lld\r\n",
+				(long long)response_info->file_size);
+			strncat(buf, range, strlen(range));
+		}
+	}
+	/* caching directives of the rule for this path, see cachectl.c */
+	if (response_info->cache_rule != NULL &&
+		response_info->http_status < Bad_Request) {
+		strcat(buf, "Cache-Control: ");
+		strcat(buf, response_info->cache_rule->value);
+		strcat(buf, "\r\n");
+		if (response_info->cache_rule->max_age >= 0) {
+			expires = time(NULL) + response_info->cache_rule->max_age;
+			http_date_format(expires, expstr);
+			sprintf(range, "Expires: %s\r\n", expstr);
+			strncat(buf, range, strlen(range));
+		}
 	}
-	if (response_info->body_flag == 1 && response_info->http_status != Not_Modified) {
+	/* tell the client whether the connection stays open */
+	if (response_info->keep_alive == 1)
+		sprintf(conn, "Connection: keep-alive\r\n"
+			"Keep-Alive: timeout=%d\r\n", HTTP_KEEPALIVE_TIMEOUT);
+	else
+		sprintf(conn, "Connection: close\r\n");
+	strncat(buf, conn, strlen(conn));
+	if (response_info->chunked == 1) {
+		/* the body is sent in chunks, it ends with an empty one */
+		sprintf(len, "Transfer-Encoding: chunked\r\n\r\n");
+		strncat(buf, len, strlen(len));
+	} else if (response_info->body_flag == 1 && response_info->http_status != Not_Modified) {
 		/* append a content length and a ending CRLF */
 		sprintf(len, "Content-Length: %zu\r\n\r\n", response_info->content_length);
 		strncat(buf, len, strlen(len));
@@ -89,20 +174,20 @@ int
 cgi_response(struct http_response *response_info, char *resp_buf, size_t capacity, size_t *size)
 {
 	char buf[capacity];
-	char timestr[64], lastmodstr[64];
-	time_t present;
+	char *timestr, lastmodstr[HTTP_DATE_SIZE];
 	int i = 0;
 
-	/* process the current time and last modified time */
-	time(&present);
-	strftime(timestr, sizeof(timestr), rfc1123_DATE_STR, gmtime(&present));
-	strftime(lastmodstr, sizeof(lastmodstr), rfc1123_DATE_STR, gmtime(&response_info->last_modified));
+	/* the current time, formatted once a second, and last modified time */
+	timestr = http_date_now();
+	http_date_format(response_info->last_modified, lastmodstr);
 
+	/* the end of the body is only known when the connection closes */
 	sprintf(buf,
 		"%s %d %s\r\n"
 		"Date: %s\r\n"
 		"Server: %s\r\n"
-		"Last-Modified: %s\r\n",
+		"Last-Modified: %s\r\n"
+		"Connection: close\r\n",
 		HTTP_VERSION, response_info->http_status, status_phrase(response_info->http_status),
 		timestr,
 		HTTP_SERVER_NAME,
@@ -133,6 +218,9 @@ status_phrase(int code)
 		case 204:
 			return "No Content";
 			break;
+		case 206:
+			return "Partial Content";
+			break;
 		case 301:
 			return "Moved Permanently";
 			break;
@@ -154,6 +242,9 @@ status_phrase(int code)
 		case 404:
 			return "Not Found";
 			break;
+		case 416:
+			return "Range Not Satisfiable";
+			break;
 		case 500:
 			return "Internal Server Error";
 			break;
@@ -166,12 +257,51 @@ status_phrase(int code)
 		case 503:
 			return "Service Unavailable";
 			break;
+		case 504:
+			return "Gateway Timeout";
+			break;
 		default:
 			return "UNRECOGNIZED CODE";
 			break;
 	}
 }
 
+/*
+ * The entity tag of a file is made of its inode, size and
+ * modification time, and the coding of the body if it's not
+ * the file itself. A file changed in this second may change
+ * again unnoticed, so its tag is only weak.
+ */
+void
+make_etag(char *buf, size_t capacity, ino_t ino, off_t size, time_t mtime,
+          int encoding)
+{
+	snprintf(buf, capacity, "%s\"%llx-%llx-%llx%s%s\"",
+		mtime >= time(NULL) ? "W/" : "",
+		(unsigned long long)ino, (unsigned long long)size,
+		(unsigned long long)mtime,
+		encoding == ENCODING_NONE ? "" : "-",
+		encoding == ENCODING_NONE ? "" : encoding_name(encoding));
+}
+
+/* get the name of a content coding thru its number in http.h */
+char*
+encoding_name(int encoding)
+{
+	switch(encoding) {
+		case ENCODING_BR:
+			return "br";
+		case ENCODING_ZSTD:
+			return "zstd";
+		case ENCODING_GZIP:
+			return "gzip";
+		case ENCODING_DEFLATE:
+			return "deflate";
+		default:
+			return "identity";
+	}
+}
+
 /*
  * simple routine to check the extension of file path
  * and get the content type
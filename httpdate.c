@@ -0,0 +1,267 @@
+/*
+ * This program parses and formats the dates of HTTP headers:
+ *
+ *	Sun, 06 Nov 1994 08:49:37 GMT	RFC 1123, the one sent
+ *	Sunday, 06-Nov-94 08:49:37 GMT	RFC 850
+ *	Sun Nov  6 08:49:37 1994	asctime(3)
+ *
+ * Dates are always GMT, so they are turned into seconds since the
+ * Epoch and back with the arithmetic of the Gregorian calendar
+ * instead of mktime(3) and gmtime(3), which look at TZ and take
+ * the lock of the time zone; nothing is allocated. The Date of the
+ * responses is formatted once per second.
+ */
+#include <sys/types.h>
+
+#include <string.h>
+#include <time.h>
+
+#include "macros.h"
+#include "httpdate.h"
+
+static BOOL parse_weekday(char *, size_t *);
+static int parse_month(char *);
+static int parse_digits(char *, int);
+static BOOL parse_time(char *, long *);
+static long days_from_civil(long, int, int);
+static void civil_from_days(long, long *, int *, int *);
+static void put_digits(char *, long, int);
+
+static char *wkdays[] = {
+	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+static char *weekdays[] = {
+	"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday",
+	"Saturday"
+};
+static char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+static int month_days[] = {
+	31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+};
+
+/* the Date of the responses made in the second date_time */
+static time_t date_time = -1;
+static char date_now[HTTP_DATE_SIZE];
+
+/*
+ * This function returns the seconds since the Epoch of a date in
+ * any of the three forms, or -1 if it isn't one. A two-digit year
+ * of RFC 850 up to 50 is in this century, a larger one in the last.
+ */
+time_t
+http_date_parse(char *s)
+{
+	size_t n;
+	long year;
+	int mon, day;
+	long secs;
+
+	if (parse_weekday(s, &n) == FALSE)
+		return -1;
+	s += n;
+
+	if (n == 3 && s[0] == ',' && s[1] == ' ') {
+		/* 06 Nov 1994 08:49:37 GMT */
+		s += 2;
+		if (strlen(s) != 24 || s[2] != ' ' || s[6] != ' ' ||
+		    s[11] != ' ' || strcmp(s + 20, " GMT") != 0)
+			return -1;
+		day = parse_digits(s, 2);
+		mon = parse_month(s + 3);
+		year = parse_digits(s + 7, 4);
+		if (parse_time(s + 12, &secs) == FALSE)
+			return -1;
+	} else if (n > 3 && s[0] == ',' && s[1] == ' ') {
+		/* 06-Nov-94 08:49:37 GMT */
+		s += 2;
+		if (strlen(s) != 22 || s[2] != '-' || s[6] != '-' ||
+		    s[9] != ' ' || strcmp(s + 18, " GMT") != 0)
+			return -1;
+		day = parse_digits(s, 2);
+		mon = parse_month(s + 3);
+		year = parse_digits(s + 7, 2);
+		if (year >= 0)
+			year += year <= 50 ? 2000 : 1900;
+		if (parse_time(s + 10, &secs) == FALSE)
+			return -1;
+	} else if (n == 3 && s[0] == ' ') {
+		/* Nov  6 08:49:37 1994, the day may have a leading 0 */
+		s += 1;
+		if (strlen(s) != 20 || s[3] != ' ' || s[6] != ' ' ||
+		    s[15] != ' ')
+			return -1;
+		mon = parse_month(s);
+		day = s[4] == ' ' ? parse_digits(s + 5, 1) : parse_digits(s + 4, 2);
+		year = parse_digits(s + 16, 4);
+		if (parse_time(s + 7, &secs) == FALSE)
+			return -1;
+	} else
+		return -1;
+
+	if (mon < 0 || year < 0 || day < 1 || day > month_days[mon] ||
+	    (mon == 1 && day == 29 &&
+	     (year % 4 != 0 || (year % 100 == 0 && year % 400 != 0))))
+		return -1;
+
+	return (time_t)days_from_civil(year, mon + 1, day) * 86400 + secs;
+}
+
+/*
+ * This function writes the RFC 1123 form of t to buf, which has
+ * HTTP_DATE_SIZE bytes.
+ */
+void
+http_date_format(time_t t, char *buf)
+{
+	long days, secs, year;
+	int mon, day;
+
+	days = (long)(t / 86400);
+	secs = (long)(t % 86400);
+	if (secs < 0) {
+		secs += 86400;
+		days--;
+	}
+	civil_from_days(days, &year, &mon, &day);
+
+	/* 1970-01-01 was a Thursday */
+	(void)memcpy(buf, wkdays[((days % 7) + 11) % 7], 3);
+	buf[3] = ',';
+	buf[4] = ' ';
+	put_digits(buf + 5, day, 2);
+	buf[7] = ' ';
+	(void)memcpy(buf + 8, months + (mon - 1) * 3, 3);
+	buf[11] = ' ';
+	put_digits(buf + 12, year, 4);
+	buf[16] = ' ';
+	put_digits(buf + 17, secs / 3600, 2);
+	buf[19] = ':';
+	put_digits(buf + 20, secs / 60 % 60, 2);
+	buf[22] = ':';
+	put_digits(buf + 23, secs % 60, 2);
+	(void)memcpy(buf + 25, " GMT", 5);
+}
+
+/*
+ * This function returns the Date of a response made now. It's only
+ * formatted again when the second changed.
+ */
+char *
+http_date_now(void)
+{
+	time_t now;
+
+	if ((now = time(NULL)) != date_time) {
+		http_date_format(now, date_now);
+		date_time = now;
+	}
+	return date_now;
+}
+
+/* the name of a day, its length in n */
+static BOOL
+parse_weekday(char *s, size_t *n)
+{
+	int i;
+
+	for (i = 0; i < 7; i++) {
+		*n = strlen(weekdays[i]);
+		if (strncmp(s, weekdays[i], *n) == 0)
+			return TRUE;
+	}
+	for (i = 0; i < 7; i++)
+		if (strncmp(s, wkdays[i], 3) == 0) {
+			*n = 3;
+			return TRUE;
+		}
+	return FALSE;
+}
+
+/* the month of the 3 letters at s from 0, or -1 */
+static int
+parse_month(char *s)
+{
+	int i;
+
+	for (i = 0; i < 12; i++)
+		if (strncmp(s, months + i * 3, 3) == 0)
+			return i;
+	return -1;
+}
+
+/* the number of n digits at s, or -1 */
+static int
+parse_digits(char *s, int n)
+{
+	int i, v;
+
+	for (i = 0, v = 0; i < n; i++) {
+		if (s[i] < '0' || s[i] > '9')
+			return -1;
+		v = v * 10 + (s[i] - '0');
+	}
+	return v;
+}
+
+/* the seconds of "hh:mm:ss" into the day, a leap second is 59 */
+static BOOL
+parse_time(char *s, long *secs)
+{
+	int h, m, sec;
+
+	if (s[2] != ':' || s[5] != ':')
+		return FALSE;
+	h = parse_digits(s, 2);
+	m = parse_digits(s + 3, 2);
+	sec = parse_digits(s + 6, 2);
+	if (h < 0 || h > 23 || m < 0 || m > 59 || sec < 0 || sec > 60)
+		return FALSE;
+	if (sec == 60)
+		sec = 59;
+	*secs = h * 3600L + m * 60L + sec;
+	return TRUE;
+}
+
+/*
+ * The days from 1970-01-01 to a date, counted in eras of 400 years
+ * which start on March 1st, so February ends a year of the era.
+ */
+static long
+days_from_civil(long year, int mon, int day)
+{
+	long era, yoe, doy, doe;
+
+	year -= mon <= 2;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+/* the date of a number of days since 1970-01-01, the reverse */
+static void
+civil_from_days(long days, long *year, int *mon, int *day)
+{
+	long era, doe, yoe, doy, mp;
+
+	days += 719468;
+	era = (days >= 0 ? days : days - 146096) / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	*day = (int)(doy - (153 * mp + 2) / 5 + 1);
+	*mon = (int)(mp < 10 ? mp + 3 : mp - 9);
+	*year = yoe + era * 400 + (*mon <= 2);
+}
+
+/* n digits of v at s, with leading zeros */
+static void
+put_digits(char *s, long v, int n)
+{
+	while (n-- > 0) {
+		s[n] = (char)('0' + v % 10);
+		v /= 10;
+	}
+}
@@ -0,0 +1,12 @@
+#ifndef _HTTPDATE_H_
+#define _HTTPDATE_H_
+
+/* "Sun, 06 Nov 1994 08:49:37 GMT" and its '\0' */
+#define HTTP_DATE_LEN		29
+#define HTTP_DATE_SIZE		(HTTP_DATE_LEN + 1)
+
+time_t http_date_parse(char *);
+void http_date_format(time_t, char *);
+char *http_date_now(void);
+
+#endif /* !_HTTPDATE_H_ */
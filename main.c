@@ -21,11 +21,20 @@
 #include "jstring.h"
 #include "macros.h"
 #include "sws.h"
+#include "fcache.h"
+#include "cachectl.h"
+#include "http.h"
+#include "cgi.h"
+#include "fastcgi.h"
 #include "net.h"
 
 int main(int, char **);
 static BOOL is_dir(char *);
 static JSTRING *convert(char *, char *);
+static int get_model(char *);
+static int get_workers(char *);
+static int get_ttl(char *);
+static int get_cache_mem(char *);
 static void usage();
 static void print_help();
 
@@ -38,13 +47,23 @@ int
 main(int argc, char *argv[])
 {
 	int opt, fd;
-	char *logfile, *cgidir;
+	char *logfile, *cgidir, *rules, *scripts;
 	char *cwd;
 	struct swsopt so;
 	
 	/* By default, set all options to be FALSE */
 	memset(so.opt, FALSE, sizeof(BOOL) * 256);
 	
+	/* The event loop is only available on Linux */
+#ifdef _LINUX_
+	so.model = MODEL_EVENT;
+#else
+	so.model = MODEL_FORK;
+#endif
+	so.workers = 0;
+	so.ttl = FCACHE_TTL;
+	so.cache_mem = FCACHE_MEM;
+	
 	setprogname(argv[0]);
 	
 	/* Get current wording directory */
@@ -57,7 +76,7 @@ main(int argc, char *argv[])
 	}
 	
 	while ((opt = getopt(argc, argv, 
-					"c:dhi:l:p:")) != -1) {
+					"c:df:hi:l:m:M:p:r:t:w:z")) != -1) {
 		switch (opt) {
 		case 'c':
 			so.opt['c'] = TRUE;
@@ -66,6 +85,10 @@ main(int argc, char *argv[])
 		case 'd':
 			so.opt['d'] = TRUE;
 			break;
+		case 'f':
+			so.opt['f'] = TRUE;
+			scripts = optarg;
+			break;
 		case 'h':
 			print_help();
 			/* NOTREACHED */
@@ -77,10 +100,33 @@ main(int argc, char *argv[])
 			so.opt['l'] = TRUE;
 			logfile = optarg;
 			break;
+		case 'm':
+			so.opt['m'] = TRUE;
+			so.model = get_model(optarg);
+			break;
+		case 'M':
+			so.opt['M'] = TRUE;
+			so.cache_mem = get_cache_mem(optarg);
+			break;
 		case 'p':
 			so.opt['p'] = TRUE;
 			so.port = optarg;
 			break;
+		case 'r':
+			so.opt['r'] = TRUE;
+			rules = optarg;
+			break;
+		case 't':
+			so.opt['t'] = TRUE;
+			so.ttl = get_ttl(optarg);
+			break;
+		case 'w':
+			so.opt['w'] = TRUE;
+			so.workers = get_workers(optarg);
+			break;
+		case 'z':
+			so.opt['z'] = TRUE;
+			break;
 		case '?':
 			usage();
 			/* NOTREACHED */
@@ -100,6 +146,13 @@ main(int argc, char *argv[])
 		/* NOTREACHED */
 	}
 	
+	/* the prefork model starts one worker per online cpu by default */
+	if (so.model == MODEL_PREFORK && so.workers == 0) {
+		so.workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (so.workers < 1)
+			so.workers = 1;
+	}
+	
 	/* verify whether dir is a valid directory */
 	if (is_dir(argv[0]) == FALSE) {
 		(void)fprintf(stderr,
@@ -128,6 +181,20 @@ main(int argc, char *argv[])
 		so.cgi_dir = convert(cwd, cgidir);
 	}
 	
+	/* the FastCGI scripts are run from the cgi directory */
+	if (so.opt['f']) {
+		if (so.opt['c'] == FALSE) {
+			(void)fprintf(stderr,
+			  "%s: -f needs a cgi directory given by -c\n",
+			  getprogname());
+			exit(EXIT_FAILURE);
+		}
+		fcgi_load(scripts, jstr_cstr(so.cgi_dir));
+	}
+	
+	/* the caching rules are read once, errors stop the server */
+	if (so.opt['r'])
+		cachectl_load(rules);
 	
 	/*
 	 * -d has higher priority than -l option. If -d
@@ -250,11 +317,85 @@ convert(char *cwd, char *dir)
 	return trimed;
 }
 
+/*
+ * This function converts the name given to -m into one
+ * of the connection handling models in sws.h.
+ */
+static int
+get_model(char *name)
+{
+	if (strcmp(name, "fork") == 0)
+		return MODEL_FORK;
+#ifdef _LINUX_
+	if (strcmp(name, "event") == 0)
+		return MODEL_EVENT;
+	if (strcmp(name, "prefork") == 0)
+		return MODEL_PREFORK;
+	if (strcmp(name, "uring") == 0)
+		return MODEL_URING;
+#endif
+	(void)fprintf(stderr,
+	  "%s: unsupported model '%s'\n",
+	  getprogname(),
+	  name);
+	exit(EXIT_FAILURE);
+}
+
+static int
+get_workers(char *num)
+{
+	char *end;
+	long workers;
+	
+	workers = strtol(num, &end, 10);
+	if (*num == '\0' || *end != '\0' || workers < 1 || workers > 1024) {
+		(void)fprintf(stderr,
+		  "%s: workers must be an integer between 1 and 1024\n",
+		  getprogname());
+		exit(EXIT_FAILURE);
+	}
+	return (int)workers;
+}
+
+static int
+get_ttl(char *num)
+{
+	char *end;
+	long ttl;
+	
+	ttl = strtol(num, &end, 10);
+	if (*num == '\0' || *end != '\0' || ttl < 0 || ttl > 86400) {
+		(void)fprintf(stderr,
+		  "%s: ttl must be an integer between 0 and 86400\n",
+		  getprogname());
+		exit(EXIT_FAILURE);
+	}
+	return (int)ttl;
+}
+
+static int
+get_cache_mem(char *num)
+{
+	char *end;
+	long mem;
+	
+	mem = strtol(num, &end, 10);
+	if (*num == '\0' || *end != '\0' || mem < 0 || mem > 65536) {
+		(void)fprintf(stderr,
+		  "%s: cache memory must be an integer between 0 and 65536\n",
+		  getprogname());
+		exit(EXIT_FAILURE);
+	}
+	return (int)mem;
+}
+
 static void
 usage()
 {
 	(void)fprintf(stderr, 
-	  "usage: %s [-dh] [-c dir] [-i address] [-l file] [-p port] dir\n", 
+	  "usage: %s [-dhz] [-c dir] [-f scripts] [-i address] [-l file] "
+	  "[-m model] "
+	  "[-M mb] [-p port] [-r rules] [-t ttl] [-w workers] dir\n", 
 	  getprogname());
 	exit(EXIT_FAILURE);
 }
@@ -285,6 +426,15 @@ print_help()
 	  "              one connection at a time and enable logging to " \
 	                 "stdout.\n\n");
 	
+	(void)fprintf(stdout,
+	  "       -f scripts\n");
+	(void)fprintf(stdout,
+	  "              Run the CGIs named in the given file as FastCGI " \
+	                 "applications,\n");
+	(void)fprintf(stdout,
+	  "              each with a pool of persistent workers; needs " \
+	                 "-c.\n\n");
+	
 	(void)fprintf(stdout,
 	  "       -h     Print a short usage summary and exit.\n\n");
 	  
@@ -302,6 +452,37 @@ print_help()
 	(void)fprintf(stdout,
 	  "              Log all requests to the given file.\n\n");
 	
+	(void)fprintf(stdout,
+	  "       -m model\n");
+	(void)fprintf(stdout,
+	  "              Select how connections are handled. 'event' " \
+	                 "(the default)\n");
+	(void)fprintf(stdout,
+	  "              serves all connections from one process with " \
+	                 "epoll(7);\n");
+	(void)fprintf(stdout,
+	  "              'fork' forks a child process per connection;\n");
+	(void)fprintf(stdout,
+	  "              'prefork' starts worker processes which run the " \
+	                 "event loop\n");
+	(void)fprintf(stdout,
+	  "              on SO_REUSEPORT sockets of their own;\n");
+	(void)fprintf(stdout,
+	  "              'uring' serves all connections from one process " \
+	                 "with\n");
+	(void)fprintf(stdout,
+	  "              io_uring(7), or with epoll(7) if the kernel " \
+	                 "lacks it.\n\n");
+	
+	(void)fprintf(stdout,
+	  "       -M mb\n");
+	(void)fprintf(stdout,
+	  "              Keep the content of small files in up to mb " \
+	                 "megabytes of\n");
+	(void)fprintf(stdout,
+	  "              memory, 32 by default. SIGUSR1 reports the " \
+	                 "hits and misses.\n\n");
+	
 	(void)fprintf(stdout,
 	  "       -p port\n");
 	(void)fprintf(stdout,
@@ -309,5 +490,37 @@ print_help()
 	                 "will listen\n");
 	(void)fprintf(stdout,
 	  "              on port 8080.\n\n");
+	
+	(void)fprintf(stdout,
+	  "       -r rules\n");
+	(void)fprintf(stdout,
+	  "              Add Cache-Control and Expires headers by the " \
+	                 "rules in the\n");
+	(void)fprintf(stdout,
+	  "              given file, matched by path prefix, glob or " \
+	                 "content type.\n\n");
+	
+	(void)fprintf(stdout,
+	  "       -t ttl\n");
+	(void)fprintf(stdout,
+	  "              Cache the metadata and open descriptors of " \
+	                 "served files\n");
+	(void)fprintf(stdout,
+	  "              for ttl seconds, 10 by default. 0 disables " \
+	                 "the cache.\n\n");
+	
+	(void)fprintf(stdout,
+	  "       -w workers\n");
+	(void)fprintf(stdout,
+	  "              Number of workers of the prefork model. If not " \
+	                 "provided,\n");
+	(void)fprintf(stdout,
+	  "              one worker per online CPU is started.\n\n");
+	
+	(void)fprintf(stdout,
+	  "       -z     Compress text with gzip or deflate for clients " \
+	                 "which accept\n");
+	(void)fprintf(stdout,
+	  "              it, unless the file has a precompressed copy.\n\n");
 	exit(EXIT_SUCCESS);
 }
@@ -9,13 +9,13 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/utsname.h>
+#include <poll.h>
 
 #ifdef _LINUX_
 	#include <bsd/stdlib.h>
 #endif
 
 #include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -28,38 +28,72 @@
 
 
 #include "jstring.h"
-#include "arraylist.h"
 #include "macros.h"
 
 #include "sws.h"
-#include "net.h"
 #include "http.h"
+#include "conn.h"
+#include "net.h"
+#include "event.h"
+#include "uring.h"
+#include "fcache.h"
+#include "compress.h"
+#include "cachectl.h"
+#include "dirlist.h"
+#include "scan.h"
+#include "canon.h"
 #include "cgi.h"
+#include "fastcgi.h"
 
-#define DEFAULT_BACKLOG 10
-#define DEFAULT_BUFFSIZE 512
+#define DEFAULT_BACKLOG SOMAXCONN
 
-static void do_http(struct swsopt *, int, struct sockaddr *,
-					struct sockaddr *, char *);
-static void read_http_header(int, struct http_request *,
-                             struct set_logging *);
-static void get_ip(char *, struct sockaddr *);
-static void send_file(int, struct http_request *, JSTRING *);
-static void send_dirindex(int, int, JSTRING *, char *uri);
-static void send_err_and_exit(int, int);
+static int create_socket(struct sockaddr *, socklen_t, BOOL);
+static void fork_loop(struct swsopt *, int);
+#ifdef _LINUX_
+static void prefork_loop(struct swsopt *, int, struct sockaddr *, socklen_t);
+static pid_t spawn_worker(struct swsopt *, int, struct sockaddr *, socklen_t);
+static void stop_workers(int);
+static void report_workers(int);
+#endif
+static void serve_conn(struct swsopt *, int, struct sockaddr *);
+static BOOL keep_alive(struct conn *, struct http_request *);
+static int route_request(struct swsopt *, struct conn *,
+                         struct http_request *);
+static int serve_cgi(struct swsopt *, struct conn *,
+                     struct http_request *, char *);
+static int run_cgi(struct swsopt *, struct conn *,
+                   struct http_request *, char *);
+static int serve_static(struct conn *, struct http_request *,
+                        struct canon *);
+static int send_file(struct conn *, struct http_request *, char *,
+                     struct fentry *);
+static struct fentry *find_sidecar(struct http_request *, struct fentry *,
+                                   int *, int *);
+static BOOL if_range_matches(struct http_request *, struct fentry *,
+                             char *);
+static int send_unsatisfiable(struct conn *, struct fentry *);
+static void queue_part(struct conn *, struct fentry *, char *, off_t,
+                       size_t);
+static size_t queue_ranges(struct conn *, struct fentry *, char *,
+                           struct http_range *, int, char *);
+static int file_error(void);
+static int open_dir(struct fentry *);
+static int send_dirindex(struct conn *, struct http_request *,
+                         struct fentry *);
+static int stream_dirindex(struct conn *, struct http_request *,
+                           struct fentry *, int);
 
-static int trim_uri(JSTRING *);
 static void verify_port(char *);
-static BOOL replace_userdir(JSTRING *);
-static void separate_query(char *, JSTRING **, JSTRING **);
-static BOOL is_dir(char *);
-static BOOL contains_indexfile(JSTRING *);
-static void write_socket(int, char *, size_t);
-static int lexicographical_compare(const void *, const void *);
 static void perror_exit(char *);
 
 static struct set_logging logger;
 static struct http_response h_res;
+static char server_ip[INET6_ADDRSTRLEN];
+static char *server_port;
+
+/* pids of the pre-forked workers, used by the master process */
+static pid_t *workers;
+static int nworkers;
 
 /*
  * This function creates a server socket and binds
@@ -69,14 +103,11 @@ static struct http_response h_res;
 void
 start_server(struct swsopt *so)
 {
-	int sfd, cfd, errcode;
-	pid_t pid;
-	char *server_port;
+	int sfd, errcode;
 	struct addrinfo hint, *res;
-	struct sockaddr_in ipv4_client;
-	struct sockaddr_in6 ipv6_any, ipv6_client;
-	struct sockaddr *server, *client;
-	socklen_t server_len, client_len;
+	struct sockaddr_in6 ipv6_any;
+	struct sockaddr *server;
+	socklen_t server_len;
 	
 	
 	/* set server socket port and verify */
@@ -124,18 +155,216 @@ start_server(struct swsopt *so)
 	
 	/* 
 	 * create TCP/IP socket, bind to proper address
-	 * then start to listening
+	 * then start to listening. In the prefork model
+	 * every worker listens on a socket of its own; the
+	 * master only binds one to report errors early and
+	 * to keep the port reserved.
 	 */
+	if (so->model == MODEL_PREFORK)
+		sfd = create_socket(server, server_len, TRUE);
+	else {
+		sfd = create_socket(server, server_len, FALSE);
+		if (listen(sfd, DEFAULT_BACKLOG) == -1)
+			perror_exit("listen socket error");
+	}
+	
+	/* used as SERVER_NAME of cgi requests when -i is set */
+	get_ip(server_ip, server);
+	
+	fcache_init(so->ttl, (size_t)so->cache_mem * 1024 * 1024,
+	            so->opt['l'] == TRUE ? so->fd_logfile : STDERR_FILENO);
+	compress_init(so->opt['z']);
+	scan_init();
+	
+	/* files are opened beneath the roots opened here, see canon.c */
+	if (canon_init(jstr_cstr(so->content_dir)) == -1)
+		perror_exit("open content directory error");
+	if (so->opt['c'] == TRUE &&
+	    (so->cgi_fd = canon_root(jstr_cstr(so->cgi_dir))) == -1)
+		perror_exit("open cgi directory error");
+	
+	/* If -d isn't set, run this server as a daemon process. */
+	if (so->opt['d'] == FALSE)
+		if (daemon(0, 0) != 0)
+			perror_exit("daemonize error: ");
+	
+	/* the workers of the FastCGI scripts, see fastcgi.c */
+	if (so->opt['f'] == TRUE && fcgi_start() == -1)
+		perror_exit("start fastcgi manager error");
+	
+#ifdef _LINUX_
+	if (so->model == MODEL_PREFORK)
+		prefork_loop(so, sfd, server, server_len);
+	else if (so->model == MODEL_EVENT)
+		event_loop(so, sfd);
+	else if (so->model == MODEL_URING) {
+		if (uring_loop(so, sfd) == FALSE) {
+			(void)fprintf(stderr,
+			  "%s: io_uring is not available, using epoll\n",
+			  getprogname());
+			event_loop(so, sfd);
+		}
+	} else
+#endif
+		fork_loop(so, sfd);
+	
+	close(sfd);
+	if (so->opt['i'] == TRUE)
+		freeaddrinfo(res);
+
+}
+
+/*
+ * This function creates a TCP/IP socket bound to the
+ * server address. With reuseport set, several sockets
+ * can be bound to the same address and the kernel
+ * balances new connections between them.
+ */
+static int
+create_socket(struct sockaddr *server, socklen_t server_len, BOOL reuseport)
+{
+	int sfd, on;
+	
 	sfd = socket(server->sa_family, SOCK_STREAM, 0);
 	if (sfd == -1)
 		perror_exit("create socket error");
+	
+	on = 1;
+	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+		perror_exit("set SO_REUSEADDR error");
+	
+#ifdef _LINUX_
+	if (reuseport == TRUE &&
+	    setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+		perror_exit("set SO_REUSEPORT error");
+#endif
 		
 	if (bind(sfd, server, server_len) == -1)
 		perror_exit("bind socket error");
 	
+	return sfd;
+}
+
+#ifdef _LINUX_
+/*
+ * This function starts the pre-forked workers and
+ * supervises them. A worker that exits is replaced
+ * by a new one.
+ */
+static void
+prefork_loop(struct swsopt *so, int sfd,
+             struct sockaddr *server, socklen_t server_len)
+{
+	int i;
+	pid_t pid;
+	time_t *started;
+	
+	nworkers = so->workers;
+	MALLOC(workers, pid_t, nworkers);
+	MALLOC(started, time_t, nworkers);
+	
+	for (i = 0; i < nworkers; i++)
+		workers[i] = 0;
+	
+	if (signal(SIGTERM, &stop_workers) == SIG_ERR ||
+	    signal(SIGINT, &stop_workers) == SIG_ERR ||
+	    signal(SIGUSR1, &report_workers) == SIG_ERR)
+		perror_exit("signal error");
+	
+	for (i = 0; i < nworkers; i++) {
+		workers[i] = spawn_worker(so, sfd, server, server_len);
+		started[i] = time(NULL);
+	}
+	
+	for (;;) {
+		if ((pid = wait(NULL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror_exit("wait worker error");
+		}
+		
+		for (i = 0; i < nworkers; i++)
+			if (workers[i] == pid)
+				break;
+		if (i == nworkers)
+			continue;
+		
+		/* don't respawn in a tight loop if workers keep failing */
+		if (time(NULL) - started[i] < 1)
+			(void)sleep(1);
+		
+		workers[i] = spawn_worker(so, sfd, server, server_len);
+		started[i] = time(NULL);
+	}
+}
+
+/*
+ * A worker listens on a SO_REUSEPORT socket of its own
+ * and serves its connections with the event loop.
+ */
+static pid_t
+spawn_worker(struct swsopt *so, int master_fd,
+             struct sockaddr *server, socklen_t server_len)
+{
+	int sfd;
+	pid_t pid;
+	
+	if ((pid = fork()) == -1)
+		perror_exit("fork worker error");
+	
+	if (pid > 0)
+		return pid;
+	
+	(void)close(master_fd);
+	if (signal(SIGTERM, SIG_DFL) == SIG_ERR ||
+	    signal(SIGINT, SIG_DFL) == SIG_ERR)
+		perror_exit("signal error");
+	
+	sfd = create_socket(server, server_len, TRUE);
 	if (listen(sfd, DEFAULT_BACKLOG) == -1)
 		perror_exit("listen socket error");
-		
+	
+	event_loop(so, sfd);
+	_exit(EXIT_SUCCESS);
+}
+
+/* the master passes SIGTERM and SIGINT on to its workers */
+static void
+stop_workers(int signum)
+{
+	int i;
+	
+	for (i = 0; i < nworkers; i++)
+		if (workers[i] > 0)
+			(void)kill(workers[i], SIGTERM);
+	_exit(EXIT_SUCCESS);
+}
+
+/* every worker reports on its own file cache */
+static void
+report_workers(int signum)
+{
+	int i;
+	
+	for (i = 0; i < nworkers; i++)
+		if (workers[i] > 0)
+			(void)kill(workers[i], SIGUSR1);
+}
+#endif
+
+/*
+ * This function serves every connection in its own
+ * child process.
+ */
+static void
+fork_loop(struct swsopt *so, int sfd)
+{
+	int cfd;
+	pid_t pid;
+	struct sockaddr_in ipv4_client;
+	struct sockaddr_in6 ipv6_client;
+	struct sockaddr *client;
+	socklen_t client_len;
 	
 	/* 
 	 * Since ipv4 and ipv6 have different structure,
@@ -150,11 +379,6 @@ start_server(struct swsopt *so)
 		client_len = sizeof(struct sockaddr_in);
 	}
 	
-	/* If -d isn't set, run this server as a daemon process. */
-	if (so->opt['d'] == FALSE)
-		if (daemon(0, 0) != 0)
-			perror_exit("daemonize error: ");
-		
 	/*
 	 * This infinite loop makes server accept next request
 	 * after it dealt with the last one.
@@ -176,7 +400,7 @@ start_server(struct swsopt *so)
 			
 			if (pid > 0) {
 				close(cfd);
-				(void)wait(NULL);
+				(void)waitpid(pid, NULL, 0);
 			} else {
 				if ((pid = fork()) == -1)
 					perror_exit("fork second child error: ");
@@ -184,8 +408,7 @@ start_server(struct swsopt *so)
 				if (pid > 0) 
 					_exit(EXIT_SUCCESS);
 				else {
-					do_http(so, cfd, client, server, server_port);
-					close(cfd);
+					serve_conn(so, cfd, client);
 					_exit(EXIT_SUCCESS);
 				}	
 			}
@@ -200,469 +423,861 @@ start_server(struct swsopt *so)
 			
 			if (pid > 0) {
 				close(cfd);
-				(void)wait(NULL);
+				(void)waitpid(pid, NULL, 0);
 			} else {
-				do_http(so, cfd, client, server, server_port);
-				close(cfd);
+				serve_conn(so, cfd, client);
 				_exit(EXIT_SUCCESS);
 			}
 		}
-			
+	}
+}
+
+/*
+ * This function serves one connection with blocking I/O.
+ * It's called in the child process of the fork model.
+ */
+static void
+serve_conn(struct swsopt *so, int cfd, struct sockaddr *client)
+{
+	struct conn *c;
+	struct pollfd pfd;
+	int n, result;
+	BOOL more;
+	
+	c = conn_create(cfd, client);
+	pfd.fd = cfd;
+	pfd.events = POLLIN;
+	
+	result = CONN_AGAIN;
+	for (;;) {
+		/* close the connection if the client stays idle */
+		while (result == CONN_AGAIN) {
+			if (poll(&pfd, 1, HTTP_KEEPALIVE_TIMEOUT * 1000) < 1)
+				break;
+			result = conn_read(c);
+		}
 		
+		if (result != CONN_DONE) {
+			if (result == CONN_ERROR)
+				send_err(c, Internal_Server_Error);
+			else if (result != CONN_AGAIN && c->head_len > c->head_start)
+				send_err(c, Bad_Request);
+			(void)conn_flush(c);
+			break;
+		}
 		
+		/*
+		 * Answer all requests the client already sent before
+		 * the responses are written together.
+		 */
+		for (n = 1; ; n++) {
+			do_http(so, c);
+			more = c->keep_alive == TRUE && conn_next(c) == TRUE;
+			if (more == FALSE || n == CONN_PIPELINE_MAX)
+				break;
+		}
+		
+		if (conn_flush(c) != CONN_DONE || c->keep_alive == FALSE)
+			break;
+		
+		result = more == TRUE ? CONN_DONE : CONN_AGAIN;
 	}
 	
-	close(sfd);
-	if (so->opt['i'] == TRUE)
-		freeaddrinfo(res);
-
+	conn_free(c);
 }
 
 /*
  * This function implements the main logic of handling
- * http request and response.
+ * http request and response. The request head must be
+ * buffered in the connection; the response is queued
+ * to it.
  */
-static void
-do_http(struct swsopt *so, int cfd, 
-		struct sockaddr *client,
-		struct sockaddr *server,
-		char *server_port)
+void
+do_http(struct swsopt *so, struct conn *c)
 {
-	int cgi_result, trim_result;
-	struct cgi_request cgi_req;
-	/* ipv6 length is enough for both type */
-	char server_ip[INET6_ADDRSTRLEN];
-	char client_ip[INET6_ADDRSTRLEN];
+	int status;
 	struct http_request hr;
     extern struct http_response h_res;
     extern struct set_logging logger;
-	JSTRING *url, *query;
-	struct utsname uname_buf;
-	
-	get_ip(server_ip, server);
-	get_ip(client_ip, client);
 	
-    logger.client_ip = client_ip;
+    logger.client_ip = c->client_ip;
     logger.fd = so->fd_logfile;
     logger.logging_flag = so->opt['l'];
 	
-	read_http_header(cfd, &hr, &logger);
+	c->nrequests++;
+	
+	/* nothing of the last response may leak into this one */
+	h_res.content_encoding = ENCODING_NONE;
+	h_res.chunked = 0;
+	h_res.etag = NULL;
+	h_res.cache_rule = NULL;
+	h_res.content_type = NULL;
+	h_res.vary_accept = 0;
+	h_res.vary_encoding = 0;
+	
+	/* request() return 0 means success */
+	if (request(c->head + c->head_start, &c->parser, &hr, &logger) != 0)
+		status = Bad_Request;
+	else {
+		c->keep_alive = keep_alive(c, &hr);
+		h_res.keep_alive = c->keep_alive;
+		status = route_request(so, c, &hr);
+	}
+	
+	if (status != 0)
+		send_err(c, status);
     
+    clean_request(&hr);
+    clean_logging(&logger);
+}
+
+/*
+ * HTTP/1.1 connections are persistent unless the client
+ * asks to close them, HTTP/1.0 clients have to ask for
+ * keep-alive. A connection serves HTTP_KEEPALIVE_MAX
+ * requests at most. A request body is never read, so
+ * the connection ends after a request which has one.
+ */
+static BOOL
+keep_alive(struct conn *c, struct http_request *hr)
+{
+	if (c->nrequests >= HTTP_KEEPALIVE_MAX ||
+	    hr->connection == CONNECTION_CLOSE ||
+	    hr->content_length > 0 ||
+	    hr->transfer_encoding != TRANSFER_NONE)
+		return FALSE;
+	
+	if (hr->http_version >= (float)HTTP_IMPL_VERSION)
+		return TRUE;
+	
+	return hr->connection == CONNECTION_KEEPALIVE;
+}
+
+/*
+ * This function checks the request and passes it to the
+ * cgi or the static file handler. It returns 0 when the
+ * response was queued, or an http error status code.
+ */
+static int
+route_request(struct swsopt *so, struct conn *c, struct http_request *hr)
+{
+	int status;
+	char path[CANON_SIZE];
+	struct canon cp;
+	
 	/* verify if http version is supported */
-	if (hr.http_version > HTTP_IMPL_VERSION)
-		send_err_and_exit(cfd, Not_Implemented);
+	if (hr->http_version > (float)HTTP_IMPL_VERSION)
+		return Not_Implemented;
 	
 	/* Check if the request method is not HEAD or GET */
-	if (hr.method_type != HEAD &&
-	    hr.method_type != GET)
-		send_err_and_exit(cfd, Not_Implemented);
+	if (hr->method_type != HEAD &&
+	    hr->method_type != GET)
+		return Not_Implemented;
 	
-	/* separate url and query string */
-	separate_query(hr.request_URL, &url, &query);
+	/*
+	 * clean the path, map a user directory and verify the
+	 * file doesn't leave the content directory, see canon.c
+	 */
+	status = canon_path(hr->request_URL, path, sizeof(path), &cp);
+	if (status != 0)
+		return status;
 	
-	/* trim uri and verify if the actual file exceeds CWD */
-	trim_result = trim_uri(url);
-	if (trim_result != 0)
-		send_err_and_exit(cfd, trim_result);
+	/* If -c is set and URL starts with /cgi-bin */
+	if (so->opt['c'] == TRUE && cp.url != NULL && is_cgi_call(cp.url) == TRUE)
+		return serve_cgi(so, c, hr, cp.url);
+	return serve_static(c, hr, &cp);
+}
+
+static int
+serve_cgi(struct swsopt *so, struct conn *c, struct http_request *hr,
+          char *url)
+{
+	int cgi_result;
+	pid_t pid;
 	
+	/* the cgi output ends when the connection is closed */
+	c->keep_alive = FALSE;
 	
-    h_res.file_path = jstr_cstr(url);
-    
-	/* If -c is set and URL starts with /cgi-bin */
-	if (so->opt['c'] == TRUE && is_cgi_call(url) == TRUE) {
-		/* Initialize struct cgi_request */
-		cgi_req.cfd = cfd;
-		cgi_req.request_method = hr.method_type;
-		cgi_req.cgi_dir = so->cgi_dir;
-		
-		/* 
-		 * If -i is set, use the ip address as server
-		 * name; or, use nodename as server name
-		 */
-		if (so->opt['i'] == TRUE)
-			cgi_req.server_name = server_ip;
-		else {
-			if (uname(&uname_buf) == -1)
-				send_err_and_exit(cfd, Internal_Server_Error);
-			cgi_req.server_name = uname_buf.nodename;
-		}
-		
-		cgi_req.server_port = server_port;
-		cgi_req.client_ip = client_ip;
-		cgi_req.uri = url;
-		cgi_req.query = query;
-		
-		cgi_result = call_cgi(&cgi_req, &h_res);
-		if (cgi_result != OK)
-			send_err_and_exit(cfd, cgi_result);
-		
-        logger.state_code = cgi_result;
-        /* can't get Content-Length from cgi call */
-        logger.content_length = 0;
-        (void)logging(&logger);
-	} else {
-		/* 
-		 * If url doesn't start with /~<user> and is a 
-		 * relative path, it should be concatenated with
-		 * current working directory.
-		 */
-		if (replace_userdir(url) == FALSE)
-			jstr_insert(url, 0, jstr_cstr(so->content_dir));
-		
-		/*
-		 * If url denotes a directory and contains index.html,
-		 * the index.html file will be sent as response; If it
-		 * is a directory but doesn't contain index.html, the
-		 * directory index will be generated and sent to client.
-		 */
-		if (is_dir(jstr_cstr(url)) == TRUE &&
-			contains_indexfile(url) == TRUE) {
-			if (jstr_charat(url, jstr_length(url) - 1) != '/')
-				jstr_append(url, '/');
-			jstr_concat(url, "index.html");
-			send_file(cfd, &hr, url);
-		} else if (is_dir(jstr_cstr(url)) == TRUE)
-			send_dirindex(cfd, hr.method_type, url, hr.request_URL);
+	/*
+	 * The cgi program writes to the client socket directly.
+	 * Unless this process already serves only this client,
+	 * the request is passed to a child process and the
+	 * connection is dropped from the event loop.
+	 */
+	if (so->model == MODEL_FORK)
+		return run_cgi(so, c, hr, url);
+	
+	if ((pid = fork()) == -1)
+		return Internal_Server_Error;
+	
+	if (pid > 0) {
+		c->state = CONN_CLOSING;
+		return 0;
+	}
+	
+	(void)signal(SIGCHLD, SIG_DFL);
+	conn_close_others(c);
+	if (fcntl(c->fd, F_SETFL, 0) == -1)
+		_exit(EXIT_FAILURE);
+	
+	if ((cgi_result = run_cgi(so, c, hr, url)) != 0)
+		send_err(c, cgi_result);
+	(void)conn_flush(c);
+	_exit(EXIT_SUCCESS);
+}
+
+static int
+run_cgi(struct swsopt *so, struct conn *c, struct http_request *hr,
+        char *url)
+{
+	int cgi_result;
+	struct cgi_request cgi_req;
+	struct utsname uname_buf;
+    extern struct http_response h_res;
+    extern struct set_logging logger;
+	
+	/* Initialize struct cgi_request */
+	cgi_req.cfd = c->fd;
+	cgi_req.request_method = hr->method_type;
+	cgi_req.cgi_dir = so->cgi_dir;
+	cgi_req.cgi_fd = so->cgi_fd;
+	
+	/* 
+	 * If -i is set, use the ip address as server
+	 * name; or, use nodename as server name
+	 */
+	if (so->opt['i'] == TRUE)
+		cgi_req.server_name = server_ip;
+	else {
+		if (uname(&uname_buf) == -1)
+			return Internal_Server_Error;
+		cgi_req.server_name = uname_buf.nodename;
+	}
+	
+	cgi_req.server_port = server_port;
+	cgi_req.client_ip = c->client_ip;
+	cgi_req.uri = jstr_create(url);
+	cgi_req.query = jstr_create(hr->query != NULL ? hr->query : "");
+	cgi_req.host = hr->host;
+	cgi_req.user_agent = hr->user_agent;
+	
+	/* responses to earlier pipelined requests go first */
+	if (conn_flush(c) != CONN_DONE)
+		cgi_result = 0;
+	else {
+		h_res.file_path = url;
+		if (so->opt['f'] == TRUE && is_fastcgi_call(url) == TRUE)
+			cgi_result = call_fastcgi(&cgi_req, &h_res);
 		else
-			send_file(cfd, &hr, url);
+			cgi_result = call_cgi(&cgi_req, &h_res);
 	}
+	jstr_free(cgi_req.uri);
+	jstr_free(cgi_req.query);
+	if (cgi_result != OK)
+		return cgi_result;
 	
-	jstr_free(url);
-	jstr_free(query);
-    
-    clean_request(&hr);
-    clean_logging(&logger);
+    logger.state_code = cgi_result;
+    /* can't get Content-Length from cgi call */
+    logger.content_length = 0;
+    (void)logging(&logger);
+	return 0;
 }
 
 /*
- * This function reads the http request header to the buffer.
+ * This function serves the file or the directory of cp, whose name
+ * canon_path() wrote with room for "/index.html" after it.
  */
-static void
-read_http_header(int cfd, struct http_request *phr, 
-                 struct set_logging *logger)
+static int
+serve_static(struct conn *c, struct http_request *hr, struct canon *cp)
 {
-	ssize_t i, count;
-	char buf[DEFAULT_BUFFSIZE];
-	char request_head[HTTP_REQUEST_MAX_LENGTH];
-	ssize_t request_len;
-	BOOL end_of_request;
-	int offset;
-	char *end_flag;
-	
-	offset = 0;
-	request_len = 0;
-	end_flag = "\r\n\r\n";
-	end_of_request = FALSE;
-	
-	while ((count = read(cfd, buf, DEFAULT_BUFFSIZE)) > 0) {
-		for (i = 0; i < count; i++, request_len++) {
-			request_head[request_len] = buf[i];
-			
-			/* verify if it's the end of request */
-			offset = buf[i] == end_flag[offset] ? offset + 1 : 0;
-			if (offset == 4) {
-				end_of_request = TRUE;
-				break;
-			}
-			
-			/* verify length */
-			if (request_len == HTTP_REQUEST_MAX_LENGTH - 1)
-				send_err_and_exit(cfd, Bad_Request);
-				
-		}
-		if (end_of_request == TRUE)
-			break;
-	}
-	if (count == -1)
-		send_err_and_exit(cfd, Internal_Server_Error);
+	struct fentry *fe;
+	char *file;
+	size_t len;
 	
-	if (end_of_request == FALSE)
-		send_err_and_exit(cfd, Bad_Request);
-	
-	/* request() return 0 means success */
-	if (request(request_head, phr, logger) != 0)
-		send_err_and_exit(cfd, Bad_Request);
+	/* the metadata comes from the file cache, see fcache.c */
+	file = cp->file;
+	if ((fe = fcache_get(file, cp->dir, cp->rel)) == NULL)
+		return file_error();
 	
+	/*
+	 * If url denotes a directory and contains index.html,
+	 * the index.html file will be sent as response; If it
+	 * is a directory but doesn't contain index.html, the
+	 * directory index will be generated and sent to client.
+	 */
+	if (S_ISDIR(fe->mode) && fe->has_index == TRUE) {
+		fcache_put(fe);
+		len = strlen(file);
+		if (file[len - 1] == '/')
+			len--;
+		(void)strcpy(file + len, "/index.html");
+		if ((fe = fcache_get(file, cp->dir, cp->rel)) == NULL)
+			return file_error();
+	} else if (S_ISDIR(fe->mode))
+		return send_dirindex(c, hr, fe);
+	
+	return send_file(c, hr, file, fe);
 }
 
-static void
-send_file(int cfd, struct http_request *hr, JSTRING *path)
+/*
+ * This function sends the file of the cache entry fe and
+ * gives back its reference.
+ */
+static int
+send_file(struct conn *c, struct http_request *hr, char *path,
+          struct fentry *fe)
 {
 	extern struct set_logging logger;
 	extern struct http_response h_res;
     BOOL need_send;
-	struct stat stat_buf;
-	int fd;
-	ssize_t read_count;
-	char buf[DEFAULT_BUFFSIZE];
+	int fd, status;
 	char resp_buf[HTTP_RESPONSE_MAX_LENGTH];
-    size_t size;
+	char *head, *body, *zbody;
+    size_t size, zlen;
+	struct http_range ranges[HTTP_RANGES_MAX];
+	int nranges;
+	static char boundary[24];
+	static char etag[HTTP_ETAG_MAX];
+	struct fentry *sidecar;
+	int rule;
+	
+	if (!S_ISREG(fe->mode)) {
+		fcache_put(fe);
+		return Not_Found;
+	}
 	
-	if (stat(jstr_cstr(path), &stat_buf) == -1) {
-		if (errno == ENOENT)
-			send_err_and_exit(cfd, Not_Found);
-		else if (errno == EACCES)
-			send_err_and_exit(cfd, Forbidden);
-		else
-			send_err_and_exit(cfd, Internal_Server_Error);
+	/*
+	 * a precompressed copy is sent in place of the file, but
+	 * the content type comes from the name of the original
+	 */
+	h_res.file_path = path;
+	if ((sidecar = find_sidecar(hr, fe, &h_res.content_encoding,
+	                            &h_res.vary_encoding)) != NULL) {
+		fcache_put(fe);
+		fe = sidecar;
 	}
 	
-	if (!S_ISREG(stat_buf.st_mode))
-		send_err_and_exit(cfd, Not_Found);
+	/*
+	 * without a precompressed copy, the file may be compressed
+	 * here once and sent from the variant cache; the ranges of
+	 * a file always refer to the file itself. Any response of a
+	 * type that's compressed is one of the variants.
+	 */
+	if (compress_type(get_content_type(h_res.file_path)))
+		h_res.vary_encoding = 1;
+	if (sidecar == NULL && hr->range == NULL &&
+	    fe->size >= COMPRESS_MIN && fe->size <= COMPRESS_FILE_MAX)
+		h_res.content_encoding = compress_encoding(hr,
+		                             get_content_type(h_res.file_path));
+	
+	/*
+	 * the variant is decided before the tag the conditions are
+	 * checked against: a file which doesn't get smaller is sent
+	 * as it is, the variant cache remembers that
+	 */
+	zbody = NULL;
+	zlen = 0;
+	if (sidecar == NULL && h_res.content_encoding != ENCODING_NONE &&
+	    (zbody = compress_file(fe, h_res.content_encoding, &zlen)) == NULL)
+		h_res.content_encoding = ENCODING_NONE;
+	make_etag(etag, sizeof(etag), fe->ino, fe->size, fe->mtime,
+	          h_res.content_encoding);
+	h_res.etag = etag;
+	h_res.cache_rule = cachectl_match(hr->request_URL,
+	                                  get_content_type(h_res.file_path));
+	rule = h_res.cache_rule != NULL ? h_res.cache_rule->index : -1;
 	
-	/* 1 means has If-Modified-Since header */
+	/*
+	 * the file is not sent again if the client has it, an
+	 * If-None-Match header overrides If-Modified-Since
+	 */
 	need_send = TRUE;
-	if (hr->if_modified_flag == 1 &&
-	    difftime(stat_buf.st_mtime, hr->if_modified_since) <= 0)
+	if (hr->if_none_match != NULL) {
+		if (match_etag(hr->if_none_match, etag, 0))
+			need_send = FALSE;
+	} else if (hr->if_modified_flag == 1 &&
+	    difftime(fe->mtime, hr->if_modified_since) <= 0)
 		need_send = FALSE;
 	
-	if (hr->method_type == HEAD) {
-		/* send head response, without Content-Length */
-        h_res.last_modified = time(NULL);
-        h_res.content_length = 0;
-        h_res.http_status = OK;
-        h_res.body_flag = 0;
-        
-        size = 0;
-        (void)response(&h_res, resp_buf, 
-                       HTTP_RESPONSE_MAX_LENGTH, &size);
-        
-        
-        write_socket(cfd, resp_buf, size);
-        
-        /* log the response */
-        logger.state_code = h_res.http_status;
-        logger.content_length = h_res.content_length;
-
-        (void)logging(&logger);
-		return;
-	}
+	/*
+	 * a Range header counts only while If-Range still matches,
+	 * otherwise the whole file is sent
+	 */
+	nranges = -1;
+	if (need_send && hr->range != NULL && if_range_matches(hr, fe, etag))
+		nranges = parse_range(hr->range, fe->size, ranges,
+		                      HTTP_RANGES_MAX);
+	if (nranges == 0)
+		return send_unsatisfiable(c, fe);
 	
-	if ((fd = open(jstr_cstr(path), O_RDONLY)) == -1) {
-		if (errno == ENOENT)
-			send_err_and_exit(cfd, Not_Found);
-		else if (errno == EACCES)
-			send_err_and_exit(cfd, Forbidden);
-		else
-			send_err_and_exit(cfd, Internal_Server_Error);
+	/*
+	 * only GET request need the file to send message body,
+	 * a small file is sent from memory
+	 */
+	body = NULL;
+	fd = -1;
+	if (need_send && zbody == NULL && hr->method_type == GET &&
+	    (body = fcache_body(fe)) == NULL &&
+	    (fd = fcache_open(fe)) == -1) {
+		status = file_error();
+		fcache_put(fe);
+		return status;
 	}
 		
 	
-	/* prepare response head data */
-	h_res.last_modified = stat_buf.st_mtime;
-    h_res.body_flag = need_send;
+	/* 
+	 * prepare response head data, a HEAD response has the
+	 * same header fields as the GET response would have
+	 */
+	h_res.last_modified = fe->mtime;
+    h_res.body_flag = 1;
+    h_res.boundary = NULL;
     /* 
      * check if it needs to add Content-Length
      * header and sends message body 
      */
-    if (need_send) {
+    if (need_send && nranges > 0) {
+		h_res.http_status = Partial_Content;
+		h_res.file_size = fe->size;
+		if (nranges == 1) {
+			h_res.range_first = ranges[0].first;
+			h_res.range_last = ranges[0].last;
+			h_res.content_length = ranges[0].last - ranges[0].first + 1;
+		} else {
+			(void)snprintf(boundary, sizeof(boundary), "%08x%08x",
+			               arc4random(), arc4random());
+			h_res.boundary = boundary;
+			h_res.content_length = queue_ranges(NULL, fe, NULL, ranges,
+			                                    nranges, boundary);
+		}
+    } else if (need_send) {
 		h_res.http_status = OK;
-		h_res.content_length = stat_buf.st_size;
+		h_res.content_length = zbody != NULL ? zlen : fe->size;
 	} else {
 		h_res.http_status = Not_Modified;
 		h_res.content_length = 0;
 	}
         
     
-    /* send http response head */
-    size = 0;
-    (void)response(&h_res, resp_buf, 
-                   HTTP_RESPONSE_MAX_LENGTH, &size);
-    write_socket(cfd, resp_buf, size);
+    /* 
+     * queue http response head, the 200 head of a cached
+     * file is built once per second; a compressed variant
+     * is not a file of its own
+     */
+    if (h_res.http_status != OK || zbody != NULL ||
+        (head = fcache_head(fe, h_res.keep_alive, h_res.content_encoding,
+                            h_res.vary_encoding, rule, &size)) == NULL) {
+        size = 0;
+        (void)response(&h_res, resp_buf, 
+                       HTTP_RESPONSE_MAX_LENGTH, &size);
+        head = resp_buf;
+        if (h_res.http_status == OK && zbody == NULL)
+            fcache_set_head(fe, h_res.keep_alive, h_res.content_encoding,
+                            h_res.vary_encoding, rule, resp_buf, size);
+    }
+    conn_queue(c, head, size);
     
     
-    /* send message body when needed */
-	if (need_send) {
-        while ((read_count = read(fd, buf, DEFAULT_BUFFSIZE)) > 0)
-            write_socket(cfd, buf, read_count);
-        if (read_count == -1)
-            perror_exit("read file error: ");
-    }
-	(void)close(fd);
+    /* queue message body when needed */
+	if (need_send && zbody != NULL && hr->method_type == GET)
+		conn_queue(c, zbody, zlen);
+	else if (body == NULL && fd == -1)
+		;
+	else if (nranges > 1)
+		(void)queue_ranges(c, fe, body, ranges, nranges, boundary);
+	else if (nranges == 1)
+		queue_part(c, fe, body, ranges[0].first, h_res.content_length);
+	else
+		queue_part(c, fe, body, 0, fe->size);
+	fcache_put(fe);
 	
 	/* log the response */
     logger.state_code = h_res.http_status;
-    logger.content_length = h_res.content_length;
+    logger.content_length = body != NULL || fd != -1 ||
+                            (need_send && zbody != NULL &&
+                             hr->method_type == GET) ?
+                            h_res.content_length : 0;
     
     (void)logging(&logger);
+	return 0;
 }
 
+/*
+ * Look for a precompressed copy next to the file of the entry file,
+ * beneath the same root, such as
+ * foo.css.gz for foo.css, in the coding with the highest q-value
+ * the client sent; codings it likes equally are tried in the
+ * order of http.h. The entry is returned with a reference and
+ * its coding is stored in encoding. vary is set to 1 if there is
+ * a copy, in a coding the client takes or not: the file itself is
+ * then only one of the variants.
+ */
+static struct fentry *
+find_sidecar(struct http_request *hr, struct fentry *file, int *encoding,
+             int *vary)
+{
+	static char *suffix[HTTP_ENCODINGS] = { ".br", ".zst", ".gz", NULL };
+	struct fentry *fe, *other;
+	char *name;
+	size_t len;
+	int tried[HTTP_ENCODINGS];
+	int i, best;
+
+	for (i = 0; i < HTTP_ENCODINGS; i++)
+		tried[i] = 0;
+
+	len = strlen(file->path);
+	MALLOC(name, char, len + sizeof(".zst"));
+	(void)memcpy(name, file->path, len);
+
+	fe = NULL;
+	while (fe == NULL) {
+		best = ENCODING_NONE;
+		for (i = 0; i < HTTP_ENCODINGS; i++)
+			if (!tried[i] && suffix[i] != NULL &&
+			    hr->encoding_q[i] > 0 &&
+			    (best == ENCODING_NONE ||
+			     hr->encoding_q[i] > hr->encoding_q[best]))
+				best = i;
+		if (best == ENCODING_NONE)
+			break;
+		tried[best] = 1;
+
+		(void)strcpy(name + len, suffix[best]);
+		if ((fe = fcache_get(name, file->dir, name + file->rel)) != NULL &&
+		    !S_ISREG(fe->mode)) {
+			fcache_put(fe);
+			fe = NULL;
+		}
+		if (fe != NULL)
+			*encoding = best;
+	}
+
+	*vary = fe != NULL;
+	for (i = 0; *vary == 0 && i < HTTP_ENCODINGS; i++) {
+		if (tried[i] || suffix[i] == NULL)
+			continue;
+		(void)strcpy(name + len, suffix[i]);
+		if ((other = fcache_get(name, file->dir,
+		                        name + file->rel)) != NULL) {
+			*vary = S_ISREG(other->mode);
+			fcache_put(other);
+		}
+	}
+
+	free(name);
+	return fe;
+}
+
+/*
+ * If-Range names the version the client has a part of, by a date
+ * equal to the modification time or by the same strong entity tag.
+ */
+static BOOL
+if_range_matches(struct http_request *hr, struct fentry *fe, char *etag)
+{
+	if (hr->if_range_flag == IF_RANGE_NONE)
+		return TRUE;
+	if (hr->if_range_flag == IF_RANGE_DATE)
+		return hr->if_range_date == fe->mtime;
+	return match_etag(hr->if_range_etag, etag, 1);
+}
+
+/* queue the 416 response, none of the ranges is in the file */
+static int
+send_unsatisfiable(struct conn *c, struct fentry *fe)
+{
+	extern struct set_logging logger;
+	extern struct http_response h_res;
+	char resp_buf[HTTP_RESPONSE_MAX_LENGTH];
+	size_t size;
+
+	h_res.http_status = Range_Not_Satisfiable;
+	h_res.last_modified = fe->mtime;
+	h_res.body_flag = 1;
+	h_res.content_length = 0;
+	h_res.file_size = fe->size;
+	fcache_put(fe);
+
+	size = 0;
+	(void)response(&h_res, resp_buf, HTTP_RESPONSE_MAX_LENGTH, &size);
+	conn_queue(c, resp_buf, size);
+
+	logger.state_code = h_res.http_status;
+	logger.content_length = 0;
+	(void)logging(&logger);
+	return 0;
+}
+
+/*
+ * Queue len bytes of the file from offset, out of the cached
+ * body if there is one. Every segment holds its own reference.
+ */
 static void
-send_dirindex(int cfd, int method_type, JSTRING *path, char *uri)
+queue_part(struct conn *c, struct fentry *fe, char *body, off_t offset,
+           size_t len)
+{
+	fcache_hold(fe);
+	if (body != NULL)
+		conn_queue_body(c, fe, body + offset, len);
+	else
+		conn_queue_entry(c, fe, offset, len);
+}
+
+/*
+ * Queue a multipart/byteranges body, each range with a head of
+ * its own. If c is NULL, only the length of the body is counted,
+ * as it's needed for the Content-Length of the response head.
+ */
+static size_t
+queue_ranges(struct conn *c, struct fentry *fe, char *body,
+             struct http_range *ranges, int nranges, char *boundary)
+{
+	extern struct http_response h_res;
+	char part[HTTP_RESPONSE_MAX_LENGTH];
+	char *type;
+	size_t total, len;
+	int i;
+
+	type = get_content_type(h_res.file_path);
+	total = 0;
+	for (i = 0; i < nranges; i++) {
+		len = snprintf(part, sizeof(part),
+		               "\r\n--%s\r\n"
+		               "Content-Type: %s\r\n"
+		               "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+		               boundary, type, (long long)ranges[i].first,
+		               (long long)ranges[i].last, (long long)fe->size);
+		total += len + ranges[i].last - ranges[i].first + 1;
+		if (c != NULL) {
+			conn_queue(c, part, len);
+			queue_part(c, fe, body, ranges[i].first,
+			           ranges[i].last - ranges[i].first + 1);
+		}
+	}
+
+	len = snprintf(part, sizeof(part), "\r\n--%s--\r\n", boundary);
+	total += len;
+	if (c != NULL)
+		conn_queue(c, part, len);
+	return total;
+}
+
+/*
+ * This function sends the index of the directory of the cache
+ * entry fe and gives back its reference. The rendered index is
+ * kept in the entry, so until the directory changes a request
+ * for it is answered from memory with a single write. An index
+ * too large to be rendered at once is streamed, and one in JSON
+ * is rendered for each request, see dirlist.c.
+ */
+static int
+send_dirindex(struct conn *c, struct http_request *hr, struct fentry *fe)
 {
 	extern struct http_response h_res;
     extern struct set_logging logger;
-    DIR *dp;
-	struct dirent *dirp;
-	size_t i, bodylen;
-	ARRAYLIST *list;
-	JSTRING *filename;
 	char resp_buf[HTTP_RESPONSE_MAX_LENGTH];
-    size_t size;
-    
-    char *tag_before_title;
-	char *tag_before_h1;
-	char *tag_before_li;
-	char *tag_left_li;
-	char *tag_middle_li;
-	char *tag_right_li;
-	char *tag_after_li;
-	
-	size_t tag_before_title_len;
-	size_t tag_before_h1_len;
-	size_t tag_before_li_len;
-	size_t tag_left_li_len;
-	size_t tag_middle_li_len;
-	size_t tag_right_li_len;
-	size_t tag_after_li_len;
-	
-	size_t uri_len;
-	
-	
-	list = arrlist_create();
-	
-	/* 
-	 * Denotes the http response body length to this 
-	 * request.
-	 */
-	bodylen = 0;
-	
-	if ((dp = opendir(jstr_cstr(path))) == NULL ) {
-		if (errno == ENOENT)
-			send_err_and_exit(cfd, Not_Found);
-		else if (errno == EACCES)
-			send_err_and_exit(cfd, Forbidden);
-		else
-			send_err_and_exit(cfd, Internal_Server_Error);
-	}
-		
-	while ((dirp = readdir(dp)) != NULL ) {
-		/*  Files starting with a '.' are ignored. */
-		if (dirp->d_name[0] == '.')
-			continue;
-		
-		filename = jstr_create(dirp->d_name);
-		bodylen += jstr_length(filename);
-		arrlist_add(list, filename);
+    size_t size, bodylen;
+	char *html, uri[HTTP_REQUEST_MAX_LENGTH];
+	long page, limit;
+	BOOL cached;
+	int format, encoding, status, fd;
+	struct zstream *zs;
+	
+	/* an index is shown and kept for the path with its query string */
+	if (hr->query != NULL)
+		(void)snprintf(uri, sizeof(uri), "%s?%s", hr->request_URL,
+		               hr->query);
+	else
+		(void)snprintf(uri, sizeof(uri), "%s", hr->request_URL);
+	format = dirlist_format(hr->query, hr->accept);
+	
+	/* the compressed index is chunked, HTTP/1.0 can't take it */
+	encoding = ENCODING_NONE;
+	if (hr->http_version >= 1.1)
+		encoding = compress_encoding(hr, dirlist_type(format));
+	
+	html = NULL;
+	if (format == DIRLIST_HTML)
+		html = fcache_listing(fe, uri, &bodylen);
+	cached = html != NULL;
+	if (html == NULL) {
+		if (dirlist_query(hr->query, &page, &limit) == FALSE)
+			page = 0;
+		if ((fd = open_dir(fe)) == -1) {
+			status = file_error();
+			fcache_put(fe);
+			return status;
+		}
+		html = dirlist_render(fd, uri, format, page, limit,
+		                      &bodylen, &status);
+		if (html == NULL && status == 0)
+			return stream_dirindex(c, hr, fe, format);
+		if (html == NULL) {
+			fcache_put(fe);
+			return status;
+		}
+		if (format == DIRLIST_HTML)
+			cached = fcache_set_listing(fe, uri, html, bodylen);
 	}
-	(void)closedir(dp);
-	
-	/* sort the list in alphanumeric order */
-	arrlist_sort(list, &lexicographical_compare);
-	
-	tag_before_title = \
-		"<!DOCTYPE html>\n" \
-		"<html>\n" \
-		"\t<head><title>Index of ";
-	tag_before_h1 = \
-		"</title></head>\n" \
-		"\t<body>\n" \
-		"\t\t<h1>Index of ";
-	tag_before_li = \
-		"</h1>\n" \
-		"\t\t<ul>\n";
-	tag_left_li = "\t\t\t<li><a href=\"";
-	tag_middle_li = "\"> ";
-	tag_right_li = "</a></li>\n";
-	tag_after_li = "\t\t</ul>\n\t</body>\n</html>";
-	
-	tag_before_title_len = strlen(tag_before_title);
-	tag_before_h1_len = strlen(tag_before_h1);
-	tag_before_li_len = strlen(tag_before_li);
-	tag_left_li_len = strlen(tag_left_li);
-	tag_middle_li_len = strlen(tag_middle_li);
-	tag_right_li_len = strlen(tag_right_li);
-	tag_after_li_len = strlen(tag_after_li);
-	
-	uri_len = strlen(uri);
-	
-	/* each uri will be wrote twice */
-	bodylen *= 2;
-	
-	bodylen += uri_len * 2;
-	
-	bodylen += tag_before_title_len +
-			   tag_before_h1_len +
-			   tag_before_li_len +
-			   tag_left_li_len * arrlist_size(list) +
-			   tag_middle_li_len * arrlist_size(list) +
-			   tag_right_li_len * arrlist_size(list) +
-			   tag_after_li_len;
 	
 	/* send response head */
-    h_res.last_modified = time(NULL);
+    h_res.file_path = fe->path;
+    h_res.last_modified = fe->mtime;
     h_res.content_length = bodylen;
     h_res.http_status = OK;
     
-	if (method_type == HEAD) {
-		bodylen = 0;
-		h_res.body_flag = 0;
-	} else if (method_type == GET)
-		h_res.body_flag = 1;
-	else
-		send_err_and_exit(cfd, Not_Implemented);
+	/* HEAD response has Content-Length too */
+	h_res.body_flag = 1;
+	
+	/* a compressed index is sent in chunks, see compress.c */
+	h_res.content_encoding = encoding;
+	h_res.chunked = encoding != ENCODING_NONE;
+	h_res.content_type = dirlist_type(format);
+	h_res.vary_accept = 1;
+	h_res.vary_encoding = compress_type(h_res.content_type);
+	h_res.cache_rule = cachectl_match(hr->request_URL, h_res.content_type);
 	
 	size = 0;
 	(void)response(&h_res, resp_buf, 
 					   HTTP_RESPONSE_MAX_LENGTH, &size);
-	write_socket(cfd, resp_buf, size);
+	conn_queue(c, resp_buf, size);
 	
 	/* only GET request need send message body */
-	if (method_type == GET) {
-		/* send message body */
-		write_socket(cfd, tag_before_title, tag_before_title_len);
-		write_socket(cfd, uri, uri_len);
-		write_socket(cfd, tag_before_h1, tag_before_h1_len);
-		write_socket(cfd, uri, uri_len);
-		write_socket(cfd, tag_before_li, tag_before_li_len);
-		for (i = 0; i < arrlist_size(list); i++) {
-			filename = (JSTRING *)arrlist_get(list, i);
-			
-			write_socket(cfd, tag_left_li, tag_left_li_len);
-			write_socket(cfd, jstr_cstr(filename), jstr_length(filename));
-			write_socket(cfd, tag_middle_li, tag_middle_li_len);
-			write_socket(cfd, jstr_cstr(filename), jstr_length(filename));
-			write_socket(cfd, tag_right_li, tag_right_li_len);
-			
-			jstr_free(filename);
-		}
-		write_socket(cfd, tag_after_li, tag_after_li_len);
-	}
-	
-	arrlist_free(list);
+	if (hr->method_type == GET && encoding != ENCODING_NONE) {
+		zs = zstream_open(c, encoding);
+		zstream_write(zs, html, bodylen);
+		bodylen = zstream_close(zs);
+	} else if (hr->method_type == GET && cached) {
+		fcache_hold(fe);
+		conn_queue_body(c, fe, html, bodylen);
+	} else if (hr->method_type == GET)
+		conn_queue(c, html, bodylen);
+	
+	if (!cached)
+		free(html);
+	fcache_put(fe);
     
     /* log the response */
     logger.state_code = OK;
-    logger.content_length = bodylen;
+    logger.content_length = hr->method_type == GET ? bodylen : 0;
     
     (void)logging(&logger);
+	return 0;
 }
 
+/*
+ * This function streams the index of a huge directory. Its length
+ * isn't known, so it's sent in chunks to an HTTP/1.1 client and
+ * up to the end of the connection otherwise. It's not compressed.
+ */
+static int
+stream_dirindex(struct conn *c, struct http_request *hr, struct fentry *fe,
+                int format)
+{
+	extern struct http_response h_res;
+    extern struct set_logging logger;
+	char resp_buf[HTTP_RESPONSE_MAX_LENGTH];
+    size_t size;
+	BOOL chunked;
+	int status, fd;
+	struct dirstream *ds;
+	
+	chunked = hr->http_version >= 1.1;
+	if ((fd = open_dir(fe)) == -1) {
+		status = file_error();
+		fcache_put(fe);
+		return status;
+	}
+	ds = dirlist_stream(fd, hr->request_URL, format, chunked, &status);
+	if (ds == NULL) {
+		fcache_put(fe);
+		return status;
+	}
+	
+	if (!chunked) {
+		c->keep_alive = FALSE;
+		h_res.keep_alive = FALSE;
+	}
+	
+    h_res.file_path = fe->path;
+    h_res.last_modified = fe->mtime;
+    h_res.http_status = OK;
+	h_res.body_flag = 0;
+	h_res.chunked = chunked;
+	h_res.content_type = dirlist_type(format);
+	h_res.vary_accept = 1;
+	/* a smaller index of the directory would be compressed */
+	h_res.vary_encoding = compress_type(h_res.content_type);
+	h_res.cache_rule = cachectl_match(hr->request_URL, h_res.content_type);
+	
+	size = 0;
+	(void)response(&h_res, resp_buf, 
+					   HTTP_RESPONSE_MAX_LENGTH, &size);
+	conn_queue(c, resp_buf, size);
+	
+	if (hr->method_type == GET)
+		dirlist_queue(c, ds);
+	else
+		dirlist_close(ds);
+	fcache_put(fe);
+	
+	/* the length is not known before the stream ends */
+    logger.state_code = OK;
+    logger.content_length = 0;
+    
+    (void)logging(&logger);
+	return 0;
+}
 
-static void
-send_err_and_exit(int cfd, int err_code)
+/*
+ * A 404 only changes with the second and the connection header, so
+ * the two of them are kept rendered for the paths found missing over
+ * and over, see fcache_get().
+ */
+void
+send_err(struct conn *c, int err_code)
 {
     extern struct http_response h_res;
 	extern struct set_logging logger;
+	static char not_found[2][HTTP_RESPONSE_MAX_LENGTH];
+	static size_t not_found_len[2];
+	static time_t not_found_time[2];
     char resp_buf[HTTP_RESPONSE_MAX_LENGTH];
     size_t size;
+	time_t now;
+	int k;
     
-    h_res.last_modified = time(NULL);
-    h_res.http_status = err_code;
-    /* 
-	 * 4xx and 5xx should include Content-Length, but
-	 * the value could be 0.
-	 */
-	h_res.content_length = 0;
-	h_res.body_flag = 1; // 1 means including Content-Length
-    
-    size = 0;
-    (void)response(&h_res, resp_buf, 
-                   HTTP_RESPONSE_MAX_LENGTH, &size);
+	if (err_code != Not_Found && err_code != Forbidden)
+		c->keep_alive = FALSE;
+	h_res.keep_alive = c->keep_alive;
+	now = time(NULL);
+	k = c->keep_alive == TRUE;
+
+	if (err_code == Not_Found && not_found_time[k] == now) {
+		conn_queue(c, not_found[k], not_found_len[k]);
+	} else {
+		h_res.last_modified = now;
+		h_res.http_status = err_code;
+		/* 
+		 * 4xx and 5xx should include Content-Length, but
+		 * the value could be 0.
+		 */
+		h_res.content_length = 0;
+		h_res.body_flag = 1; // 1 means including Content-Length
+		h_res.chunked = 0;
     
-    write_socket(cfd, resp_buf, size);
+		size = 0;
+		(void)response(&h_res, resp_buf, 
+					   HTTP_RESPONSE_MAX_LENGTH, &size);
     
-	close(cfd);
+		conn_queue(c, resp_buf, size);
+		if (err_code == Not_Found) {
+			(void)memcpy(not_found[k], resp_buf, size);
+			not_found_len[k] = size;
+			not_found_time[k] = now;
+		}
+	}
     
     /* log to file */
     logger.state_code = err_code;
@@ -670,78 +1285,6 @@ send_err_and_exit(int cfd, int err_code)
     
     /* return 0 when error happened */
     (void)logging(&logger);
-        
-    
-	_exit(EXIT_FAILURE);
-}
-
-
-static void
-get_ip(char *ip, struct sockaddr *addr) 
-{
-	void *in_addr;
-	
-	if (addr->sa_family == AF_INET)
-		in_addr = 
-			(void *)&((struct sockaddr_in *)addr)->sin_addr;
-	else if (addr->sa_family == AF_INET6)
-		in_addr = 
-			(void *)&((struct sockaddr_in6 *)addr)->sin6_addr;
-	
-	(void)inet_ntop(addr->sa_family, in_addr,
-					ip, INET6_ADDRSTRLEN);
-}
-
-static int 
-trim_uri(JSTRING *uri)
-{
-	size_t i;
-	JSTRING *temp, *last;
-	ARRAYLIST *list;
-	
-	list = arrlist_create();
-	
-	/* uri must start with '/' */
-	arrlist_add(list, jstr_create("/"));
-	
-	temp = jstr_create("");
-	for (i = 1; i < jstr_length(uri); i++) {
-		jstr_append(temp, jstr_charat(uri, i));
-		if (jstr_charat(uri, i) == '/' || 
-			i == jstr_length(uri) - 1) {
-			if (jstr_equals(temp, "..") == 0 ||
-				jstr_equals(temp, "../") == 0) {
-				
-				if (arrlist_size(list) > 1) {
-					last = (JSTRING *)arrlist_remove(list, 
-							arrlist_size(list) - 1);
-					jstr_free(last);
-				} else
-					return Forbidden;
-				
-				jstr_free(temp);
-			} else if (jstr_equals(temp, ".") == 0 ||
-					   jstr_equals(temp, "./") == 0 ||
-					   jstr_equals(temp, "/") == 0) {
-				jstr_free(temp);
-			} else {
-				arrlist_add(list, temp);
-			}
-			temp = jstr_create("");
-		}
-	}
-	jstr_free(temp);
-	
-	jstr_trunc(uri, jstr_length(uri), 0);
-	for (i = 0; i < arrlist_size(list); i++) {
-		temp = (JSTRING *)arrlist_get(list, i);
-		jstr_concat(uri, jstr_cstr(temp));
-		jstr_free(temp);
-	}
-		
-	arrlist_free(list);
-	
-	return 0;
 }
 
 static void 
@@ -775,127 +1318,26 @@ verify_port(char *port)
 }
 
 /*
- * This function replace /~<user> with /home/<user>/sws/,
- * and return TRUE if replacement successes, or return 
- * FALSE if the path doesn't need to be replaced.
- */
-static BOOL
-replace_userdir(JSTRING *path)
-{
-	size_t i;
-	JSTRING *user;
-	
-	if (jstr_length(path) <= 2)
-		return FALSE;
-	
-	if (strncmp(jstr_cstr(path), "/~/", 3) == 0)
-		return FALSE;
-	
-	if (strncmp(jstr_cstr(path), "/~", 2) != 0)
-		return FALSE;
-	
-	user = jstr_create("/home/");
-	for (i = 2; 
-		 i < jstr_length(path) && jstr_charat(path, i) != '/';
-		 i++)
-		jstr_append(user, jstr_charat(path, i));
-	jstr_concat(user, "/sws");
-    
-	if (i >= jstr_length(path) || jstr_charat(path, i) != '/')
-		jstr_append(user, '/');
-	
-	jstr_trunc(path, i, jstr_length(path) - i);
-	jstr_insert(path, 0, jstr_cstr(user));
-	
-	jstr_free(user);
-	return TRUE;
-}
-
-/*
- * This function separate query string from the original
- * uri.
+ * Open the directory of a cache entry to list it, beneath its root
+ * like the entry itself, so a link swapped in since doesn't leave it.
  */
-static void
-separate_query(char *uri, JSTRING **url, JSTRING **query)
+static int
+open_dir(struct fentry *fe)
 {
-	size_t i;
-	JSTRING *juri;
-	
-	juri = jstr_create(uri);
-	
-	for (i = 0; i < jstr_length(juri); i++)
-		if (jstr_charat(juri, i) == '?')
-			break;
-	if (i != jstr_length(juri)) {
-		*url = jstr_substr(juri, 0, i);
-		*query = jstr_substr(juri, i + 1, jstr_length(juri) - i - 1);
-		jstr_free(juri);
-	} else {
-		*url = juri;
-		*query = jstr_create("");
-	}
+	return canon_open(fe->dir, fe->path + fe->rel,
+	                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 }
 
-static BOOL
-is_dir(char *path)
+/* map the errno of a failed open(2) to a status, EXDEV left the root */
+static int
+file_error(void)
 {
-	struct stat buf;
-	
-	if (stat(path, &buf) != -1 && 
-	    S_ISDIR(buf.st_mode))
-		return TRUE;
+	if (errno == ENOENT || errno == ENOTDIR)
+		return Not_Found;
+	else if (errno == EACCES || errno == EXDEV)
+		return Forbidden;
 	else
-		return FALSE;
-}
-
-static BOOL
-contains_indexfile(JSTRING *path)
-{
-	JSTRING *temp;
-	struct stat buf;
-	BOOL flag;
-	
-	flag = FALSE;
-	temp = jstr_create(jstr_cstr(path));
-	if (jstr_charat(temp, jstr_length(temp) - 1) != '/')
-		jstr_append(temp, '/');
-	jstr_concat(temp, "index.html");
-	
-	if (stat(jstr_cstr(temp), &buf) != -1 &&
-		S_ISREG(buf.st_mode))
-		flag = TRUE;	
-	
-	jstr_free(temp);
-	
-	return flag;
-}
-
-static void
-write_socket(int sfd, char *buf, size_t len)
-{
-	ssize_t count;
-		
-	count = 0;
-	while ((count = write(sfd, buf, len)) > 0) {
-		if (count < len) {
-			len -= count;
-			buf += count;
-		} else
-			break;
-	}
-	if (count == -1)
-		perror("write socket error: ");
-}
-
-static int 
-lexicographical_compare(const void *p1, const void *p2)
-{
-	JSTRING *fp1, *fp2; 
-	
-	fp1 = *(JSTRING * const *)p1;
-	fp2 = *(JSTRING * const *)p2;
-	
-	return strcmp(jstr_cstr(fp1), jstr_cstr(fp2));
+		return Internal_Server_Error;
 }
 
 static void
@@ -1,6 +1,15 @@
 #ifndef _NET_H_
 #define _NET_H_
 
+struct conn;
+
 void start_server(struct swsopt *);
 
+/* 
+ * do_http(2) handles the request head buffered in the connection
+ * and queues the response; send_err(2) queues an error response.
+ */
+void do_http(struct swsopt *, struct conn *);
+void send_err(struct conn *, int);
+
 #endif /* !_NET_H_ */
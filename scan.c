@@ -0,0 +1,436 @@
+/*
+ * This program holds the kernels http_parse() uses to find the end
+ * of the runs of a request head: the bytes of a method or a field
+ * name, of the target or the version, and of a field value; and
+ * the one http_decoding() uses to find the next escape. Each
+ * returns the length of the run at the start of its buffer, which
+ * is all of it if the run doesn't end there.
+ *
+ * Every kernel has a scalar version on a table of byte classes. On
+ * x86-64 tokens are found with the ranges of SSE4.2's PCMPESTRI and
+ * the other runs with SSE2, 16 bytes at a time, or AVX2, 64 at a
+ * time; on AArch64 with NEON. AVX2 and SSE4.2 are used only if
+ * scan_init() finds them on the CPU, so the program is built for
+ * the plain architecture. The bytes after the last whole block go
+ * to the scalar version.
+ */
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SCAN_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define SCAN_NEON
+#include <arm_neon.h>
+#endif
+
+#include "scan.h"
+
+static size_t token_scalar(char *, size_t);
+static size_t target_scalar(char *, size_t);
+static size_t value_scalar(char *, size_t);
+static size_t plain_scalar(char *, size_t);
+
+#ifdef SCAN_X86
+static size_t token_sse42(char *, size_t);
+static size_t target_sse2(char *, size_t);
+static size_t value_sse2(char *, size_t);
+static size_t target_avx2(char *, size_t);
+static size_t value_avx2(char *, size_t);
+static size_t plain_sse2(char *, size_t);
+static size_t plain_avx2(char *, size_t);
+#endif
+
+#ifdef SCAN_NEON
+static size_t first_neon(uint8x16_t);
+static size_t target_neon(char *, size_t);
+static size_t value_neon(char *, size_t);
+static size_t plain_neon(char *, size_t);
+#endif
+
+/* the classes of each byte */
+const unsigned char scan_class[256] = {
+	8, 12, 12, 12, 12, 12, 12, 12, 12, 12, 8, 12, 12, 8, 12, 12,
+	12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+	12, 15, 14, 15, 15, 7, 15, 15, 14, 14, 15, 7, 14, 15, 15, 14,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 14, 14, 14, 14, 14, 14,
+	14, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 14, 14, 14, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 14, 15, 14, 15, 12,
+	14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+	14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+	14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+	14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+	14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+	14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+	14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+	14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+};
+
+/* the kernels in use, the scalar ones until scan_init() */
+static size_t (*token_kernel)(char *, size_t) = token_scalar;
+static size_t (*target_kernel)(char *, size_t) = target_scalar;
+static size_t (*value_kernel)(char *, size_t) = value_scalar;
+static size_t (*plain_kernel)(char *, size_t) = plain_scalar;
+
+/*
+ * This function picks the fastest kernels the CPU has. It's called
+ * once at startup, before any request is parsed.
+ */
+void
+scan_init(void)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	target_kernel = target_sse2;
+	value_kernel = value_sse2;
+	plain_kernel = plain_sse2;
+	if (__builtin_cpu_supports("sse4.2"))
+		token_kernel = token_sse42;
+	if (__builtin_cpu_supports("avx2")) {
+		target_kernel = target_avx2;
+		value_kernel = value_avx2;
+		plain_kernel = plain_avx2;
+	}
+#endif
+#ifdef SCAN_NEON
+	target_kernel = target_neon;
+	value_kernel = value_neon;
+	plain_kernel = plain_neon;
+#endif
+}
+
+/* the length of the token at p */
+size_t
+scan_token(char *p, size_t len)
+{
+	return token_kernel(p, len);
+}
+
+/* the length of the target or version at p, up to a space or a CTL */
+size_t
+scan_target(char *p, size_t len)
+{
+	return target_kernel(p, len);
+}
+
+/* the length of the value at p, up to a CR, an LF or a NUL */
+size_t
+scan_value(char *p, size_t len)
+{
+	return value_kernel(p, len);
+}
+
+/* the length of the part of a path at p up to a '%' or a '+' */
+size_t
+scan_plain(char *p, size_t len)
+{
+	return plain_kernel(p, len);
+}
+
+static size_t
+token_scalar(char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len &&
+	     (scan_class[(unsigned char)p[i]] & SCAN_TOKEN) != 0; i++)
+		;
+	return i;
+}
+
+static size_t
+target_scalar(char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len &&
+	     (scan_class[(unsigned char)p[i]] & SCAN_TARGET) != 0; i++)
+		;
+	return i;
+}
+
+static size_t
+value_scalar(char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len &&
+	     (scan_class[(unsigned char)p[i]] & SCAN_VALUE) != 0; i++)
+		;
+	return i;
+}
+
+static size_t
+plain_scalar(char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len &&
+	     (scan_class[(unsigned char)p[i]] & SCAN_PLAIN) != 0; i++)
+		;
+	return i;
+}
+
+#ifdef SCAN_X86
+/*
+ * PCMPESTRI compares each byte with up to 8 ranges at once; the
+ * token characters take 9, so '~' is left out. The scalar version
+ * goes on from a byte outside the ranges, which is the end of the
+ * token unless it's a '~'.
+ */
+__attribute__((target("sse4.2")))
+static size_t
+token_sse42(char *p, size_t len)
+{
+	static const char ranges[SCAN_SSE_BLOCK] = "!!#'*+-.09AZ^z||";
+	__m128i r, v;
+	size_t i;
+	int n;
+
+	r = _mm_loadu_si128((const __m128i *)ranges);
+	for (i = 0; i + SCAN_SSE_BLOCK <= len; i += SCAN_SSE_BLOCK) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		n = _mm_cmpestri(r, SCAN_SSE_BLOCK, v, SCAN_SSE_BLOCK,
+		    _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+		    _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT);
+		if (n != SCAN_SSE_BLOCK) {
+			i += n;
+			break;
+		}
+	}
+	return i + token_scalar(p + i, len - i);
+}
+
+/*
+ * A byte ends the target if it's at most a space, which is when the
+ * unsigned minimum of it and a space is itself, or if it's a DEL.
+ */
+static size_t
+target_sse2(char *p, size_t len)
+{
+	__m128i sp, del, v, m;
+	size_t i;
+	int mask;
+
+	sp = _mm_set1_epi8(' ');
+	del = _mm_set1_epi8(0x7f);
+	for (i = 0; i + SCAN_SSE_BLOCK <= len; i += SCAN_SSE_BLOCK) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		m = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, sp), v),
+		    _mm_cmpeq_epi8(v, del));
+		if ((mask = _mm_movemask_epi8(m)) != 0)
+			return i + __builtin_ctz((unsigned int)mask);
+	}
+	return i + target_scalar(p + i, len - i);
+}
+
+static size_t
+value_sse2(char *p, size_t len)
+{
+	__m128i cr, lf, nul, v, m;
+	size_t i;
+	int mask;
+
+	cr = _mm_set1_epi8('\r');
+	lf = _mm_set1_epi8('\n');
+	nul = _mm_setzero_si128();
+	for (i = 0; i + SCAN_SSE_BLOCK <= len; i += SCAN_SSE_BLOCK) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+		    _mm_cmpeq_epi8(v, lf)), _mm_cmpeq_epi8(v, nul));
+		if ((mask = _mm_movemask_epi8(m)) != 0)
+			return i + __builtin_ctz((unsigned int)mask);
+	}
+	return i + value_scalar(p + i, len - i);
+}
+
+static size_t
+plain_sse2(char *p, size_t len)
+{
+	__m128i pct, plus, v, m;
+	size_t i;
+	int mask;
+
+	pct = _mm_set1_epi8('%');
+	plus = _mm_set1_epi8('+');
+	for (i = 0; i + SCAN_SSE_BLOCK <= len; i += SCAN_SSE_BLOCK) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		m = _mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, plus));
+		if ((mask = _mm_movemask_epi8(m)) != 0)
+			return i + __builtin_ctz((unsigned int)mask);
+	}
+	return i + plain_scalar(p + i, len - i);
+}
+
+/*
+ * The AVX2 kernels take two vectors at a time and join their masks
+ * into one 64-bit word. The upper halves of the registers are
+ * cleared before the SSE2 version takes the rest, as mixing the two
+ * encodings is slow.
+ */
+__attribute__((target("avx2")))
+static size_t
+target_avx2(char *p, size_t len)
+{
+	__m256i sp, del, v, w;
+	uint64_t mask;
+	size_t i;
+
+	mask = 0;
+	sp = _mm256_set1_epi8(' ');
+	del = _mm256_set1_epi8(0x7f);
+	for (i = 0; i + SCAN_AVX_BLOCK <= len; i += SCAN_AVX_BLOCK) {
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		w = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+		v = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, sp), v),
+		    _mm256_cmpeq_epi8(v, del));
+		w = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(w, sp), w),
+		    _mm256_cmpeq_epi8(w, del));
+		mask = (uint32_t)_mm256_movemask_epi8(v) |
+		    (uint64_t)(uint32_t)_mm256_movemask_epi8(w) << 32;
+		if (mask != 0)
+			break;
+	}
+	_mm256_zeroupper();
+	if (i + SCAN_AVX_BLOCK <= len)
+		return i + __builtin_ctzll(mask);
+	return i + target_sse2(p + i, len - i);
+}
+
+/*
+ * A CR, an LF or a NUL is found with one lookup by the low 4 bits
+ * of each byte: nibbles 0, 10 and 13 give those bytes, the others
+ * 0xff, and PSHUFB gives 0 for a byte of 0x80 or more, so only the
+ * three bytes equal what they look up.
+ */
+__attribute__((target("avx2")))
+static size_t
+value_avx2(char *p, size_t len)
+{
+	__m256i tbl, v, w;
+	uint64_t mask;
+	size_t i;
+
+	mask = 0;
+	tbl = _mm256_setr_epi8(
+	    0, -1, -1, -1, -1, -1, -1, -1, -1, -1, '\n', -1, -1, '\r', -1, -1,
+	    0, -1, -1, -1, -1, -1, -1, -1, -1, -1, '\n', -1, -1, '\r', -1, -1);
+	for (i = 0; i + SCAN_AVX_BLOCK <= len; i += SCAN_AVX_BLOCK) {
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		w = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+		v = _mm256_cmpeq_epi8(_mm256_shuffle_epi8(tbl, v), v);
+		w = _mm256_cmpeq_epi8(_mm256_shuffle_epi8(tbl, w), w);
+		mask = (uint32_t)_mm256_movemask_epi8(v) |
+		    (uint64_t)(uint32_t)_mm256_movemask_epi8(w) << 32;
+		if (mask != 0)
+			break;
+	}
+	_mm256_zeroupper();
+	if (i + SCAN_AVX_BLOCK <= len)
+		return i + __builtin_ctzll(mask);
+	return i + value_sse2(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+plain_avx2(char *p, size_t len)
+{
+	__m256i pct, plus, v, w;
+	uint64_t mask;
+	size_t i;
+
+	mask = 0;
+	pct = _mm256_set1_epi8('%');
+	plus = _mm256_set1_epi8('+');
+	for (i = 0; i + SCAN_AVX_BLOCK <= len; i += SCAN_AVX_BLOCK) {
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		w = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+		v = _mm256_or_si256(_mm256_cmpeq_epi8(v, pct),
+		    _mm256_cmpeq_epi8(v, plus));
+		w = _mm256_or_si256(_mm256_cmpeq_epi8(w, pct),
+		    _mm256_cmpeq_epi8(w, plus));
+		mask = (uint32_t)_mm256_movemask_epi8(v) |
+		    (uint64_t)(uint32_t)_mm256_movemask_epi8(w) << 32;
+		if (mask != 0)
+			break;
+	}
+	_mm256_zeroupper();
+	if (i + SCAN_AVX_BLOCK <= len)
+		return i + __builtin_ctzll(mask);
+	return i + plain_sse2(p + i, len - i);
+}
+#endif /* SCAN_X86 */
+
+#ifdef SCAN_NEON
+/*
+ * NEON has no byte mask of a comparison: shifting each 16-bit lane
+ * right by 4 and narrowing it leaves 4 bits for every byte in a
+ * 64-bit word, so the first match is at its lowest set bit / 4.
+ */
+static size_t
+first_neon(uint8x16_t m)
+{
+	uint64_t bits;
+
+	bits = vget_lane_u64(vreinterpret_u64_u8(
+	    vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+	return bits == 0 ? SCAN_SSE_BLOCK : (size_t)__builtin_ctzll(bits) >> 2;
+}
+
+static size_t
+target_neon(char *p, size_t len)
+{
+	uint8x16_t sp, del, v, m;
+	size_t i, n;
+
+	sp = vdupq_n_u8(' ');
+	del = vdupq_n_u8(0x7f);
+	for (i = 0; i + SCAN_SSE_BLOCK <= len; i += SCAN_SSE_BLOCK) {
+		v = vld1q_u8((const uint8_t *)(p + i));
+		m = vorrq_u8(vcleq_u8(v, sp), vceqq_u8(v, del));
+		if ((n = first_neon(m)) != SCAN_SSE_BLOCK)
+			return i + n;
+	}
+	return i + target_scalar(p + i, len - i);
+}
+
+static size_t
+value_neon(char *p, size_t len)
+{
+	uint8x16_t cr, lf, v, m;
+	size_t i, n;
+
+	cr = vdupq_n_u8('\r');
+	lf = vdupq_n_u8('\n');
+	for (i = 0; i + SCAN_SSE_BLOCK <= len; i += SCAN_SSE_BLOCK) {
+		v = vld1q_u8((const uint8_t *)(p + i));
+		m = vorrq_u8(vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, lf)),
+		    vceqzq_u8(v));
+		if ((n = first_neon(m)) != SCAN_SSE_BLOCK)
+			return i + n;
+	}
+	return i + value_scalar(p + i, len - i);
+}
+
+static size_t
+plain_neon(char *p, size_t len)
+{
+	uint8x16_t pct, plus, v, m;
+	size_t i, n;
+
+	pct = vdupq_n_u8('%');
+	plus = vdupq_n_u8('+');
+	for (i = 0; i + SCAN_SSE_BLOCK <= len; i += SCAN_SSE_BLOCK) {
+		v = vld1q_u8((const uint8_t *)(p + i));
+		m = vorrq_u8(vceqq_u8(v, pct), vceqq_u8(v, plus));
+		if ((n = first_neon(m)) != SCAN_SSE_BLOCK)
+			return i + n;
+	}
+	return i + plain_scalar(p + i, len - i);
+}
+#endif /* SCAN_NEON */
@@ -0,0 +1,25 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+/* bytes taken by each step of the vector kernels */
+#define SCAN_SSE_BLOCK		16
+#define SCAN_AVX_BLOCK		64
+
+/* bytes of a run looked up in scan_class[] before a kernel is called */
+#define SCAN_SHORT			16
+
+/* classes of bytes in scan_class[] */
+#define SCAN_TOKEN		1	/* of a method or a field name */
+#define SCAN_TARGET		2	/* of the target or the version */
+#define SCAN_VALUE		4	/* of a field value: not CR, LF or NUL */
+#define SCAN_PLAIN		8	/* of a URL, not '%' or '+' */
+
+extern const unsigned char scan_class[256];
+
+void scan_init(void);
+size_t scan_token(char *, size_t);
+size_t scan_target(char *, size_t);
+size_t scan_value(char *, size_t);
+size_t scan_plain(char *, size_t);
+
+#endif /* !_SCAN_H_ */
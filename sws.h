@@ -1,13 +1,24 @@
 #ifndef _SWS_H_
 #define _SWS_H_
 
+/* connection handling models, selected by -m */
+#define MODEL_FORK		0
+#define MODEL_EVENT		1
+#define MODEL_PREFORK	2
+#define MODEL_URING		3
+
 struct swsopt {
 	BOOL opt[256];
 	JSTRING *content_dir;
 	JSTRING *cgi_dir;
+	int cgi_fd;		/* cgi_dir opened by start_server() */
 	char *address;
 	int fd_logfile;
 	char *port;
+	int model;
+	int workers;	/* number of workers of the prefork model */
+	int ttl;		/* lifetime of file cache entries in seconds */
+	int cache_mem;	/* megabytes for file bodies in the cache */
 };
 
 #endif /* !_SWS_H_ */
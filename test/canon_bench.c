@@ -0,0 +1,89 @@
+/*
+ * This program times canon_path() and the code it replaced on a few
+ * request paths, and prints the nanoseconds each takes per path:
+ *
+ *	canon_bench [-n count]
+ *
+ * The old code is timed as canon_old.c runs it, which copies the
+ * file name and clean path out of its JSTRING at the end. There's
+ * no user directory: canon_path() opens it, which is timed then.
+ */
+#include <sys/types.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../macros.h"
+#include "../http.h"
+#include "../canon.h"
+#include "canon_old.h"
+
+#define CANON_BENCH_ROOT	"/srv/www"
+
+static double elapsed(struct timespec *);
+
+static char *paths[] = {
+	"/index.html",
+	"/assets/css/site.min.css",
+	"/a/b/../c/./d//e.png",
+	"/public/photos/2024/../2025/img.jpg",
+	NULL
+};
+
+int
+main(int argc, char *argv[])
+{
+	static char buf[CANON_SIZE], file[CANON_SIZE], url[CANON_SIZE];
+	struct timespec start;
+	struct canon c;
+	double old, new;
+	long i, count;
+	int k, ch;
+
+	count = 1000000;
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			count = strtol(optarg, NULL, 10);
+			break;
+		default:
+			(void)fprintf(stderr, "usage: canon_bench [-n count]\n");
+			return EXIT_FAILURE;
+		}
+	}
+	if (count <= 0)
+		count = 1;
+
+	(void)canon_init(CANON_BENCH_ROOT);
+	for (k = 0; paths[k] != NULL; k++) {
+		(void)clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; i++)
+			(void)old_canon(paths[k], CANON_BENCH_ROOT, file, url,
+			    sizeof(file));
+		old = elapsed(&start) / count;
+
+		(void)clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; i++)
+			(void)canon_path(paths[k], buf, sizeof(buf), &c);
+		new = elapsed(&start) / count;
+
+		(void)printf("%-36s old %7.1f ns  new %6.1f ns\n",
+		    paths[k], old, new);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* the nanoseconds since start */
+static double
+elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e9 +
+	    (now.tv_nsec - start->tv_nsec);
+}
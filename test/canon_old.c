@@ -0,0 +1,134 @@
+/*
+ * The request path handling canon_path() replaced, kept as it was
+ * to check the new one against: trim_uri() and replace_userdir()
+ * from net.c, and the content directory put in front of the path
+ * when it isn't a user directory.
+ */
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../macros.h"
+#include "../http.h"
+#include "../jstring.h"
+#include "../arraylist.h"
+#include "canon_old.h"
+
+static int trim_uri(JSTRING *);
+static BOOL replace_userdir(JSTRING *);
+
+/*
+ * This function writes the file of the request path path under
+ * the content directory root to file, and the clean path to url,
+ * or "" for a user directory; both have size bytes. It returns 0
+ * or Forbidden, as trim_uri() did.
+ */
+int
+old_canon(char *path, char *root, char *file, char *url, size_t size)
+{
+	JSTRING *u;
+	int status;
+
+	u = jstr_create(path);
+	if ((status = trim_uri(u)) != 0)
+		return status;
+
+	(void)snprintf(url, size, "%s", jstr_cstr(u));
+	if (replace_userdir(u) == FALSE)
+		jstr_insert(u, 0, root);
+	else
+		url[0] = '\0';
+	(void)snprintf(file, size, "%s", jstr_cstr(u));
+	jstr_free(u);
+	return 0;
+}
+
+static int 
+trim_uri(JSTRING *uri)
+{
+	size_t i;
+	JSTRING *temp, *last;
+	ARRAYLIST *list;
+	
+	list = arrlist_create();
+	
+	/* uri must start with '/' */
+	arrlist_add(list, jstr_create("/"));
+	
+	temp = jstr_create("");
+	for (i = 1; i < jstr_length(uri); i++) {
+		jstr_append(temp, jstr_charat(uri, i));
+		if (jstr_charat(uri, i) == '/' || 
+			i == jstr_length(uri) - 1) {
+			if (jstr_equals(temp, "..") == 0 ||
+				jstr_equals(temp, "../") == 0) {
+				
+				if (arrlist_size(list) > 1) {
+					last = (JSTRING *)arrlist_remove(list, 
+							arrlist_size(list) - 1);
+					jstr_free(last);
+				} else
+					return Forbidden;
+				
+				jstr_free(temp);
+			} else if (jstr_equals(temp, ".") == 0 ||
+					   jstr_equals(temp, "./") == 0 ||
+					   jstr_equals(temp, "/") == 0) {
+				jstr_free(temp);
+			} else {
+				arrlist_add(list, temp);
+			}
+			temp = jstr_create("");
+		}
+	}
+	jstr_free(temp);
+	
+	jstr_trunc(uri, jstr_length(uri), 0);
+	for (i = 0; i < arrlist_size(list); i++) {
+		temp = (JSTRING *)arrlist_get(list, i);
+		jstr_concat(uri, jstr_cstr(temp));
+		jstr_free(temp);
+	}
+		
+	arrlist_free(list);
+	
+	return 0;
+}
+
+/*
+ * This function replace /~<user> with /home/<user>/sws/,
+ * and return TRUE if replacement successes, or return 
+ * FALSE if the path doesn't need to be replaced.
+ */
+static BOOL
+replace_userdir(JSTRING *path)
+{
+	size_t i;
+	JSTRING *user;
+	
+	if (jstr_length(path) <= 2)
+		return FALSE;
+	
+	if (strncmp(jstr_cstr(path), "/~/", 3) == 0)
+		return FALSE;
+	
+	if (strncmp(jstr_cstr(path), "/~", 2) != 0)
+		return FALSE;
+	
+	user = jstr_create("/home/");
+	for (i = 2; 
+		 i < jstr_length(path) && jstr_charat(path, i) != '/';
+		 i++)
+		jstr_append(user, jstr_charat(path, i));
+	jstr_concat(user, "/sws");
+    
+	if (i >= jstr_length(path) || jstr_charat(path, i) != '/')
+		jstr_append(user, '/');
+	
+	jstr_trunc(path, i, jstr_length(path) - i);
+	jstr_insert(path, 0, jstr_cstr(user));
+	
+	jstr_free(user);
+	return TRUE;
+}
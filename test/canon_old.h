@@ -0,0 +1,6 @@
+#ifndef _CANON_OLD_H_
+#define _CANON_OLD_H_
+
+int old_canon(char *, char *, char *, char *, size_t);
+
+#endif /* !_CANON_OLD_H_ */
@@ -0,0 +1,279 @@
+/*
+ * This program checks canon_path() against the code it replaced:
+ *
+ *	canon_test [-n count] [-s seed] reference
+ *	canon_test -g > reference
+ *
+ * Each line of the reference file is a request path with the
+ * status, file name and clean path trim_uri() and replace_userdir()
+ * gave for it under CANON_TEST_ROOT, separated by tabs; the clean
+ * path is empty for a user directory. -g writes them, from the old
+ * code in canon_old.c, for the edge cases below and random paths.
+ *
+ * Then count random paths, made of the segments below under a few
+ * roots, are passed to both: they must agree, and the clean path
+ * must have no empty, "." or ".." segment and stay the same when
+ * it's cleaned again.
+ */
+#include <sys/types.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../macros.h"
+#include "../http.h"
+#include "../canon.h"
+#include "canon_old.h"
+
+#define CANON_TEST_ROOT		"/srv/www"
+#define CANON_TEST_RANDOM	2000	/* random paths written by -g */
+#define CANON_TEST_SEGMENTS	8	/* segments of a random path at most */
+#define CANON_TEST_LINE		1024
+
+static void generate(void);
+static void reference(char *);
+static void random_path(char *);
+static int check(char *, int, char *, char *);
+static int check_clean(char *, char *);
+static BOOL is_clean(char *);
+static char *field(char **);
+
+static char *edges[] = {
+	"/", "//", "/.", "/..", "/./", "/../", "/...", "/.../x",
+	"/a", "/a/", "/a//b", "/a/./b", "/a/b/.", "/a/b/..", "/a/..",
+	"/a/../", "/a/../..", "/a/b/c/../../../..", "/a/../b/../c",
+	"/..a", "/a..", "/.a/.b", "/a/%2e%2e/b", "/a/~bob",
+	"/~", "/~/", "/~/x", "/~/..", "/~bob", "/~bob/", "/~bob/x",
+	"/~bob/x/../y", "/~bob/..", "/~bob/../..", "/~bob/../x",
+	"/~bob/./", "/~bob//x", "/~./x", "/~../x", "/~~/x",
+	"/cgi-bin/x.cgi", "/cgi-bin/../x.cgi", "/~bob/cgi-bin/x.cgi",
+	NULL
+};
+
+static char *segments[] = {
+	"a", "bb", "index.html", "~bob", "~al", "~", ".", "..", "...",
+	"", "cgi-bin", "x.cgi", "%2e", "\xc3\xa9"
+};
+
+int
+main(int argc, char *argv[])
+{
+	static char *roots[] = { CANON_TEST_ROOT, "", "/r" };
+	char line[CANON_TEST_LINE], path[CANON_TEST_LINE];
+	char *p, *status, *file, *url, *root;
+	long i, count, cases;
+	unsigned seed;
+	FILE *fp;
+	int ch;
+
+	count = 1000000;
+	seed = (unsigned)time(NULL);
+	while ((ch = getopt(argc, argv, "gn:s:")) != -1) {
+		switch (ch) {
+		case 'g':
+			generate();
+			return EXIT_SUCCESS;
+		case 'n':
+			count = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			seed = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		default:
+			(void)fprintf(stderr, "usage: canon_test "
+			    "[-n count] [-s seed] reference\n"
+			    "       canon_test -g\n");
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		(void)fprintf(stderr, "canon_test: no reference file\n");
+		return EXIT_FAILURE;
+	}
+
+	/* the root needn't exist, only user directories are opened */
+	(void)canon_init(CANON_TEST_ROOT);
+	if ((fp = fopen(argv[optind], "r")) == NULL) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+	for (cases = 0; fgets(line, sizeof(line), fp) != NULL; cases++) {
+		line[strcspn(line, "\n")] = '\0';
+		p = line;
+		status = field(&p);
+		(void)snprintf(path, sizeof(path), "%s", field(&p));
+		file = field(&p);
+		url = field(&p);
+		if (check(path, atoi(status), file, url) != 0)
+			return EXIT_FAILURE;
+	}
+	(void)fclose(fp);
+
+	srand(seed);
+	for (i = 0; i < count; i++) {
+		root = roots[i / (count / 3 + 1)];
+		if (i % (count / 3 + 1) == 0)
+			(void)canon_init(root);
+		random_path(path);
+		if (check_clean(path, root) != 0) {
+			(void)fprintf(stderr, "canon_test: seed %u\n", seed);
+			return EXIT_FAILURE;
+		}
+	}
+
+	(void)printf("canon_test: %ld reference cases, "
+	    "%ld random paths with seed %u: ok\n", cases, count, seed);
+	return EXIT_SUCCESS;
+}
+
+/* write the reference cases from the old code to stdout */
+static void
+generate(void)
+{
+	char path[CANON_TEST_LINE];
+	int i;
+
+	for (i = 0; edges[i] != NULL; i++)
+		reference(edges[i]);
+	srand(1);
+	for (i = 0; i < CANON_TEST_RANDOM; i++) {
+		random_path(path);
+		reference(path);
+	}
+}
+
+/* write the line of the reference file for the request path path */
+static void
+reference(char *path)
+{
+	static char file[CANON_SIZE], url[CANON_SIZE];
+	int status;
+
+	status = old_canon(path, CANON_TEST_ROOT, file, url, sizeof(file));
+	if (status != 0)
+		file[0] = url[0] = '\0';
+	(void)printf("%d\t%s\t%s\t%s\n", status, path, file, url);
+}
+
+/* write a request path of random segments, ending with '/' or not */
+static void
+random_path(char *path)
+{
+	size_t n, len;
+	int i, count;
+	char *s;
+
+	path[0] = '/';
+	len = 1;
+	count = rand() % (CANON_TEST_SEGMENTS + 1);
+	for (i = 0; i < count; i++) {
+		s = segments[rand() % (sizeof(segments) / sizeof(segments[0]))];
+		n = strlen(s);
+		(void)memcpy(path + len, s, n);
+		len += n;
+		if (i < count - 1 || rand() % 2 == 0)
+			path[len++] = '/';
+		if (rand() % 5 == 0)
+			path[len++] = '/';
+	}
+	path[len] = '\0';
+}
+
+/*
+ * This function checks canon_path() on the request path path
+ * against the status, file name and clean path the old code gave,
+ * url being "" for a user directory. It returns 0 if they agree.
+ */
+static int
+check(char *path, int status, char *file, char *url)
+{
+	static char buf[CANON_SIZE];
+	struct canon c;
+	int r;
+
+	c.url = buf;
+	r = canon_path(path, buf, sizeof(buf), &c);
+
+	/* the old code found a missing user directory by stat(2) later */
+	if (r != 0 && c.url == NULL && status == 0)
+		r = 0;
+	if (r == status && (r != 0 || (strcmp(c.file, file) == 0 &&
+	    strcmp(c.url != NULL ? c.url : "", url) == 0)))
+		return 0;
+
+	(void)fprintf(stderr, "canon_test: [%s] gives %d [%s] [%s], "
+	    "was %d [%s] [%s]\n", path, r, r == 0 ? c.file : "",
+	    r == 0 && c.url != NULL ? c.url : "", status, file, url);
+	return -1;
+}
+
+/*
+ * This function checks canon_path() on the request path path
+ * against the old code under the content directory root, which
+ * canon_init() was given, and that the clean path is clean. It
+ * returns 0 if it is.
+ */
+static int
+check_clean(char *path, char *root)
+{
+	static char file[CANON_SIZE], url[CANON_SIZE], buf[CANON_SIZE];
+	struct canon c;
+	int status;
+
+	status = old_canon(path, root, file, url, sizeof(file));
+	if (status != 0)
+		file[0] = url[0] = '\0';
+	if (check(path, status, file, url) != 0)
+		return -1;
+	if (status != 0 || url[0] == '\0')
+		return 0;
+
+	if (is_clean(url) == FALSE) {
+		(void)fprintf(stderr, "canon_test: [%s] gives [%s]\n",
+		    path, url);
+		return -1;
+	}
+	if (canon_path(url, buf, sizeof(buf), &c) != 0 ||
+	    strcmp(c.url, url) != 0) {
+		(void)fprintf(stderr, "canon_test: [%s] gives [%s], "
+		    "then [%s]\n", path, url, c.url);
+		return -1;
+	}
+	return 0;
+}
+
+/* whether url starts with '/' and has no empty, "." or ".." segment */
+static BOOL
+is_clean(char *url)
+{
+	char *p, *q;
+	size_t n;
+
+	if (url[0] != '/')
+		return FALSE;
+	for (p = url + 1; *p != '\0'; p = q + (*q == '/')) {
+		q = p + strcspn(p, "/");
+		n = (size_t)(q - p);
+		if (n == 0 || (n == 1 && p[0] == '.') ||
+		    (n == 2 && p[0] == '.' && p[1] == '.'))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* the next field of the line at *p, which is moved past it */
+static char *
+field(char **p)
+{
+	char *f;
+
+	f = *p;
+	*p += strcspn(*p, "\t");
+	if (**p == '\t')
+		*(*p)++ = '\0';
+	return f;
+}
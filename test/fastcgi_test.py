@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+#
+# This program checks the FastCGI workers of sws (fastcgi.c) with
+# responder.fcgi, in each model given or all of them:
+#
+#	fastcgi_test.py sws [model ...]
+#
+# sws has to be built with a MAX_CGI_EXEC_TIME of EXEC_TIME, see the
+# fastcgi-test target of the Makefiles, so a hung worker gives a 504
+# in seconds. For each model a server is started with the scripts of
+# SCRIPTS and checked for:
+#
+#	- the parameters of a request and a body of several records;
+#	- a worker replaced after the number of requests of its line;
+#	- requests queued for a busy worker, then a 503 after
+#	  FCGI_QUEUE_TIMEOUT seconds;
+#	- a 502 when a worker dies, and a new one for the next request;
+#	- a 504 when a worker takes longer than EXEC_TIME.
+#
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+EXEC_TIME = 8
+QUEUE_TIMEOUT = 10	# FCGI_QUEUE_TIMEOUT of fastcgi.h
+MODELS = ["event", "uring", "fork", "prefork"]
+
+# script, minimum and maximum workers, requests until one is replaced
+SCRIPTS = [
+    ("app.fcgi", 1, 2, 0),
+    ("recycle.fcgi", 1, 1, 3),
+    ("one.fcgi", 1, 1, 0),
+    ("slow.fcgi", 1, 1, 0),
+]
+
+
+def get(port, path, headers=""):
+    """Ask for path, return the status and the body."""
+    s = socket.create_connection(("127.0.0.1", port))
+    s.settimeout(EXEC_TIME + QUEUE_TIMEOUT + 10)
+    s.sendall(("GET %s HTTP/1.1\r\nHost: test\r\n%s"
+               "Connection: close\r\n\r\n" % (path, headers)).encode())
+    data = b""
+    while True:
+        b = s.recv(65536)
+        if not b:
+            break
+        data += b
+    s.close()
+    head, _, body = data.partition(b"\r\n\r\n")
+    return int(head.split()[1]), body
+
+
+def fields(body):
+    """The name=value lines of an answer of responder.fcgi."""
+    return dict(l.split("=", 1) for l in body.decode().splitlines()
+                if "=" in l)
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def wait_port(port):
+    for _ in range(50):
+        try:
+            socket.create_connection(("127.0.0.1", port)).close()
+            return
+        except OSError:
+            time.sleep(0.1)
+    raise RuntimeError("sws doesn't listen on %d" % port)
+
+
+def check(name, ok, what):
+    if not ok:
+        raise AssertionError("%s: %s" % (name, what))
+
+
+def test_params(port):
+    status, body = get(port, "/cgi-bin/app.fcgi/x/y?a=b",
+                       "User-Agent: fastcgi_test\r\n")
+    env = fields(body)
+    check("params", status == 200, "status %d" % status)
+    check("params", env.get("PATH_INFO") == "/x/y", env)
+    check("params", env.get("QUERY_STRING") == "a=b", env)
+    check("params", env.get("HTTP_USER_AGENT") == "fastcgi_test", env)
+
+    status, body = get(port, "/cgi-bin/app.fcgi?big")
+    check("big", status == 200 and body == b"x" * 200000,
+          "status %d, %d bytes" % (status, len(body)))
+
+
+def test_recycle(port):
+    answers = [fields(get(port, "/cgi-bin/recycle.fcgi")[1])
+               for _ in range(7)]
+    served = [int(a["served"]) for a in answers]
+    pids = [a["pid"] for a in answers]
+    check("recycle", served == [1, 2, 3, 1, 2, 3, 1], served)
+    check("recycle", pids[0] == pids[2] != pids[3] == pids[5] != pids[6],
+          pids)
+
+
+def test_queue(port):
+    # one worker busy for 4 s: the third waits 8 s, the fourth 12 s
+    statuses = [None] * 4
+
+    def ask(i):
+        statuses[i] = get(port, "/cgi-bin/one.fcgi?sleep=4")[0]
+
+    threads = []
+    for i in range(4):
+        threads.append(threading.Thread(target=ask, args=(i,)))
+        threads[-1].start()
+        time.sleep(0.2)
+    for t in threads:
+        t.join()
+    check("queue", statuses == [200, 200, 200, 503], statuses)
+
+
+def test_die(port):
+    status, _ = get(port, "/cgi-bin/app.fcgi?die")
+    check("die", status == 502, "status %d" % status)
+    status, _ = get(port, "/cgi-bin/app.fcgi")
+    check("die", status == 200, "then status %d" % status)
+
+
+def test_timeout(port, result):
+    start = time.time()
+    status, _ = get(port, "/cgi-bin/slow.fcgi?sleep=%d" % (EXEC_TIME * 3))
+    took = time.time() - start
+    if status != 504 or took > EXEC_TIME + 2:
+        result.append("timeout: status %d after %.1f s" % (status, took))
+
+
+def run(sws, model, cgi, www, conf):
+    port = free_port()
+    subprocess.check_call([sws, "-m", model, "-c", cgi, "-f", conf,
+                           "-p", str(port), www])
+    try:
+        wait_port(port)
+        test_params(port)
+        test_recycle(port)
+        test_die(port)
+        # the 504 takes as long as the queue, they run together
+        result = []
+        t = threading.Thread(target=test_timeout, args=(port, result))
+        t.start()
+        test_queue(port)
+        t.join()
+        check("timeout", not result, result)
+    finally:
+        subprocess.call(["pkill", "-f", "%s .*-p %d " % (sws, port)])
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit("usage: fastcgi_test.py sws [model ...]")
+    sws = os.path.abspath(sys.argv[1])
+    models = sys.argv[2:] or MODELS
+
+    tmp = tempfile.mkdtemp()
+    try:
+        cgi = os.path.join(tmp, "cgi")
+        www = os.path.join(tmp, "www")
+        os.mkdir(cgi)
+        os.mkdir(www)
+        responder = os.path.join(os.path.dirname(__file__), "responder.fcgi")
+        conf = os.path.join(tmp, "scripts")
+        with open(conf, "w") as f:
+            for name, low, high, requests in SCRIPTS:
+                shutil.copy(responder, os.path.join(cgi, name))
+                os.chmod(os.path.join(cgi, name), 0o755)
+                f.write("/%s %d %d %d\n" % (name, low, high, requests))
+
+        failed = 0
+        for model in models:
+            try:
+                run(sws, model, cgi, www, conf)
+                print("fastcgi_test: %s: ok" % model)
+            except Exception as e:
+                print("fastcgi_test: %s: %s" % (model, e))
+                failed += 1
+    finally:
+        shutil.rmtree(tmp)
+    sys.exit(1 if failed else 0)
+
+
+main()
@@ -0,0 +1,811 @@
+/*
+ * This program contains the io_uring(7) loop of the server. It
+ * serves connections like the epoll loop in event.c, but instead
+ * of waiting for sockets to become ready, the operations are
+ * queued to the kernel and submitted together with a single
+ * io_uring_enter(2) per round:
+ *
+ *  - one multishot accept delivers all new connections,
+ *  - request heads are received into the connection buffer,
+ *  - queued responses are written with writev, and
+ *  - file bodies are read into registered buffers and written
+ *    to the client from there.
+ *
+ * Client sockets are registered as fixed files. The ring is set
+ * up with the raw system calls, so no library is needed.
+ */
+#ifdef _LINUX_
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#include <bsd/stdlib.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jstring.h"
+#include "macros.h"
+#include "sws.h"
+#include "http.h"
+#include "conn.h"
+#include "net.h"
+#include "fcache.h"
+#include "uring.h"
+
+/* operations, kept in the low byte of user_data */
+#define OP_ACCEPT		1
+#define OP_TIMEOUT		2
+#define OP_CANCEL		3
+#define OP_WATCH		8
+#define OP_RECV			4
+#define OP_WRITE		5
+#define OP_READ_FILE	6
+#define OP_WRITE_FILE	7
+
+#define USER_DATA(slot, op)	((__u64)(slot) << 8 | (op))
+
+/*
+ * uconn
+ * The io_uring state of one connection. slot is its index in
+ * the fixed file table. File data is staged in the registered
+ * buffer buf_index, or in buf when all of them are in use.
+ */
+struct uconn {
+	struct conn *c;
+	int slot;
+	BOOL fixed;
+	int buf_index;
+	char *buf;
+	char *stage;
+	size_t stage_off;
+	size_t stage_len;
+	struct iovec iov[CONN_IOV_MAX];
+	struct uconn *next_free;
+};
+
+struct ring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	unsigned tail;		/* sq tail not yet published */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+};
+
+/*
+ * completion
+ * A completion taken off the queue, to be handled by the loop.
+ * The queue is emptied into a list of them when it's full while
+ * an operation is queued, in the middle of handling another.
+ */
+struct completion {
+	__u64 user_data;
+	int res;
+	unsigned flags;
+};
+
+static BOOL setup_ring(void);
+static void setup_files(void);
+static void setup_buffers(void);
+static struct io_uring_sqe *get_sqe(void);
+static BOOL submit(unsigned);
+static void reap(void);
+static void handle_cqe(struct swsopt *, __u64, int, unsigned);
+static void arm_accept(void);
+static void stop_accepting(void);
+static void add_conn(struct swsopt *, int);
+static void arm_recv(struct swsopt *, struct uconn *);
+static void serve_conn(struct swsopt *, struct uconn *, int);
+static void send_output(struct swsopt *, struct uconn *);
+static void set_fd(struct io_uring_sqe *, struct uconn *);
+static void get_buf(struct uconn *);
+static void put_buf(struct uconn *);
+static void close_conn(struct uconn *);
+static void arm_watch(void);
+static void arm_timeout(void);
+static void close_idle(void);
+static void perror_exit(char *);
+
+static struct ring ring;
+static struct completion *done;
+static size_t ndone;
+static size_t done_size;
+static int listen_fd;
+static int nconns;
+static int max_conns;
+static BOOL accepting;
+static BOOL accept_armed;
+static BOOL multishot;
+static BOOL multipoll;
+static int watch_fd;
+static BOOL fixed_files;
+
+static struct uconn *uconns;
+static struct uconn *free_uconns;
+
+static char *bufs;
+static int free_bufs[URING_NBUFS];
+static int nfree_bufs;
+
+static struct __kernel_timespec tick = { 1, 0 };
+
+/*
+ * This function runs the io_uring loop on the listening
+ * socket sfd. It only returns, with FALSE, if the ring
+ * can't be set up.
+ */
+BOOL
+uring_loop(struct swsopt *so, int sfd)
+{
+	int i;
+	size_t n;
+	__u64 user_data;
+	int res;
+	unsigned flags;
+
+	if (setup_ring() == FALSE)
+		return FALSE;
+
+	listen_fd = sfd;
+
+	/* -d only allows one connection at a time */
+	max_conns = so->opt['d'] == TRUE ? 1 : URING_MAX_CONNS;
+
+	MALLOC(uconns, struct uconn, URING_MAX_CONNS);
+	free_uconns = NULL;
+	for (i = URING_MAX_CONNS - 1; i >= 0; i--) {
+		memset(&uconns[i], 0, sizeof(struct uconn));
+		uconns[i].slot = i;
+		uconns[i].buf_index = -1;
+		uconns[i].next_free = free_uconns;
+		free_uconns = &uconns[i];
+	}
+
+	setup_files();
+	setup_buffers();
+
+	/*
+	 * Writes to a closed connection must not kill the
+	 * server, and cgi children are reaped automatically.
+	 */
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR ||
+	    signal(SIGCHLD, SIG_IGN) == SIG_ERR)
+		perror_exit("signal error");
+
+	multishot = TRUE;
+	accepting = TRUE;
+	arm_accept();
+	arm_timeout();
+
+	/* changes of cached files, see fcache.c */
+	multipoll = TRUE;
+	if ((watch_fd = fcache_watch()) != -1)
+		arm_watch();
+
+	for (;;) {
+		(void)submit(1);
+		fcache_report();
+
+		/* handling one may queue more, which are handled in turn */
+		reap();
+		for (n = 0; n < ndone; n++) {
+			user_data = done[n].user_data;
+			res = done[n].res;
+			flags = done[n].flags;
+			handle_cqe(so, user_data, res, flags);
+		}
+		ndone = 0;
+	}
+}
+
+static BOOL
+setup_ring(void)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring.fd == -1)
+		return FALSE;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size)
+		sq_size = cq_size;
+
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+	          MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		(void)close(ring.fd);
+		return FALSE;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+		          MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			(void)close(ring.fd);
+			return FALSE;
+		}
+	}
+
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                 ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		(void)close(ring.fd);
+		return FALSE;
+	}
+
+	ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring.sq_entries = p.sq_entries;
+	ring.tail = *ring.sq_tail;
+
+	ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return TRUE;
+}
+
+/* reserve an empty fixed file slot for every connection */
+static void
+setup_files(void)
+{
+	int *fds;
+	int i;
+
+	MALLOC(fds, int, URING_MAX_CONNS);
+	for (i = 0; i < URING_MAX_CONNS; i++)
+		fds[i] = -1;
+
+	fixed_files = syscall(__NR_io_uring_register, ring.fd,
+	                      IORING_REGISTER_FILES, fds, URING_MAX_CONNS) == 0;
+	free(fds);
+}
+
+/*
+ * The buffers must not be shared with cgi children, or
+ * copy-on-write would detach them from the ring.
+ */
+static void
+setup_buffers(void)
+{
+	struct iovec iov[URING_NBUFS];
+	int i;
+
+	nfree_bufs = 0;
+	bufs = mmap(NULL, URING_NBUFS * URING_BUFSIZE, PROT_READ | PROT_WRITE,
+	            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufs == MAP_FAILED)
+		return;
+	(void)madvise(bufs, URING_NBUFS * URING_BUFSIZE, MADV_DONTFORK);
+
+	for (i = 0; i < URING_NBUFS; i++) {
+		iov[i].iov_base = bufs + i * URING_BUFSIZE;
+		iov[i].iov_len = URING_BUFSIZE;
+	}
+
+	/* without registered buffers every connection uses its own */
+	if (syscall(__NR_io_uring_register, ring.fd,
+	            IORING_REGISTER_BUFFERS, iov, URING_NBUFS) == -1) {
+		(void)munmap(bufs, URING_NBUFS * URING_BUFSIZE);
+		return;
+	}
+
+	for (i = 0; i < URING_NBUFS; i++)
+		free_bufs[nfree_bufs++] = i;
+}
+
+static struct io_uring_sqe *
+get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned index;
+
+	/*
+	 * The queue is full: it's handed to the kernel until it took
+	 * some, as an entry it hasn't read must not be written over.
+	 * While the completion queue is full it takes none, that one
+	 * is emptied first.
+	 */
+	while (ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) ==
+	    ring.sq_entries)
+		if (submit(0) == FALSE)
+			reap();
+
+	index = ring.tail & *ring.sq_mask;
+	sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring.sq_array[index] = index;
+	ring.tail++;
+
+	return sqe;
+}
+
+/*
+ * This function submits all queued operations and waits
+ * until at least wait of them are completed. It returns
+ * FALSE if the kernel is busy as the completion queue is
+ * full.
+ */
+static BOOL
+submit(unsigned wait)
+{
+	unsigned pending;
+
+	__atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+
+	for (;;) {
+		pending = ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+		if (syscall(__NR_io_uring_enter, ring.fd, pending, wait,
+		            wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0) != -1)
+			return TRUE;
+		/* a signal may have asked for something */
+		if (errno == EINTR && wait > 0)
+			return TRUE;
+		if (errno == EINTR)
+			continue;
+		/* the completion queue is full, it's emptied first */
+		if (errno == EAGAIN || errno == EBUSY)
+			return FALSE;
+		perror_exit("io_uring_enter error");
+	}
+}
+
+/* take the completions off the queue, to the end of the list */
+static void
+reap(void)
+{
+	unsigned head, tail;
+	struct io_uring_cqe *cqe;
+
+	head = *ring.cq_head;
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	if (ndone + (tail - head) > done_size) {
+		done_size = ndone + (tail - head);
+		REALLOC(done, struct completion, done_size);
+	}
+	for (; head != tail; head++) {
+		cqe = &ring.cqes[head & *ring.cq_mask];
+		done[ndone].user_data = cqe->user_data;
+		done[ndone].res = cqe->res;
+		done[ndone].flags = cqe->flags;
+		ndone++;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void
+handle_cqe(struct swsopt *so, __u64 user_data, int res, unsigned flags)
+{
+	struct uconn *u;
+	struct conn_seg *seg;
+
+	switch (user_data & 0xff) {
+	case OP_ACCEPT:
+		if ((flags & IORING_CQE_F_MORE) == 0)
+			accept_armed = FALSE;
+		if (res >= 0)
+			add_conn(so, res);
+		else if (res == -EINVAL && multishot == TRUE)
+			multishot = FALSE;	/* kernel older than 5.19 */
+		else if ((res == -EMFILE || res == -ENFILE) && nconns > 0)
+			stop_accepting();	/* wait until a connection was closed */
+		if (accepting == TRUE && accept_armed == FALSE)
+			arm_accept();
+		return;
+	case OP_TIMEOUT:
+		close_idle();
+		arm_timeout();
+		return;
+	case OP_WATCH:
+		if (res == -EINVAL && multipoll == TRUE)
+			multipoll = FALSE;	/* kernel older than 5.13 */
+		else if (res > 0)
+			fcache_events();
+		if ((flags & IORING_CQE_F_MORE) == 0)
+			arm_watch();
+		return;
+	case OP_CANCEL:
+		return;
+	}
+
+	u = &uconns[user_data >> 8];
+	if (u->c == NULL)
+		return;
+	conn_touch(u->c);
+
+	switch (user_data & 0xff) {
+	case OP_RECV:
+		if (res < 0)
+			serve_conn(so, u, CONN_ERROR);
+		else if (res == 0)
+			serve_conn(so, u, CONN_EOF);
+		else if ((res = conn_received(u->c, res)) == CONN_AGAIN)
+			arm_recv(so, u);
+		else
+			serve_conn(so, u, res);
+		break;
+	case OP_WRITE:
+		if (res < 0) {
+			close_conn(u);
+			return;
+		}
+		conn_written(u->c, res);
+		send_output(so, u);
+		break;
+	case OP_READ_FILE:
+		/* the file shrank, the promised length can't be kept */
+		if (res <= 0) {
+			close_conn(u);
+			return;
+		}
+		seg = u->c->out_first;
+		seg->pos += res;
+		u->stage_off = 0;
+		u->stage_len = res;
+		send_output(so, u);
+		break;
+	case OP_WRITE_FILE:
+		if (res < 0) {
+			close_conn(u);
+			return;
+		}
+		u->stage_off += res;
+		send_output(so, u);
+		break;
+	}
+}
+
+static void
+arm_accept(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listen_fd;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	if (multishot == TRUE)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = USER_DATA(0, OP_ACCEPT);
+	accept_armed = TRUE;
+}
+
+static void
+stop_accepting(void)
+{
+	struct io_uring_sqe *sqe;
+
+	accepting = FALSE;
+	if (accept_armed == FALSE)
+		return;
+
+	sqe = get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = USER_DATA(0, OP_ACCEPT);
+	sqe->user_data = USER_DATA(0, OP_CANCEL);
+}
+
+/*
+ * This function starts serving the accepted socket fd. A
+ * connection accepted while the cancelled accept was still
+ * running is closed again.
+ */
+static void
+add_conn(struct swsopt *so, int fd)
+{
+	struct uconn *u;
+	struct sockaddr_storage client;
+	socklen_t client_len;
+	struct io_uring_files_update update;
+
+	client_len = sizeof(struct sockaddr_storage);
+	if (nconns == max_conns || free_uconns == NULL ||
+	    getpeername(fd, (struct sockaddr *)&client, &client_len) == -1) {
+		(void)close(fd);
+		return;
+	}
+
+	u = free_uconns;
+	free_uconns = u->next_free;
+	u->c = conn_create(fd, (struct sockaddr *)&client);
+	nconns++;
+
+	u->fixed = FALSE;
+	if (fixed_files == TRUE) {
+		memset(&update, 0, sizeof(update));
+		update.offset = u->slot;
+		update.fds = (__u64)(uintptr_t)&u->c->fd;
+		u->fixed = syscall(__NR_io_uring_register, ring.fd,
+		                   IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+	}
+
+	arm_recv(so, u);
+
+	if (nconns == max_conns)
+		stop_accepting();
+}
+
+/* receive the next part of the request head */
+static void
+arm_recv(struct swsopt *so, struct uconn *u)
+{
+	struct io_uring_sqe *sqe;
+	struct conn *c;
+	size_t room;
+
+	c = u->c;
+	if ((room = conn_room(c)) == 0) {
+		serve_conn(so, u, CONN_FULL);
+		return;
+	}
+
+	sqe = get_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	set_fd(sqe, u);
+	sqe->addr = (__u64)(uintptr_t)(c->head + c->head_len);
+	sqe->len = room;
+	sqe->user_data = USER_DATA(u->slot, OP_RECV);
+}
+
+/*
+ * This function handles the result of reading a request
+ * head. Like the epoll loop, all requests the client
+ * already sent are answered before the responses are
+ * written together.
+ */
+static void
+serve_conn(struct swsopt *so, struct uconn *u, int result)
+{
+	struct conn *c;
+	int n;
+
+	c = u->c;
+	if (result != CONN_DONE) {
+		if (result == CONN_ERROR || c->head_len == c->head_start)
+			close_conn(u);
+		else {
+			send_err(c, Bad_Request);
+			send_output(so, u);
+		}
+		return;
+	}
+
+	for (n = 1; ; n++) {
+		do_http(so, c);
+
+		/* the connection was handed over to a cgi child process */
+		if (c->state == CONN_CLOSING) {
+			close_conn(u);
+			return;
+		}
+
+		if (c->keep_alive == FALSE || conn_next(c) == FALSE ||
+		    n == CONN_PIPELINE_MAX)
+			break;
+	}
+
+	send_output(so, u);
+}
+
+/*
+ * This function queues the next write of the output queue.
+ * Once it's empty, the connection goes on with the next
+ * request or is closed.
+ */
+static void
+send_output(struct swsopt *so, struct uconn *u)
+{
+	struct io_uring_sqe *sqe;
+	struct conn *c;
+	struct conn_seg *seg;
+	size_t len;
+
+	c = u->c;
+	for (;;) {
+		if ((seg = c->out_first) == NULL)
+			break;
+
+		sqe = NULL;
+		if (seg->fd == -1) {
+			sqe = get_sqe();
+			sqe->opcode = IORING_OP_WRITEV;
+			set_fd(sqe, u);
+			sqe->addr = (__u64)(uintptr_t)u->iov;
+			sqe->len = conn_iov(c, u->iov, CONN_IOV_MAX);
+			sqe->user_data = USER_DATA(u->slot, OP_WRITE);
+		} else if (u->stage_off < u->stage_len) {
+			sqe = get_sqe();
+			sqe->opcode = u->buf_index != -1 ?
+			              IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+			set_fd(sqe, u);
+			sqe->addr = (__u64)(uintptr_t)(u->stage + u->stage_off);
+			sqe->len = u->stage_len - u->stage_off;
+			sqe->buf_index = u->buf_index != -1 ? u->buf_index : 0;
+			sqe->user_data = USER_DATA(u->slot, OP_WRITE_FILE);
+		} else if (seg->pos < seg->len) {
+			if (u->stage == NULL)
+				get_buf(u);
+
+			len = seg->len - seg->pos;
+			if (len > URING_BUFSIZE)
+				len = URING_BUFSIZE;
+
+			sqe = get_sqe();
+			sqe->opcode = u->buf_index != -1 ?
+			              IORING_OP_READ_FIXED : IORING_OP_READ;
+			sqe->fd = seg->fd;
+			sqe->off = seg->offset + seg->pos;
+			sqe->addr = (__u64)(uintptr_t)u->stage;
+			sqe->len = len;
+			sqe->buf_index = u->buf_index != -1 ? u->buf_index : 0;
+			sqe->user_data = USER_DATA(u->slot, OP_READ_FILE);
+		}
+		if (sqe != NULL)
+			return;
+
+		/* the file was sent completely */
+		conn_drop(c);
+		put_buf(u);
+	}
+
+	if (c->keep_alive == FALSE)
+		close_conn(u);
+	else if (c->head_end != 0)
+		serve_conn(so, u, CONN_DONE);
+	else
+		arm_recv(so, u);
+}
+
+static void
+set_fd(struct io_uring_sqe *sqe, struct uconn *u)
+{
+	if (u->fixed == TRUE) {
+		sqe->fd = u->slot;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else
+		sqe->fd = u->c->fd;
+}
+
+/* use a registered buffer to stage file data, if one is free */
+static void
+get_buf(struct uconn *u)
+{
+	if (nfree_bufs > 0) {
+		u->buf_index = free_bufs[--nfree_bufs];
+		u->stage = bufs + u->buf_index * URING_BUFSIZE;
+	} else {
+		if (u->buf == NULL)
+			MALLOC(u->buf, char, URING_BUFSIZE);
+		u->buf_index = -1;
+		u->stage = u->buf;
+	}
+	u->stage_off = 0;
+	u->stage_len = 0;
+}
+
+static void
+put_buf(struct uconn *u)
+{
+	if (u->buf_index != -1)
+		free_bufs[nfree_bufs++] = u->buf_index;
+	u->buf_index = -1;
+	u->stage = NULL;
+	u->stage_off = 0;
+	u->stage_len = 0;
+}
+
+/*
+ * No operation of the connection may be pending here. Its
+ * slot is cleared first, or the ring would keep the socket
+ * open.
+ */
+static void
+close_conn(struct uconn *u)
+{
+	struct io_uring_files_update update;
+	int fd;
+
+	if (u->fixed == TRUE) {
+		fd = -1;
+		memset(&update, 0, sizeof(update));
+		update.offset = u->slot;
+		update.fds = (__u64)(uintptr_t)&fd;
+		(void)syscall(__NR_io_uring_register, ring.fd,
+		              IORING_REGISTER_FILES_UPDATE, &update, 1);
+	}
+
+	put_buf(u);
+	conn_free(u->c);
+	u->c = NULL;
+	u->next_free = free_uconns;
+	free_uconns = u;
+	nconns--;
+
+	if (accepting == FALSE && nconns < max_conns) {
+		accepting = TRUE;
+		if (accept_armed == FALSE)
+			arm_accept();
+	}
+}
+
+static void
+arm_watch(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = watch_fd;
+	sqe->poll32_events = POLLIN;
+	if (multipoll == TRUE)
+		sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = USER_DATA(0, OP_WATCH);
+}
+
+static void
+arm_timeout(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (__u64)(uintptr_t)&tick;
+	sqe->len = 1;
+	sqe->user_data = USER_DATA(0, OP_TIMEOUT);
+}
+
+/*
+ * Idle connections still have an operation pending, so they
+ * are shut down; the operation fails and closes them.
+ */
+static void
+close_idle(void)
+{
+	struct conn *c;
+	time_t now;
+
+	now = time(NULL);
+	for (c = conn_oldest(); c != NULL &&
+	     now - c->last_active >= HTTP_KEEPALIVE_TIMEOUT; c = c->prev)
+		(void)shutdown(c->fd, SHUT_RDWR);
+}
+
+static void
+perror_exit(char *message)
+{
+	fprintf(stderr, "%s: ", getprogname());
+	perror(message);
+	exit(EXIT_FAILURE);
+}
+
+#endif /* _LINUX_ */
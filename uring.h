@@ -0,0 +1,20 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+/* submission queue entries, the completion queue is twice as large */
+#define URING_ENTRIES	1024
+
+/* connections served at once, one fixed file slot each */
+#define URING_MAX_CONNS	1024
+
+/* registered buffers used to send files */
+#define URING_NBUFS		32
+#define URING_BUFSIZE	32768
+
+/*
+ * serve all connections of the listening socket in this process
+ * with io_uring(7); returns FALSE if the kernel doesn't support it
+ */
+BOOL uring_loop(struct swsopt *, int);
+
+#endif /* !_URING_H_ */